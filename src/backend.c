@@ -0,0 +1,41 @@
+#include "backend.h"
+
+#include <string.h>
+
+static bool signature_matches(const struct imv_signature *sig,
+    const unsigned char *header, size_t len)
+{
+  if (sig->offset + sig->len > len) {
+    return false;
+  }
+
+  if (!sig->search) {
+    return !memcmp(header + sig->offset, sig->magic, sig->len);
+  }
+
+  const size_t last = len - sig->len;
+  for (size_t i = sig->offset; i <= last; ++i) {
+    if (header[i] == (unsigned char)sig->magic[0]
+        && !memcmp(header + i, sig->magic, sig->len)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool imv_backend_accepts(const struct imv_backend *backend, const void *header,
+    size_t len)
+{
+  if (!backend->signatures) {
+    return true;
+  }
+
+  for (const struct imv_signature *sig = backend->signatures; sig->magic; ++sig) {
+    if (signature_matches(sig, header, len)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -1,9 +1,14 @@
 #ifndef IMV_BACKEND_H
 #define IMV_BACKEND_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 struct imv_source;
+struct imv_stream;
+
+/* Number of bytes from the start of a file used to identify its format */
+#define IMV_BACKEND_HEADER_LEN 4096
 
 enum backend_result {
 
@@ -19,6 +24,25 @@ enum backend_result {
   BACKEND_UNSUPPORTED = 2,
 };
 
+/* A sequence of bytes that identifies a file format, such as a PNG file's
+ * "\x89PNG" prefix.
+ */
+struct imv_signature {
+  /* the bytes to look for, NULL terminates a list of signatures */
+  const char *magic;
+  size_t len;
+
+  /* where in the file the bytes appear */
+  size_t offset;
+
+  /* match anywhere in the header from offset onwards, instead of only at it */
+  bool search;
+};
+
+/* Convenience for declaring a signature from a string literal */
+#define IMV_SIGNATURE(bytes, at) \
+  { .magic = (bytes), .len = sizeof(bytes) - 1, .offset = (at) }
+
 /* A backend is responsible for taking a path, or a raw data pointer, and
  * converting that into an imv_source. Each backend may be powered by a
  * different image library and support different image formats.
@@ -37,6 +61,18 @@ struct imv_backend {
   /* License the backend is used under */
   const char *license;
 
+  /* Signatures of the formats the backend can load. Files are only offered
+   * to the backend if their header matches one of them. If NULL, every file
+   * is offered, for libraries supporting too many formats to list.
+   */
+  const struct imv_signature *signatures;
+
+  /* If true, files are opened by path even when they could be read from
+   * memory, for formats that refer to other files relative to their own
+   * location, such as SVGs linking images, fonts or stylesheets.
+   */
+  bool prefers_path;
+
   /* Tries to open the given path. If successful, BACKEND_SUCCESS is returned
    * and src will point to an imv_source instance for the given path.
    */
@@ -46,6 +82,19 @@ struct imv_backend {
    * and src will point to an imv_source instance for the given data.
    */
   enum backend_result (*open_memory)(void *data, size_t len, struct imv_source **src);
+
+  /* Tries to read data that may still be arriving, such as an image piped to
+   * stdin, so that it can be decoded as it comes in rather than once it's all
+   * there. Optional: backends without it are given the whole stream through
+   * open_memory instead. The stream outlives the source.
+   */
+  enum backend_result (*open_stream)(struct imv_stream *stream, struct imv_source **src);
 };
 
+/* Returns true if a file starting with the given header should be offered to
+ * the backend. header should hold up to IMV_BACKEND_HEADER_LEN bytes.
+ */
+bool imv_backend_accepts(const struct imv_backend *backend, const void *header,
+    size_t len);
+
 #endif
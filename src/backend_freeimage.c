@@ -6,21 +6,69 @@
 #include "source_private.h"
 
 #include <FreeImage.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* A 32-bit FreeImage bitmap, shared between the source, which may need it to
+ * build the next frame, and any images displaying it */
+struct shared_bitmap {
+  FIBITMAP *bitmap;
+  int refs;
+};
+
 struct private {
   char *path;
   FIMEMORY *memory;
   FREE_IMAGE_FORMAT format;
   FIMULTIBITMAP *multibitmap;
-  FIBITMAP *last_frame;
+  struct shared_bitmap *last_frame;
   int num_frames;
   int next_frame;
   int width;
   int height;
 };
 
+static struct shared_bitmap *share_bitmap(FIBITMAP *bitmap)
+{
+  struct shared_bitmap *shared = malloc(sizeof *shared);
+  shared->bitmap = bitmap;
+  shared->refs = 1;
+  return shared;
+}
+
+static void release_bitmap(void *raw_shared)
+{
+  struct shared_bitmap *shared = raw_shared;
+  if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    FreeImage_Unload(shared->bitmap);
+    free(shared);
+  }
+}
+
+/* Replaces the last frame, taking ownership of the new one. It's converted to
+ * 32 bits if need be, so that it can be displayed as it is. */
+static bool set_last_frame(struct private *private, FIBITMAP *frame)
+{
+  if (frame && FreeImage_GetBPP(frame) != 32) {
+    FIBITMAP *converted = FreeImage_ConvertTo32Bits(frame);
+    FreeImage_Unload(frame);
+    frame = converted;
+  }
+
+  if (private->last_frame) {
+    release_bitmap(private->last_frame);
+    private->last_frame = NULL;
+  }
+
+  if (!frame) {
+    imv_log(IMV_ERROR, "freeimage: unable to convert to 32 bits\n");
+    return false;
+  }
+  private->last_frame = share_bitmap(frame);
+  return true;
+}
+
 static void free_private(void *raw_private)
 {
   if (!raw_private) {
@@ -43,24 +91,32 @@ static void free_private(void *raw_private)
   }
 
   if (private->last_frame) {
-    FreeImage_Unload(private->last_frame);
+    release_bitmap(private->last_frame);
     private->last_frame = NULL;
   }
 
   free(private);
 }
 
-static struct imv_image *to_image(FIBITMAP *in_bmp)
+/* Shows the last frame without copying it. It stays shared with the source
+ * until both are done with it. */
+static struct imv_image *to_image(struct private *private)
 {
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = FreeImage_GetWidth(in_bmp);
-  bmp->height = FreeImage_GetHeight(in_bmp);
-  bmp->format = IMV_ARGB;
-  bmp->data = malloc(4 * bmp->width * bmp->height);
-  FreeImage_ConvertToRawBits(bmp->data, in_bmp, 4 * bmp->width, 32,
-      FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
-  struct imv_image *image = imv_image_create_from_bitmap(bmp);
-  return image;
+  struct shared_bitmap *shared = private->last_frame;
+  if (!shared) {
+    return NULL;
+  }
+  __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+
+  /* FreeImage stores its rows bottom-up */
+  const int height = FreeImage_GetHeight(shared->bitmap);
+  const int pitch = FreeImage_GetPitch(shared->bitmap);
+  unsigned char *top_row = FreeImage_GetBits(shared->bitmap) + (size_t)(height - 1) * pitch;
+
+  struct imv_bitmap *bmp = imv_bitmap_create_external(
+      FreeImage_GetWidth(shared->bitmap), height, -pitch, IMV_ARGB, top_row,
+      &release_bitmap, shared);
+  return imv_image_create_from_bitmap(bmp);
 }
 
 static FIBITMAP *normalise_bitmap(FIBITMAP *input)
@@ -98,13 +154,19 @@ static FIBITMAP *normalise_bitmap(FIBITMAP *input)
   return output;
 }
 
-static void first_frame(void *raw_private, struct imv_image **image, int *frametime)
+static void first_frame(void *raw_private, const struct imv_source_request *req,
+    struct imv_image **image, int *frametime)
 {
   *image = NULL;
   *frametime = 0;
 
   imv_log(IMV_DEBUG, "freeimage: first_frame called\n");
 
+  /* FreeImage can't be interrupted once it has started loading */
+  if (imv_source_request_cancelled(req)) {
+    return;
+  }
+
   FIBITMAP *bmp = NULL;
 
   struct private *private = raw_private;
@@ -142,7 +204,7 @@ static void first_frame(void *raw_private, struct imv_image **image, int *framet
     } else {
       *frametime = 100; /* default value for gifs */
     }
-    bmp = FreeImage_ConvertTo24Bits(frame);
+    bmp = FreeImage_ConvertTo32Bits(frame);
     FreeImage_UnlockPage(private->multibitmap, frame, 0);
 
   } else { /* not a gif */
@@ -162,15 +224,18 @@ static void first_frame(void *raw_private, struct imv_image **image, int *framet
     bmp = normalise_bitmap(fibitmap);
   }
 
-  private->width = FreeImage_GetWidth(bmp);
-  private->height = FreeImage_GetHeight(bmp);
-  private->last_frame = bmp;
+  if (!set_last_frame(private, bmp)) {
+    return;
+  }
+  private->width = FreeImage_GetWidth(private->last_frame->bitmap);
+  private->height = FreeImage_GetHeight(private->last_frame->bitmap);
   private->next_frame = 1 % private->num_frames;
 
-  *image = to_image(bmp);
+  *image = to_image(private);
 }
 
-static void next_frame(void *raw_private, struct imv_image **image, int *frametime)
+static void next_frame(void *raw_private, const struct imv_source_request *req,
+    struct imv_image **image, int *frametime)
 {
   *image = NULL;
   *frametime = 0;
@@ -178,7 +243,7 @@ static void next_frame(void *raw_private, struct imv_image **image, int *frameti
   struct private *private = raw_private;
 
   if (private->num_frames == 1) {
-    *image = to_image(private->last_frame);
+    *image = to_image(private);
     return;
   }
 
@@ -233,37 +298,27 @@ static void next_frame(void *raw_private, struct imv_image **image, int *frameti
     case 0: /* nothing specified, fall through to compositing */
     case 1: /* composite over previous frame */
       if (private->last_frame && private->next_frame > 0) {
-        FIBITMAP *bg_frame = FreeImage_ConvertTo24Bits(private->last_frame);
-        FreeImage_Unload(private->last_frame);
+        FIBITMAP *bg_frame = FreeImage_ConvertTo24Bits(private->last_frame->bitmap);
         FIBITMAP *comp = FreeImage_Composite(frame32, 1, NULL, bg_frame);
         FreeImage_Unload(bg_frame);
         FreeImage_Unload(frame32);
-        private->last_frame = comp;
+        set_last_frame(private, comp);
       } else {
         /* No previous frame, just render directly */
-        if(private->last_frame) {
-          FreeImage_Unload(private->last_frame);
-        }
-        private->last_frame = frame32;
+        set_last_frame(private, frame32);
       }
       break;
     case 2: /* TODO - set to background, composite over that */
-      if (private->last_frame) {
-        FreeImage_Unload(private->last_frame);
-      }
-      private->last_frame = frame32;
+      set_last_frame(private, frame32);
       break;
     case 3: /* TODO - restore to previous content */
-      if (private->last_frame) {
-        FreeImage_Unload(private->last_frame);
-      }
-      private->last_frame = frame32;
+      set_last_frame(private, frame32);
       break;
   }
 
   private->next_frame = (private->next_frame + 1) % private->num_frames;
 
-  *image = to_image(private->last_frame);
+  *image = to_image(private);
 }
 
 static const struct imv_source_vtable vtable = {
@@ -315,6 +370,8 @@ const struct imv_backend imv_backend_freeimage = {
   .description = "Open source image library supporting a large number of formats",
   .website = "http://freeimage.sourceforge.net/",
   .license = "FreeImage Public License v1.0",
+  /* too many formats to list, so every file is offered to FreeImage */
+  .signatures = NULL,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
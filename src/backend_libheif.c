@@ -5,10 +5,12 @@
 #include "backend.h"
 #include "bitmap.h"
 #include "image.h"
+#include "log.h"
 #include "source_private.h"
 
 struct private {
-  struct heif_image *img;
+  struct heif_context *ctx;
+  struct heif_image_handle *handle;
 };
 
 static void free_private(void *raw_private)
@@ -17,31 +19,104 @@ static void free_private(void *raw_private)
     return;
   }
   struct private *private = raw_private;
-  heif_image_release(private->img);
+  heif_image_handle_release(private->handle);
+  heif_context_free(private->ctx);
   free(private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+/* Picks the smallest embedded thumbnail that's still big enough to show at
+ * the requested size, or the primary image if there isn't one. The returned
+ * handle must be released by the caller.
+ */
+static struct heif_image_handle *pick_handle(struct private *private,
+    const struct imv_source_request *req)
+{
+  struct heif_image_handle *best = NULL;
+  const int width = heif_image_handle_get_width(private->handle);
+  const int height = heif_image_handle_get_height(private->handle);
+
+  int count = heif_image_handle_get_number_of_thumbnails(private->handle);
+  if (count > 0) {
+    heif_item_id *ids = calloc(count, sizeof *ids);
+    count = heif_image_handle_get_list_of_thumbnail_IDs(private->handle, ids, count);
+    for (int i = 0; i < count; ++i) {
+      struct heif_image_handle *thumb;
+      if (heif_image_handle_get_thumbnail(private->handle, ids[i], &thumb).code
+          != heif_error_Ok) {
+        continue;
+      }
+      const int thumb_width = heif_image_handle_get_width(thumb);
+      const int thumb_height = heif_image_handle_get_height(thumb);
+      if (!imv_source_request_scale_ok(req, width, height, thumb_width, thumb_height)
+          || (best && thumb_width >= heif_image_handle_get_width(best))) {
+        heif_image_handle_release(thumb);
+        continue;
+      }
+      if (best) {
+        heif_image_handle_release(best);
+      }
+      best = thumb;
+    }
+    free(ids);
+  }
+
+  if (best) {
+    imv_log(IMV_DEBUG, "libheif: using %dx%d thumbnail of %dx%d image\n",
+        heif_image_handle_get_width(best), heif_image_handle_get_height(best),
+        width, height);
+    return best;
+  }
+
+  struct heif_image_handle *primary;
+  if (heif_context_get_primary_image_handle(private->ctx, &primary).code
+      != heif_error_Ok) {
+    return NULL;
+  }
+  return primary;
+}
+
+static void release_image(void *img)
+{
+  heif_image_release(img);
+}
+
+static void load_image(void *raw_private, const struct imv_source_request *req,
+    struct imv_image **image, int *frametime)
 {
   *image = NULL;
   *frametime = 0;
 
   struct private *private = raw_private;
 
+  /* libheif decodes in a single call, so only check before starting */
+  if (imv_source_request_cancelled(req)) {
+    return;
+  }
+
+  struct heif_image_handle *handle = pick_handle(private, req);
+  if (!handle) {
+    return;
+  }
+
+  struct heif_image *img;
+  struct heif_error err = heif_decode_image(handle, &img, heif_colorspace_RGB,
+      heif_chroma_interleaved_RGBA, NULL);
+  heif_image_handle_release(handle);
+  if (err.code != heif_error_Ok) {
+    imv_log(IMV_DEBUG, "libheif: failed to decode: %s\n", err.message);
+    return;
+  }
+
+  /* Hand libheif's own buffer over, rather than copying it */
   int stride;
-  const uint8_t *data = heif_image_get_plane_readonly(private->img, heif_channel_interleaved, &stride);
-
-  int width = heif_image_get_width(private->img, heif_channel_interleaved);
-  int height = heif_image_get_height(private->img, heif_channel_interleaved);
-  unsigned char *bitmap = malloc(width * height * 4);
-  memcpy(bitmap, data, width * height * 4);
-
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = width,
-  bmp->height = height,
-  bmp->format = IMV_ABGR;
-  bmp->data = bitmap;
-  *image = imv_image_create_from_bitmap(bmp);
+  const uint8_t *data = heif_image_get_plane_readonly(img, heif_channel_interleaved, &stride);
+  struct imv_bitmap *bmp = imv_bitmap_create_external(
+      heif_image_get_width(img, heif_channel_interleaved),
+      heif_image_get_height(img, heif_channel_interleaved),
+      stride, IMV_ABGR, (unsigned char *)data, &release_image, img);
+  *image = imv_image_create_from_scaled_bitmap(bmp,
+      heif_image_handle_get_width(private->handle),
+      heif_image_handle_get_height(private->handle));
 }
 
 static const struct imv_source_vtable vtable = {
@@ -49,17 +124,22 @@ static const struct imv_source_vtable vtable = {
   .free = free_private,
 };
 
-struct heif_error get_primary_image(struct heif_context *ctx, struct heif_image **img)
+/* Takes ownership of ctx, which should have already been read */
+static enum backend_result open_context(struct heif_context *ctx,
+    struct imv_source **src)
 {
   struct heif_image_handle *handle;
   struct heif_error err = heif_context_get_primary_image_handle(ctx, &handle);
   if (err.code != heif_error_Ok) {
-    return err;
+    heif_context_free(ctx);
+    return BACKEND_UNSUPPORTED;
   }
 
-  err = heif_decode_image(handle, img, heif_colorspace_RGB, heif_chroma_interleaved_RGBA, NULL);
-  heif_image_handle_release(handle);
-  return err;
+  struct private *private = malloc(sizeof *private);
+  private->ctx = ctx;
+  private->handle = handle;
+  *src = imv_source_create(&vtable, private);
+  return BACKEND_SUCCESS;
 }
 
 static enum backend_result open_path(const char *path, struct imv_source **src)
@@ -74,17 +154,7 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
     return BACKEND_UNSUPPORTED;
   }
 
-  struct heif_image *img;
-  err = get_primary_image(ctx, &img);
-  heif_context_free(ctx);
-  if (err.code != heif_error_Ok) {
-    return BACKEND_UNSUPPORTED;
-  }
-
-  struct private *private = malloc(sizeof *private);
-  private->img = img;
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
+  return open_context(ctx, src);
 }
 
 static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
@@ -96,24 +166,31 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
     return BACKEND_UNSUPPORTED;
   }
 
-  struct heif_image *img;
-  err = get_primary_image(ctx, &img);
-  heif_context_free(ctx);
-  if (err.code != heif_error_Ok) {
-    return BACKEND_UNSUPPORTED;
-  }
-
-  struct private *private = malloc(sizeof *private);
-  private->img = img;
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
+  return open_context(ctx, src);
 }
 
+/* The ISO base media file format's ftyp box, with one of the major brands
+ * used by HEIF and AVIF images */
+static const struct imv_signature signatures[] = {
+  IMV_SIGNATURE("ftypheic", 4),
+  IMV_SIGNATURE("ftypheix", 4),
+  IMV_SIGNATURE("ftypheim", 4),
+  IMV_SIGNATURE("ftypheis", 4),
+  IMV_SIGNATURE("ftyphevc", 4),
+  IMV_SIGNATURE("ftyphevx", 4),
+  IMV_SIGNATURE("ftypmif1", 4),
+  IMV_SIGNATURE("ftypmsf1", 4),
+  IMV_SIGNATURE("ftypavif", 4),
+  IMV_SIGNATURE("ftypavis", 4),
+  { NULL }
+};
+
 const struct imv_backend imv_backend_libheif = {
   .name = "libheif",
   .description = "ISO/IEC 23008-12:2017 HEIF file format decoder and encoder.",
   .website = "http://www.libheif.org",
   .license = "GNU Lesser General Public License",
+  .signatures = signatures,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
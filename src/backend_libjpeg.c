@@ -1,10 +1,12 @@
 #include "backend.h"
 #include "bitmap.h"
 #include "image.h"
+#include "log.h"
 #include "source.h"
 #include "source_private.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/mman.h>
@@ -21,6 +23,8 @@ struct private {
   tjhandle jpeg;
   int width;
   int height;
+  /* decode greyscale images to a single channel */
+  bool gray;
 };
 
 static void free_private(void *raw_private)
@@ -38,28 +42,79 @@ static void free_private(void *raw_private)
   free(private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+static bool read_header(struct private *private)
+{
+  int subsamp, colorspace;
+  if (tjDecompressHeader3(private->jpeg, private->data, private->len,
+        &private->width, &private->height, &subsamp, &colorspace)) {
+    return false;
+  }
+  private->gray = subsamp == TJSAMP_GRAY;
+  return true;
+}
+
+/* Finds the smallest size TurboJPEG can decode to that's still enough for the
+ * request, leaving width and height alone if that's the full size */
+static void pick_scale(struct private *private,
+    const struct imv_source_request *req, int *width, int *height)
+{
+  int num_factors;
+  tjscalingfactor *factors = tjGetScalingFactors(&num_factors);
+  if (!factors) {
+    return;
+  }
+
+  for (int i = 0; i < num_factors; ++i) {
+    if (factors[i].num >= factors[i].denom) {
+      continue;
+    }
+    const int scaled_width = TJSCALED(private->width, factors[i]);
+    const int scaled_height = TJSCALED(private->height, factors[i]);
+    if (scaled_width < *width && imv_source_request_scale_ok(req,
+          private->width, private->height, scaled_width, scaled_height)) {
+      *width = scaled_width;
+      *height = scaled_height;
+    }
+  }
+
+  if (*width != private->width) {
+    imv_log(IMV_DEBUG, "libjpeg: decoding %dx%d image at %dx%d\n",
+        private->width, private->height, *width, *height);
+  }
+}
+
+static void load_image(void *raw_private, const struct imv_source_request *req,
+    struct imv_image **image, int *frametime)
 {
   *image = NULL;
   *frametime = 0;
 
   struct private *private = raw_private;
 
-  void *bitmap = malloc(private->height * private->width * 4);
+  /* TurboJPEG decodes in a single call with no way to interrupt it, so the
+   * best we can do is not start if we're no longer wanted */
+  if (imv_source_request_cancelled(req)) {
+    return;
+  }
+
+  /* Let the DCT do the downscaling if we don't need every pixel */
+  int width = private->width;
+  int height = private->height;
+  pick_scale(private, req, &width, &height);
+
+  /* JPEGs are always opaque, so there's no need for an alpha channel */
+  struct imv_bitmap *bmp = imv_bitmap_create(width, height,
+      private->gray ? IMV_GRAY : IMV_RGB);
   int rcode = tjDecompress2(private->jpeg, private->data, private->len,
-      bitmap, private->width, 0, private->height, TJPF_RGBA, TJFLAG_FASTDCT);
+      bmp->data, width, bmp->stride, height,
+      private->gray ? TJPF_GRAY : TJPF_RGB, TJFLAG_FASTDCT);
 
   if (rcode) {
-    free(bitmap);
+    imv_bitmap_free(bmp);
     return;
   }
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = private->width;
-  bmp->height = private->height;
-  bmp->format = IMV_ABGR;
-  bmp->data = bitmap;
-  *image = imv_image_create_from_bitmap(bmp);
+  *image = imv_image_create_from_scaled_bitmap(bmp, private->width, private->height);
 }
 
 static const struct imv_source_vtable vtable = {
@@ -97,9 +152,7 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
     return BACKEND_UNSUPPORTED;
   }
 
-  int rcode = tjDecompressHeader(private.jpeg, private.data, private.len,
-      &private.width, &private.height);
-  if (rcode) {
+  if (!read_header(&private)) {
     tjDestroy(private.jpeg);
     munmap(private.data, private.len);
     close(private.fd);
@@ -126,9 +179,7 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
     return BACKEND_UNSUPPORTED;
   }
 
-  int rcode = tjDecompressHeader(private.jpeg, private.data, private.len,
-      &private.width, &private.height);
-  if (rcode) {
+  if (!read_header(&private)) {
     tjDestroy(private.jpeg);
     return BACKEND_UNSUPPORTED;
   }
@@ -140,6 +191,11 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
   return BACKEND_SUCCESS;
 }
 
+static const struct imv_signature signatures[] = {
+  IMV_SIGNATURE("\xff\xd8\xff", 0),
+  { NULL }
+};
+
 const struct imv_backend imv_backend_libjpeg = {
   .name = "libjpeg-turbo",
   .description = "Fast JPEG codec based on libjpeg. "
@@ -147,6 +203,7 @@ const struct imv_backend imv_backend_libjpeg = {
                  "of the Independent JPEG Group.",
   .website = "https://libjpeg-turbo.org/",
   .license = "The Modified BSD License",
+  .signatures = signatures,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
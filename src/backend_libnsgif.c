@@ -14,6 +14,8 @@
 
 struct private {
   int current_frame;
+  /* serial of the last frame handed out, 0 if there isn't one to follow on from */
+  unsigned long last_serial;
   gif_animation gif;
   void *data;
   size_t len;
@@ -77,25 +79,53 @@ static void free_private(void *raw_private)
 static void push_current_image(struct private *private,
     struct imv_image **image, int *frametime)
 {
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = private->gif.width;
-  bmp->height = private->gif.height;
-  bmp->format = IMV_ABGR;
-  size_t len = 4 * bmp->width * bmp->height;
-  bmp->data = malloc(len);
-  memcpy(bmp->data, private->gif.frame_image, len);
+  /* libnsgif composites every frame onto the same buffer, so the frame has to
+   * be copied out before the next one is decoded */
+  struct imv_bitmap *bmp = imv_bitmap_create(private->gif.width,
+      private->gif.height, IMV_ABGR);
+  memcpy(bmp->data, private->gif.frame_image, (size_t)bmp->stride * bmp->height);
 
   *image = imv_image_create_from_bitmap(bmp);
   *frametime = private->gif.frames[private->current_frame].frame_delay * 10.0;
+
+  /* Decoding a frame only touches its own area, plus wherever the previous
+   * frame was disposed of. The first frame starts over from a blank canvas. */
+  if (private->current_frame > 0 && private->last_serial) {
+    const gif_frame *cur = &private->gif.frames[private->current_frame];
+    const gif_frame *prev = &private->gif.frames[private->current_frame - 1];
+    unsigned int left = cur->redraw_x < prev->redraw_x ? cur->redraw_x : prev->redraw_x;
+    unsigned int top = cur->redraw_y < prev->redraw_y ? cur->redraw_y : prev->redraw_y;
+    unsigned int right = cur->redraw_x + cur->redraw_width;
+    unsigned int bottom = cur->redraw_y + cur->redraw_height;
+    if (prev->redraw_x + prev->redraw_width > right) {
+      right = prev->redraw_x + prev->redraw_width;
+    }
+    if (prev->redraw_y + prev->redraw_height > bottom) {
+      bottom = prev->redraw_y + prev->redraw_height;
+    }
+    if (right > private->gif.width) {
+      right = private->gif.width;
+    }
+    if (bottom > private->gif.height) {
+      bottom = private->gif.height;
+    }
+    if (left < right && top < bottom) {
+      imv_image_set_damage(*image, private->last_serial, left, top,
+          right - left, bottom - top);
+    }
+  }
+  private->last_serial = imv_image_serial(*image);
 }
 
-static void first_frame(void *raw_private, struct imv_image **image, int *frametime)
+static void first_frame(void *raw_private, const struct imv_source_request *req,
+    struct imv_image **image, int *frametime)
 {
   *image = NULL;
   *frametime = 0;
 
   struct private *private = raw_private;
   private->current_frame = 0;
+  private->last_serial = 0;
 
   gif_result code = gif_decode_frame(&private->gif, private->current_frame);
   if (code != GIF_OK) {
@@ -106,7 +136,8 @@ static void first_frame(void *raw_private, struct imv_image **image, int *framet
   push_current_image(private, image, frametime);
 }
 
-static void next_frame(void *raw_private, struct imv_image **image, int *frametime)
+static void next_frame(void *raw_private, const struct imv_source_request *req,
+    struct imv_image **image, int *frametime)
 {
   *image = NULL;
   *frametime = 0;
@@ -119,6 +150,7 @@ static void next_frame(void *raw_private, struct imv_image **image, int *frameti
   gif_result code = gif_decode_frame(&private->gif, private->current_frame);
   if (code != GIF_OK) {
     imv_log(IMV_DEBUG, "libnsgif: failed to decode a frame\n");
+    private->last_serial = 0;
     return;
   }
 
@@ -200,11 +232,18 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
 }
 
 
+static const struct imv_signature signatures[] = {
+  IMV_SIGNATURE("GIF87a", 0),
+  IMV_SIGNATURE("GIF89a", 0),
+  { NULL }
+};
+
 const struct imv_backend imv_backend_libnsgif = {
   .name = "libnsgif",
   .description = "Tiny GIF decoding library from the NetSurf project",
   .website = "https://www.netsurf-browser.org/projects/libnsgif/",
   .license = "MIT",
+  .signatures = signatures,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
@@ -4,15 +4,30 @@
 #include "log.h"
 #include "source.h"
 #include "source_private.h"
+#include "stream.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <png.h>
 
 struct private {
+  /* where to read from: a file, a buffer in memory, or a stream that's still
+   * arriving */
   FILE *file;
+  const unsigned char *data;
+  size_t len;
+  struct imv_stream *stream;
+  size_t pos;
+
+  /* the cancellation flag of the load in progress, so that waiting on a
+   * stream can be given up on */
+  const int *cancelled;
+
   png_structp png;
   png_infop info;
+  int passes;
+  enum imv_pixelformat format;
 };
 
 static void free_private(void *raw_private)
@@ -29,12 +44,14 @@ static void free_private(void *raw_private)
   free(private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+static void load_image(void *raw_private, const struct imv_source_request *req,
+    struct imv_image **image, int *frametime)
 {
   *image = NULL;
   *frametime = 0;
 
   struct private *private = raw_private;
+  private->cancelled = &req->cancelled;
   if (setjmp(png_jmpbuf(private->png))) {
     return;
   }
@@ -42,30 +59,44 @@ static void load_image(void *raw_private, struct imv_image **image, int *frameti
   const int width = png_get_image_width(private->png, private->info);
   const int height = png_get_image_height(private->png, private->info);
 
+  /* The image exists from the start, so it can be shown as it's decoded */
+  struct imv_bitmap *bmp = imv_bitmap_create(width, height, private->format);
+  struct imv_image *result = imv_image_create_from_bitmap(bmp);
+
   png_bytep *rows = malloc(sizeof(png_bytep) * height);
-  size_t row_len = png_get_rowbytes(private->png, private->info);
-  rows[0] = malloc(height * row_len);
-  for (int y = 1; y < height; ++y) {
-    rows[y] = rows[0] + row_len * y;
+  for (int y = 0; y < height; ++y) {
+    rows[y] = bmp->data + (size_t)bmp->stride * y;
   }
 
   if (setjmp(png_jmpbuf(private->png))) {
+    imv_image_free(result);
+    free(rows);
     return;
   }
 
-  png_read_image(private->png, rows);
-  void *raw_bmp = rows[0];
-  free(rows);
-  fclose(private->file);
-  private->file = NULL;
+  /* Read a row at a time so that we can give up part way through. Interlaced
+   * images revisit every row on each pass, so can't be shown until done. */
+  for (int pass = 0; pass < private->passes; ++pass) {
+    for (int y = 0; y < height; ++y) {
+      if (imv_source_request_cancelled(req)) {
+        imv_image_free(result);
+        free(rows);
+        return;
+      }
+      png_read_row(private->png, rows[y], NULL);
+      if (private->passes == 1) {
+        imv_source_request_progress(req, result, 0, y + 1);
+      }
+    }
+  }
 
+  free(rows);
+  if (private->file) {
+    fclose(private->file);
+    private->file = NULL;
+  }
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = width;
-  bmp->height = height;
-  bmp->format = IMV_ABGR;
-  bmp->data = raw_bmp;
-  *image = imv_image_create_from_bitmap(bmp);
+  *image = result;
 }
 
 static const struct imv_source_vtable vtable = {
@@ -73,26 +104,42 @@ static const struct imv_source_vtable vtable = {
   .free = free_private
 };
 
-static enum backend_result open_path(const char *path, struct imv_source **src)
+static void read_memory(png_structp png, png_bytep out, png_size_t len)
 {
-
-  unsigned char header[8];
-  FILE *f = fopen(path, "rb");
-  if (!f) {
-    return BACKEND_BAD_PATH;
+  struct private *private = png_get_io_ptr(png);
+  if (len > private->len - private->pos) {
+    png_error(png, "unexpected end of data");
   }
-  fread(header, 1, sizeof header, f);
-  if (png_sig_cmp(header, 0, sizeof header)) {
-    fclose(f);
-    return BACKEND_UNSUPPORTED;
+  memcpy(out, private->data + private->pos, len);
+  private->pos += len;
+}
+
+static void read_stream(png_structp png, png_bytep out, png_size_t len)
+{
+  /* waits for the data if it hasn't arrived yet, so rows are decoded, and
+   * shown, as soon as they can be */
+  struct private *private = png_get_io_ptr(png);
+  if (imv_stream_read(private->stream, private->pos, out, len,
+        private->cancelled) != len) {
+    png_error(png, "unexpected end of data");
   }
+  private->pos += len;
+}
 
-  struct private *private = calloc(1, sizeof *private);
-  private->file = f;
+static void wake_stream(void *stream)
+{
+  imv_stream_wake(stream);
+}
+
+/* Reads the image info from a file or buffer whose signature has already been
+ * checked. Takes ownership of private, cleaning it up on failure.
+ */
+static enum backend_result open_png(struct private *private, size_t sig_bytes,
+    struct imv_source **src)
+{
   private->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if (!private->png) {
-    fclose(private->file);
-    free(private);
+    free_private(private);
     return BACKEND_UNSUPPORTED;
   }
 
@@ -101,52 +148,122 @@ static enum backend_result open_path(const char *path, struct imv_source **src)
 
   private->info = png_create_info_struct(private->png);
   if (!private->info) {
-    png_destroy_read_struct(&private->png, NULL, NULL);
-    fclose(private->file);
-    free(private);
+    free_private(private);
     return BACKEND_UNSUPPORTED;
   }
 
   if (setjmp(png_jmpbuf(private->png))) {
-    png_destroy_read_struct(&private->png, &private->info, NULL);
-    fclose(private->file);
-    free(private);
+    free_private(private);
     return BACKEND_UNSUPPORTED;
   }
 
-  png_init_io(private->png, private->file);
-  png_set_sig_bytes(private->png, sizeof header);
+  if (private->file) {
+    png_init_io(private->png, private->file);
+  } else if (private->stream) {
+    png_set_read_fn(private->png, private, &read_stream);
+  } else {
+    png_set_read_fn(private->png, private, &read_memory);
+  }
+  png_set_sig_bytes(private->png, sig_bytes);
   png_read_info(private->png, private->info);
 
-  /* Tell libpng to give us a consistent output format */
-  png_set_gray_to_rgb(private->png);
-  png_set_filler(private->png, 0xff, PNG_FILLER_AFTER);
+  /* Tell libpng to give us 8 bits per channel, but keep however many channels
+   * the image has, so that greyscale and opaque images stay compact */
   png_set_strip_16(private->png);
   png_set_expand(private->png);
   png_set_packing(private->png);
+  private->passes = png_set_interlace_handling(private->png);
   png_read_update_info(private->png, private->info);
+
+  switch (png_get_channels(private->png, private->info)) {
+    case 1:
+      private->format = IMV_GRAY;
+      break;
+    case 2:
+      private->format = IMV_GRAY_ALPHA;
+      break;
+    case 3:
+      private->format = IMV_RGB;
+      break;
+    default:
+      private->format = IMV_ABGR;
+      break;
+  }
   imv_log(IMV_DEBUG, "libpng: info width=%d height=%d bit_depth=%d color_type=%d\n",
       png_get_image_width(private->png, private->info),
       png_get_image_height(private->png, private->info),
       png_get_bit_depth(private->png, private->info),
       png_get_color_type(private->png, private->info));
 
-  if (setjmp(png_jmpbuf(private->png))) {
-    png_destroy_read_struct(&private->png, &private->info, NULL);
-    fclose(private->file);
-    free(private);
+  *src = imv_source_create(&vtable, private);
+  return BACKEND_SUCCESS;
+}
+
+static enum backend_result open_path(const char *path, struct imv_source **src)
+{
+  unsigned char header[8];
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return BACKEND_BAD_PATH;
+  }
+  if (fread(header, 1, sizeof header, f) != sizeof header
+      || png_sig_cmp(header, 0, sizeof header)) {
+    fclose(f);
     return BACKEND_UNSUPPORTED;
   }
 
-  *src = imv_source_create(&vtable, private);
-  return BACKEND_SUCCESS;
+  struct private *private = calloc(1, sizeof *private);
+  private->file = f;
+  return open_png(private, sizeof header, src);
 }
 
+static enum backend_result open_memory(void *data, size_t len, struct imv_source **src)
+{
+  const size_t sig_bytes = 8;
+  if (len < sig_bytes || png_sig_cmp(data, 0, sig_bytes)) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->data = data;
+  private->len = len;
+  private->pos = sig_bytes;
+  return open_png(private, sig_bytes, src);
+}
+
+static enum backend_result open_stream(struct imv_stream *stream,
+    struct imv_source **src)
+{
+  unsigned char header[8];
+  if (imv_stream_read(stream, 0, header, sizeof header, NULL) != sizeof header
+      || png_sig_cmp(header, 0, sizeof header)) {
+    return BACKEND_UNSUPPORTED;
+  }
+
+  struct private *private = calloc(1, sizeof *private);
+  private->stream = stream;
+  private->pos = sizeof header;
+  const enum backend_result result = open_png(private, sizeof header, src);
+  if (result == BACKEND_SUCCESS) {
+    /* so that a load waiting on more to arrive can be cancelled */
+    imv_source_set_wake(*src, &wake_stream, stream);
+  }
+  return result;
+}
+
+static const struct imv_signature signatures[] = {
+  IMV_SIGNATURE("\x89PNG\r\n\x1a\n", 0),
+  { NULL }
+};
+
 const struct imv_backend imv_backend_libpng = {
   .name = "libpng",
   .description = "The official PNG reference implementation",
   .website = "http://www.libpng.org/pub/png/libpng.html",
   .license = "The libpng license",
+  .signatures = signatures,
   .open_path = &open_path,
+  .open_memory = &open_memory,
+  .open_stream = &open_stream,
 };
 
@@ -23,7 +23,8 @@ static void free_private(void *raw_private)
   free(raw_private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+static void load_image(void *raw_private, const struct imv_source_request *req,
+    struct imv_image **image, int *frametime)
 {
   *image = NULL;
   *frametime = 0;
@@ -96,11 +97,20 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
   return BACKEND_SUCCESS;
 }
 
+/* Look for an <SVG> tag near the start of the file */
+static const struct imv_signature signatures[] = {
+  { .magic = "<svg", .len = 4, .search = true },
+  { .magic = "<SVG", .len = 4, .search = true },
+  { NULL }
+};
+
 const struct imv_backend imv_backend_librsvg = {
   .name = "libRSVG",
   .description = "SVG library developed by GNOME",
   .website = "https://wiki.gnome.org/Projects/LibRsvg",
   .license = "GNU Lesser General Public License v2.1+",
+  .signatures = signatures,
+  .prefers_path = true,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
@@ -4,6 +4,7 @@
 #include "source.h"
 #include "source_private.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <tiffio.h>
@@ -19,6 +20,13 @@ struct private {
 static tsize_t mem_read(thandle_t data, tdata_t buffer, tsize_t len)
 {
   struct private *private = (struct private*)data;
+  /* a truncated or corrupt file may ask for more than there is */
+  if (len < 0 || private->pos >= private->len) {
+    return 0;
+  }
+  if ((size_t)len > private->len - private->pos) {
+    len = private->len - private->pos;
+  }
   memcpy(buffer, (char*)private->data + private->pos, len);
   private->pos += len;
   return len;
@@ -26,10 +34,11 @@ static tsize_t mem_read(thandle_t data, tdata_t buffer, tsize_t len)
 
 static tsize_t mem_write(thandle_t data, tdata_t buffer, tsize_t len)
 {
-  struct private *private = (struct private*)data;
-  memcpy((char*)private->data + private->pos, buffer, len);
-  private->pos += len;
-  return len;
+  /* the data is only ever read */
+  (void)data;
+  (void)buffer;
+  (void)len;
+  return 0;
 }
 
 static int mem_close(thandle_t data)
@@ -72,7 +81,29 @@ static void free_private(void *raw_private)
   free(private);
 }
 
-static void load_image(void *raw_private, struct imv_image **image, int *frametime)
+/* Number of rows to decode between checks for cancellation, rounded to a
+ * whole number of strips or tiles so none are decoded twice */
+static int band_height(TIFF *tiff, int height)
+{
+  const uint32_t min_rows = 64;
+
+  uint32_t unit = 0;
+  if (TIFFIsTiled(tiff)) {
+    TIFFGetField(tiff, TIFFTAG_TILELENGTH, &unit);
+  } else {
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &unit);
+  }
+
+  if (unit == 0 || unit >= (uint32_t)height) {
+    return height;
+  }
+
+  const uint32_t units = (min_rows + unit - 1) / unit;
+  return units * unit >= (uint32_t)height ? height : (int)(units * unit);
+}
+
+static void load_image(void *raw_private, const struct imv_source_request *req,
+    struct imv_image **image, int *frametime)
 {
   *image = NULL;
   *frametime = 0;
@@ -84,21 +115,61 @@ static void load_image(void *raw_private, struct imv_image **image, int *frameti
    * going to use vanilla malloc/free. Systems where that isn't acceptable
    * don't have upstream support from imv.
    */
-  void *bitmap = malloc(private->height * private->width * 4);
-  int rcode = TIFFReadRGBAImageOriented(private->tiff, private->width, private->height,
-      bitmap, ORIENTATION_TOPLEFT, 0);
+  char emsg[1024];
+  TIFFRGBAImage img;
+  if (!TIFFRGBAImageOK(private->tiff, emsg)
+      || !TIFFRGBAImageBegin(&img, private->tiff, 0, emsg)) {
+    return;
+  }
+
+  /* The image exists from the start, so it can be shown as it's decoded */
+  struct imv_bitmap *bmp = imv_bitmap_create(private->width, private->height,
+      IMV_ABGR);
+  struct imv_image *result = imv_image_create_from_bitmap(bmp);
+  uint32_t *bitmap = (uint32_t *)bmp->data;
+  img.req_orientation = ORIENTATION_TOPLEFT;
+
+  /* Files stored bottom-up are read bottom-up, so each band of rows read
+   * belongs at the other end of the output. */
+  const bool bottom_up = img.orientation == ORIENTATION_BOTLEFT
+                      || img.orientation == ORIENTATION_BOTRIGHT
+                      || img.orientation == ORIENTATION_LEFTBOT
+                      || img.orientation == ORIENTATION_RIGHTBOT;
+
+  /* Decode a band of whole strips or tiles at a time, checking in between
+   * whether we should stop */
+  const int band = band_height(private->tiff, private->height);
+
+  bool ok = true;
+  for (int row = 0; ok && row < private->height; row += band) {
+    if (imv_source_request_cancelled(req)) {
+      ok = false;
+      break;
+    }
+
+    const int rows = row + band > private->height ? private->height - row : band;
+    const int dest_row = bottom_up ? private->height - row - rows : row;
+
+    img.row_offset = row;
+    img.col_offset = 0;
+    /* 1 = success, unlike the rest of *nix */
+    ok = TIFFRGBAImageGet(&img, bitmap + (size_t)dest_row * private->width,
+        private->width, rows) == 1;
+
+    if (ok && bottom_up) {
+      imv_source_request_progress(req, result, dest_row, private->height);
+    } else if (ok) {
+      imv_source_request_progress(req, result, 0, row + rows);
+    }
+  }
+  TIFFRGBAImageEnd(&img);
 
-  /* 1 = success, unlike the rest of *nix */
-  if (rcode != 1) {
+  if (!ok) {
+    imv_image_free(result);
     return;
   }
 
-  struct imv_bitmap *bmp = malloc(sizeof *bmp);
-  bmp->width = private->width;
-  bmp->height = private->height;
-  bmp->format = IMV_ABGR;
-  bmp->data = bitmap;
-  *image = imv_image_create_from_bitmap(bmp);
+  *image = result;
 }
 
 static const struct imv_source_vtable vtable = {
@@ -151,11 +222,21 @@ static enum backend_result open_memory(void *data, size_t len, struct imv_source
   return BACKEND_SUCCESS;
 }
 
+static const struct imv_signature signatures[] = {
+  IMV_SIGNATURE("II*\0", 0),
+  IMV_SIGNATURE("MM\0*", 0),
+  /* BigTIFF */
+  IMV_SIGNATURE("II+\0", 0),
+  IMV_SIGNATURE("MM\0+", 0),
+  { NULL }
+};
+
 const struct imv_backend imv_backend_libtiff = {
   .name = "libtiff",
   .description = "The de-facto tiff library",
   .website = "http://www.libtiff.org/",
   .license = "MIT",
+  .signatures = signatures,
   .open_path = &open_path,
   .open_memory = &open_memory,
 };
@@ -1,22 +1,68 @@
 #include "bitmap.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+int imv_pixelformat_bytes(enum imv_pixelformat format)
+{
+  switch (format) {
+    case IMV_RGB:
+      return 3;
+    case IMV_GRAY:
+      return 1;
+    case IMV_GRAY_ALPHA:
+      return 2;
+    case IMV_ARGB:
+    case IMV_ABGR:
+    default:
+      return 4;
+  }
+}
+
+struct imv_bitmap *imv_bitmap_create(int width, int height,
+    enum imv_pixelformat format)
+{
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->stride = imv_pixelformat_bytes(format) * width;
+  bmp->format = format;
+  bmp->data = malloc((size_t)bmp->stride * height);
+  return bmp;
+}
+
+struct imv_bitmap *imv_bitmap_create_external(int width, int height, int stride,
+    enum imv_pixelformat format, unsigned char *data,
+    imv_bitmap_release release, void *release_data)
+{
+  struct imv_bitmap *bmp = calloc(1, sizeof *bmp);
+  bmp->width = width;
+  bmp->height = height;
+  bmp->stride = stride;
+  bmp->format = format;
+  bmp->data = data;
+  bmp->release = release;
+  bmp->release_data = release_data;
+  return bmp;
+}
+
 struct imv_bitmap *imv_bitmap_clone(struct imv_bitmap *bmp)
 {
-  struct imv_bitmap *copy = malloc(sizeof *copy);
-  const size_t num_bytes = 4 * bmp->width * bmp->height;
-  copy->width = bmp->width;
-  copy->height = bmp->height;
-  copy->format = bmp->format;
-  copy->data = malloc(num_bytes);
-  memcpy(copy->data, bmp->data, num_bytes);
+  struct imv_bitmap *copy = imv_bitmap_create(bmp->width, bmp->height, bmp->format);
+  for (int y = 0; y < bmp->height; ++y) {
+    memcpy(copy->data + (size_t)y * copy->stride,
+        bmp->data + (ptrdiff_t)y * bmp->stride, copy->stride);
+  }
   return copy;
 }
 
 void imv_bitmap_free(struct imv_bitmap *bmp)
 {
-  free(bmp->data);
+  if (bmp->release) {
+    bmp->release(bmp->release_data);
+  } else {
+    free(bmp->data);
+  }
   free(bmp);
 }
@@ -2,18 +2,49 @@
 #define IMV_BITMAP_H
 
 enum imv_pixelformat {
+  /* 32-bit pixels, 0xAARRGGBB in native byte order */
   IMV_ARGB,
+  /* 32-bit pixels, bytes in R, G, B, A order on little endian */
   IMV_ABGR,
+  /* 24-bit pixels, bytes in R, G, B order */
+  IMV_RGB,
+  /* 8-bit greyscale */
+  IMV_GRAY,
+  /* 16-bit pixels, a grey byte followed by an alpha byte */
+  IMV_GRAY_ALPHA,
 };
 
+/* Returns the number of bytes used by each pixel of the format */
+int imv_pixelformat_bytes(enum imv_pixelformat format);
+
+typedef void (*imv_bitmap_release)(void *data);
+
 struct imv_bitmap {
   int width;
   int height;
+  /* Number of bytes from the start of one row to the next, a multiple of the
+   * pixel size. Negative if rows are stored bottom-up, in which case data
+   * still points to the top row. */
+  int stride;
   enum imv_pixelformat format;
   unsigned char *data;
+  /* If set, data is owned by someone else, such as a decoding library, and
+   * this is called instead of free() to give it back */
+  imv_bitmap_release release;
+  void *release_data;
 };
 
-/* Copy an imv_bitmap */
+/* Create a tightly packed bitmap, with room for its pixels allocated */
+struct imv_bitmap *imv_bitmap_create(int width, int height,
+    enum imv_pixelformat format);
+
+/* Create a bitmap around pixels that are owned elsewhere, so that they don't
+ * need copying. release is called with release_data once it's freed. */
+struct imv_bitmap *imv_bitmap_create_external(int width, int height, int stride,
+    enum imv_pixelformat format, unsigned char *data,
+    imv_bitmap_release release, void *release_data);
+
+/* Copy an imv_bitmap. The copy is always tightly packed. */
 struct imv_bitmap *imv_bitmap_clone(struct imv_bitmap *bmp);
 
 /* Clean up a bitmap */
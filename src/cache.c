@@ -0,0 +1,169 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "log.h"
+#include "source.h"
+
+struct cache_entry {
+  char *path;
+
+  /* version of the file the image was decoded from */
+  struct imv_file_id id;
+
+  struct imv_image *image;
+  size_t bytes;
+
+  /* position in the LRU list, most recently used first */
+  struct cache_entry *prev;
+  struct cache_entry *next;
+};
+
+struct imv_cache {
+  size_t budget;
+  struct cache_entry *head;
+  struct cache_entry *tail;
+  struct imv_cache_stats stats;
+};
+
+struct imv_cache *imv_cache_create(size_t budget)
+{
+  struct imv_cache *cache = calloc(1, sizeof *cache);
+  cache->budget = budget;
+  return cache;
+}
+
+static void unlink_entry(struct imv_cache *cache, struct cache_entry *entry)
+{
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+static void push_front(struct imv_cache *cache, struct cache_entry *entry)
+{
+  entry->next = cache->head;
+  if (cache->head) {
+    cache->head->prev = entry;
+  } else {
+    cache->tail = entry;
+  }
+  cache->head = entry;
+}
+
+static void remove_entry(struct imv_cache *cache, struct cache_entry *entry)
+{
+  unlink_entry(cache, entry);
+  cache->stats.bytes -= entry->bytes;
+  imv_image_free(entry->image);
+  free(entry->path);
+  free(entry);
+}
+
+void imv_cache_free(struct imv_cache *cache)
+{
+  if (!cache) {
+    return;
+  }
+
+  while (cache->head) {
+    remove_entry(cache, cache->head);
+  }
+  free(cache);
+}
+
+static struct cache_entry *find_entry(struct imv_cache *cache, const char *path)
+{
+  for (struct cache_entry *entry = cache->head; entry; entry = entry->next) {
+    if (!strcmp(entry->path, path)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static bool same_version(const struct imv_file_id *a,
+    const struct imv_file_id *b)
+{
+  return a->dev == b->dev
+      && a->ino == b->ino
+      && a->mtime.tv_sec == b->mtime.tv_sec
+      && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+struct imv_image *imv_cache_get(struct imv_cache *cache, const char *path,
+    const struct imv_file_id *id)
+{
+  struct cache_entry *entry = find_entry(cache, path);
+  if (entry && !same_version(&entry->id, id)) {
+    /* the file has changed since */
+    remove_entry(cache, entry);
+    entry = NULL;
+  }
+  if (!entry) {
+    cache->stats.misses++;
+    return NULL;
+  }
+
+  cache->stats.hits++;
+  unlink_entry(cache, entry);
+  push_front(cache, entry);
+  return imv_image_ref(entry->image);
+}
+
+bool imv_cache_contains(struct imv_cache *cache, const char *path)
+{
+  return find_entry(cache, path) != NULL;
+}
+
+void imv_cache_put(struct imv_cache *cache, const char *path,
+    const struct imv_file_id *id, struct imv_image *image)
+{
+  struct cache_entry *old = find_entry(cache, path);
+  if (old) {
+    remove_entry(cache, old);
+  }
+
+  if (!id) {
+    /* Without a way to tell if the file changes, don't cache it */
+    return;
+  }
+
+  const size_t bytes = imv_image_memory_usage(image) + sizeof(struct cache_entry)
+                     + strlen(path) + 1;
+  if (bytes > cache->budget) {
+    return;
+  }
+
+  while (cache->stats.bytes + bytes > cache->budget) {
+    imv_log(IMV_DEBUG, "cache: evicting %s\n", cache->tail->path);
+    remove_entry(cache, cache->tail);
+    cache->stats.evictions++;
+  }
+
+  struct cache_entry *entry = calloc(1, sizeof *entry);
+  entry->path = strdup(path);
+  entry->id = *id;
+  entry->image = imv_image_ref(image);
+  entry->bytes = bytes;
+  push_front(cache, entry);
+  cache->stats.bytes += bytes;
+}
+
+struct imv_cache_stats imv_cache_get_stats(struct imv_cache *cache)
+{
+  return cache->stats;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,67 @@
+#ifndef IMV_CACHE_H
+#define IMV_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Holds recently displayed images in memory, so that returning to them
+ * doesn't require decoding them again. Entries are keyed by path, and only
+ * remain valid while the file's device, inode and modification time are
+ * unchanged. Once the total size of the cached images exceeds the budget, the
+ * least recently used images are evicted.
+ *
+ * The cache never touches the filesystem itself, so that it's safe to use
+ * from the main loop. Callers look up the file's current version, which may
+ * block, somewhere else.
+ */
+struct imv_cache;
+
+struct imv_file_id;
+struct imv_image;
+
+struct imv_cache_stats {
+  /* lookups that returned an image */
+  size_t hits;
+
+  /* lookups that found nothing, or only a stale entry */
+  size_t misses;
+
+  /* images discarded to stay within budget */
+  size_t evictions;
+
+  /* bytes currently held */
+  size_t bytes;
+};
+
+/* Creates an instance of imv_cache that will hold up to budget bytes */
+struct imv_cache *imv_cache_create(size_t budget);
+
+/* Cleans up an imv_cache instance, releasing all cached images */
+void imv_cache_free(struct imv_cache *cache);
+
+/* Look up the image for a path, given the file's current version. Returns a
+ * new reference to the image, which the caller must release with
+ * imv_image_free, or NULL if there is no image cached for that version, in
+ * which case any older one is discarded. */
+struct imv_image *imv_cache_get(struct imv_cache *cache, const char *path,
+    const struct imv_file_id *id);
+
+/* Returns true if an image is cached for the path, though the file may have
+ * changed since. Unlike imv_cache_get, this does not affect the statistics or
+ * eviction order. */
+bool imv_cache_contains(struct imv_cache *cache, const char *path);
+
+/* Add an image decoded from the given version of a file to the cache,
+ * replacing any existing entry for the path. Without a version it's not
+ * cached, as there'd be no telling when it went out of date. The cache takes
+ * its own reference to the image. */
+void imv_cache_put(struct imv_cache *cache, const char *path,
+    const struct imv_file_id *id, struct imv_image *image);
+
+/* Returns the cache's statistics */
+struct imv_cache_stats imv_cache_get_stats(struct imv_cache *cache);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -9,9 +9,12 @@
 #include <pango/pangocairo.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 
 #ifdef IMV_BACKEND_LIBRSVG
 #include <librsvg/rsvg.h>
@@ -22,6 +25,12 @@
 unsigned char checkers_data[] = { REPEAT8(REPEAT8(0xCC, 0xCC, 0xCC, 0xFF), REPEAT8(0x80, 0x80, 0x80, 0xFF)),
                                   REPEAT8(REPEAT8(0x80, 0x80, 0x80, 0xFF), REPEAT8(0xCC, 0xCC, 0xCC, 0xFF)) };
 
+/* An area of the canvas in buffer pixels, empty if x0 >= x1 or y0 >= y1 */
+struct rect {
+  int x0, y0;
+  int x1, y1;
+};
+
 struct imv_canvas {
   cairo_surface_t *surface;
   cairo_t *cairo;
@@ -29,9 +38,30 @@ struct imv_canvas {
   GLuint texture;
   int width;
   int height;
+  /* size texture was allocated at */
+  int texture_width;
+  int texture_height;
+  /* the area of surface that may have something drawn on it */
+  struct rect drawn;
+  /* the area of surface that has changed since it was last uploaded */
+  struct rect dirty;
   struct {
-    struct imv_bitmap *bitmap;
+    /* serial of the image held in texture */
+    unsigned long serial;
     GLuint texture;
+    /* the storage allocated for texture, kept for same sized images */
+    int texture_width;
+    int texture_height;
+    GLint texture_format;
+    /* the rows of bitmap uploaded so far, either because it's still being
+     * decoded or because the upload is being spread over several frames */
+    int first_row;
+    int last_row;
+    /* a cheap low resolution copy, shown until the upload catches up */
+    GLuint preview_texture;
+    int preview_width;
+    int preview_height;
+    bool has_preview;
   } cache;
   GLuint checkers_texture;
 };
@@ -86,6 +116,9 @@ void imv_canvas_free(struct imv_canvas *canvas)
   if (canvas->cache.texture) {
     glDeleteTextures(1, &canvas->cache.texture);
   }
+  if (canvas->cache.preview_texture) {
+    glDeleteTextures(1, &canvas->cache.preview_texture);
+  }
   glDeleteTextures(1, &canvas->checkers_texture);
   free(canvas);
 }
@@ -104,15 +137,88 @@ void imv_canvas_resize(struct imv_canvas *canvas, int width, int height, double
   cairo_surface_set_device_scale(canvas->surface, scale, scale);
   canvas->cairo = cairo_create(canvas->surface);
   assert(canvas->cairo);
+
+  /* the new surface starts out blank */
+  canvas->drawn = (struct rect){0};
+  canvas->dirty = (struct rect){0};
+}
+
+static bool rect_empty(const struct rect *rect)
+{
+  return rect->x0 >= rect->x1 || rect->y0 >= rect->y1;
+}
+
+static void rect_add(struct rect *rect, const struct rect *other)
+{
+  if (rect_empty(other)) {
+    return;
+  }
+  if (rect_empty(rect)) {
+    *rect = *other;
+    return;
+  }
+  rect->x0 = other->x0 < rect->x0 ? other->x0 : rect->x0;
+  rect->y0 = other->y0 < rect->y0 ? other->y0 : rect->y0;
+  rect->x1 = other->x1 > rect->x1 ? other->x1 : rect->x1;
+  rect->y1 = other->y1 > rect->y1 ? other->y1 : rect->y1;
+}
+
+/* Record that the given area, in the cairo context's user space, has been
+ * drawn on. Errs on the side of too large, as antialiasing may bleed over.
+ */
+static void mark_drawn(struct imv_canvas *canvas, double x0, double y0,
+                       double x1, double y1)
+{
+  cairo_user_to_device(canvas->cairo, &x0, &y0);
+  cairo_user_to_device(canvas->cairo, &x1, &y1);
+
+  double sx, sy;
+  cairo_surface_get_device_scale(canvas->surface, &sx, &sy);
+
+  struct rect rect = {
+    .x0 = floor((x0 < x1 ? x0 : x1) * sx) - 1,
+    .y0 = floor((y0 < y1 ? y0 : y1) * sy) - 1,
+    .x1 = ceil((x0 > x1 ? x0 : x1) * sx) + 1,
+    .y1 = ceil((y0 > y1 ? y0 : y1) * sy) + 1,
+  };
+  rect.x0 = rect.x0 < 0 ? 0 : rect.x0;
+  rect.y0 = rect.y0 < 0 ? 0 : rect.y0;
+  rect.x1 = rect.x1 > canvas->width ? canvas->width : rect.x1;
+  rect.y1 = rect.y1 > canvas->height ? canvas->height : rect.y1;
+
+  rect_add(&canvas->drawn, &rect);
+  rect_add(&canvas->dirty, &rect);
+}
+
+static void mark_all_drawn(struct imv_canvas *canvas)
+{
+  const struct rect all = {0, 0, canvas->width, canvas->height};
+  canvas->drawn = all;
+  canvas->dirty = all;
 }
 
 void imv_canvas_clear(struct imv_canvas *canvas)
 {
+  /* only what's been drawn on needs wiping */
+  if (rect_empty(&canvas->drawn)) {
+    return;
+  }
+
+  double sx, sy;
+  cairo_surface_get_device_scale(canvas->surface, &sx, &sy);
+
+  const struct rect *drawn = &canvas->drawn;
   cairo_save(canvas->cairo);
+  cairo_identity_matrix(canvas->cairo);
   cairo_set_source_rgba(canvas->cairo, 0, 0, 0, 0);
   cairo_set_operator(canvas->cairo, CAIRO_OPERATOR_SOURCE);
-  cairo_paint(canvas->cairo);
+  cairo_rectangle(canvas->cairo, drawn->x0 / sx, drawn->y0 / sy,
+      (drawn->x1 - drawn->x0) / sx, (drawn->y1 - drawn->y0) / sy);
+  cairo_fill(canvas->cairo);
   cairo_restore(canvas->cairo);
+
+  rect_add(&canvas->dirty, drawn);
+  canvas->drawn = (struct rect){0};
 }
 
 void imv_canvas_color(struct imv_canvas *canvas, float r, float g, float b, float a)
@@ -124,12 +230,14 @@ void imv_canvas_fill_rectangle(struct imv_canvas *canvas, int x, int y, int widt
 {
   cairo_rectangle(canvas->cairo, x, y, width, height);
   cairo_fill(canvas->cairo);
+  mark_drawn(canvas, x, y, x + width, y + height);
 }
 
 void imv_canvas_fill(struct imv_canvas *canvas)
 {
   cairo_rectangle(canvas->cairo, 0, 0, canvas->width, canvas->height);
   cairo_fill(canvas->cairo);
+  mark_all_drawn(canvas);
 }
 
 void imv_canvas_fill_checkers(struct imv_canvas *canvas, struct imv_image *image,
@@ -194,6 +302,11 @@ void imv_canvas_show_layout(struct imv_canvas *canvas, int x, int y,
 {
   cairo_move_to(canvas->cairo, x, y);
   pango_cairo_show_layout(canvas->cairo, layout);
+
+  PangoRectangle ink;
+  pango_layout_get_pixel_extents(layout, &ink, NULL);
+  mark_drawn(canvas, x + ink.x, y + ink.y,
+      x + ink.x + ink.width, y + ink.y + ink.height);
 }
 
 int imv_canvas_printf(struct imv_canvas *canvas, int x, int y, const char *fmt, ...)
@@ -218,29 +331,59 @@ int imv_canvas_printf(struct imv_canvas *canvas, int x, int y, const char *fmt,
 
 void imv_canvas_draw(struct imv_canvas *canvas)
 {
-  GLint viewport[4];
-  glGetIntegerv(GL_VIEWPORT, viewport);
-  glPushMatrix();
-  glOrtho(0.0, 1.0, 1.0, 0.0, 0.0, 10.0);
+  glBindTexture(GL_TEXTURE_RECTANGLE, canvas->texture);
+
+  /* Everything that's been drawn since resizing is dirty, so there's no need
+   * to fill the new texture straight away */
+  if (canvas->texture_width != canvas->width
+      || canvas->texture_height != canvas->height) {
+    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, canvas->width, canvas->height,
+                 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+    canvas->texture_width = canvas->width;
+    canvas->texture_height = canvas->height;
+  }
 
-  void *data = cairo_image_surface_get_data(canvas->surface);
+  /* Only upload what's changed since last time */
+  const struct rect *dirty = &canvas->dirty;
+  if (!rect_empty(dirty)) {
+    cairo_surface_flush(canvas->surface);
+    void *data = cairo_image_surface_get_data(canvas->surface);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, canvas->width);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, dirty->y0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, dirty->x0);
+    glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, dirty->x0, dirty->y0,
+                    dirty->x1 - dirty->x0, dirty->y1 - dirty->y0,
+                    GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, data);
+    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+    canvas->dirty = (struct rect){0};
+  }
 
+  /* Nothing to blend if the canvas is blank */
+  const struct rect *drawn = &canvas->drawn;
+  if (rect_empty(drawn)) {
+    glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+    return;
+  }
+
+  glPushMatrix();
+  glOrtho(0.0, 1.0, 1.0, 0.0, 0.0, 10.0);
   glEnable(GL_TEXTURE_RECTANGLE);
-  glBindTexture(GL_TEXTURE_RECTANGLE, canvas->texture);
 
-  glPixelStorei(GL_UNPACK_ROW_LENGTH, canvas->width);
-  glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
-  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, canvas->width, canvas->height,
-               0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, data);
+  const double left = (double)drawn->x0 / canvas->width;
+  const double top = (double)drawn->y0 / canvas->height;
+  const double right = (double)drawn->x1 / canvas->width;
+  const double bottom = (double)drawn->y1 / canvas->height;
 
   glEnable(GL_BLEND);
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   glBegin(GL_TRIANGLE_FAN);
-  glTexCoord2i(0,             0);              glVertex2i(0.0, 0.0);
-  glTexCoord2i(canvas->width, 0);              glVertex2i(1.0, 0.0);
-  glTexCoord2i(canvas->width, canvas->height); glVertex2i(1.0, 1.0);
-  glTexCoord2i(0,             canvas->height); glVertex2i(0.0, 1.0);
+  glTexCoord2i(drawn->x0, drawn->y0); glVertex2d(left, top);
+  glTexCoord2i(drawn->x1, drawn->y0); glVertex2d(right, top);
+  glTexCoord2i(drawn->x1, drawn->y1); glVertex2d(right, bottom);
+  glTexCoord2i(drawn->x0, drawn->y1); glVertex2d(left, bottom);
   glEnd();
   glDisable(GL_BLEND);
 
@@ -251,28 +394,216 @@ void imv_canvas_draw(struct imv_canvas *canvas)
 
 struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image);
 
-static int convert_pixelformat(enum imv_pixelformat fmt)
+/* How to upload pixels of a given imv_pixelformat */
+struct gl_format {
+  GLint internal_format;
+  GLenum format;
+  GLenum type;
+};
+
+static struct gl_format convert_pixelformat(enum imv_pixelformat fmt)
 {
   /* opengl uses RGBA order, not ARGB, so we get it to
    * flip the bytes around so ARGB -> BGRA
    */
   if (fmt == IMV_ARGB) {
-    return GL_BGRA;
+    return (struct gl_format){GL_RGBA8, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV};
   } else if (fmt == IMV_ABGR) {
-    return GL_RGBA;
+    return (struct gl_format){GL_RGBA8, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV};
+  } else if (fmt == IMV_RGB) {
+    return (struct gl_format){GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE};
+  } else if (fmt == IMV_GRAY) {
+    /* luminance is spread across red, green and blue when sampled */
+    return (struct gl_format){GL_LUMINANCE8, GL_LUMINANCE, GL_UNSIGNED_BYTE};
+  } else if (fmt == IMV_GRAY_ALPHA) {
+    return (struct gl_format){GL_LUMINANCE8_ALPHA8, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE};
   } else {
     imv_log(IMV_WARNING, "Unknown pixel format. Defaulting to ARGB\n");
-    return GL_BGRA;
+    return (struct gl_format){GL_RGBA8, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV};
+  }
+}
+
+/* Bitmaps stored bottom-up are uploaded as they are, leaving the texture
+ * upside down, so this maps a row of the bitmap to its row in the texture */
+static int texture_row(struct imv_bitmap *bitmap, int row)
+{
+  return bitmap->stride < 0 ? bitmap->height - row : row;
+}
+
+/* Upload columns x up to x + width of rows first_row up to last_row of bitmap
+ * to the bound texture */
+static void upload_rect(struct imv_bitmap *bitmap, struct gl_format format,
+                        int x, int width, int first_row, int last_row)
+{
+  if (first_row >= last_row || width <= 0) {
+    return;
+  }
+
+  /* start from whichever row comes first in memory */
+  const int start_row = bitmap->stride < 0 ? last_row - 1 : first_row;
+  const int tex_row = bitmap->stride < 0 ? bitmap->height - last_row : first_row;
+  const size_t offset = (size_t)x * imv_pixelformat_bytes(bitmap->format);
+  glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, x, tex_row, width,
+      last_row - first_row, format.format, format.type,
+      bitmap->data + (ptrdiff_t)start_row * bitmap->stride + offset);
+}
+
+/* Upload rows first_row up to last_row of bitmap to the bound texture */
+static void upload_rows(struct imv_bitmap *bitmap, struct gl_format format,
+                        int first_row, int last_row)
+{
+  upload_rect(bitmap, format, 0, bitmap->width, first_row, last_row);
+}
+
+/* Uploading a very large bitmap in one go stalls rendering for as long as the
+ * driver takes to copy it, so it's done a chunk at a time, stopping for the
+ * frame once the time budget's been used up.
+ */
+#define UPLOAD_CHUNK_BYTES (4 * 1024 * 1024)
+#define UPLOAD_TIME_BUDGET 0.008 /* seconds */
+
+/* Bitmaps bigger than this get a preview to show while they're uploaded */
+#define PREVIEW_THRESHOLD (4 * UPLOAD_CHUNK_BYTES)
+#define PREVIEW_SIZE 1024
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
+}
+
+/* Upload as many of the ready rows that aren't in the texture yet as the time
+ * budget allows. Returns true if there are still rows left to upload.
+ */
+static bool upload_pending_rows(struct imv_canvas *canvas,
+                                struct imv_bitmap *bitmap,
+                                struct gl_format format,
+                                int first_row, int last_row)
+{
+  int chunk = UPLOAD_CHUNK_BYTES / abs(bitmap->stride);
+  if (chunk < 1) {
+    chunk = 1;
+  }
+
+  const double deadline = now() + UPLOAD_TIME_BUDGET;
+  bool uploaded = false;
+  while (canvas->cache.first_row > first_row || canvas->cache.last_row < last_row) {
+    /* always make some progress, however slow the driver is */
+    if (uploaded && now() >= deadline) {
+      return true;
+    }
+
+    if (canvas->cache.last_row < last_row) {
+      int end = canvas->cache.last_row + chunk;
+      if (end > last_row) {
+        end = last_row;
+      }
+      upload_rows(bitmap, format, canvas->cache.last_row, end);
+      canvas->cache.last_row = end;
+    } else {
+      int start = canvas->cache.first_row - chunk;
+      if (start < first_row) {
+        start = first_row;
+      }
+      upload_rows(bitmap, format, start, canvas->cache.first_row);
+      canvas->cache.first_row = start;
+    }
+    uploaded = true;
+  }
+  return false;
+}
+
+/* Build and upload a nearest neighbour downscale of the bitmap. Only a small
+ * fraction of its rows and pixels are read, so this is quick at any size.
+ */
+static void upload_preview(struct imv_canvas *canvas, struct imv_bitmap *bitmap,
+                           struct gl_format format, GLint filter)
+{
+  const int largest = bitmap->width > bitmap->height ? bitmap->width : bitmap->height;
+  const int step = (largest + PREVIEW_SIZE - 1) / PREVIEW_SIZE;
+  const int bpp = imv_pixelformat_bytes(bitmap->format);
+  const int width = (bitmap->width + step - 1) / step;
+  const int height = (bitmap->height + step - 1) / step;
+
+  unsigned char *data = malloc((size_t)width * height * bpp);
+  if (!data) {
+    return;
+  }
+
+  unsigned char *out = data;
+  for (int y = 0; y < height; ++y) {
+    const unsigned char *row = bitmap->data + (ptrdiff_t)y * step * bitmap->stride;
+    for (int x = 0; x < width; ++x) {
+      memcpy(out, row + (size_t)x * step * bpp, bpp);
+      out += bpp;
+    }
   }
+
+  if (!canvas->cache.preview_texture) {
+    glGenTextures(1, &canvas->cache.preview_texture);
+  }
+  glBindTexture(GL_TEXTURE_RECTANGLE, canvas->cache.preview_texture);
+  glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, filter);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, format.internal_format, width, height,
+      0, format.format, format.type, data);
+  free(data);
+
+  canvas->cache.preview_width = width;
+  canvas->cache.preview_height = height;
+  canvas->cache.has_preview = true;
+}
+
+/* Upload a new image to the cached texture, reusing its storage if it's the
+ * same size, and only uploading the changed area if it's an animation frame
+ * following on from the image already there. Returns true if the texture now
+ * holds the whole image.
+ */
+static bool replace_cached_image(struct imv_canvas *canvas,
+                                 struct imv_image *image,
+                                 struct imv_bitmap *bitmap,
+                                 struct gl_format format,
+                                 int first_row, int last_row)
+{
+  const bool same_storage = canvas->cache.texture_width == bitmap->width
+    && canvas->cache.texture_height == bitmap->height
+    && canvas->cache.texture_format == format.internal_format;
+  const bool have_previous = same_storage && canvas->cache.first_row == 0
+    && canvas->cache.last_row == bitmap->height;
+
+  int x, y, w, h;
+  if (have_previous && first_row == 0 && last_row == bitmap->height
+      && imv_image_get_damage(image, canvas->cache.serial, &x, &y, &w, &h)) {
+    upload_rect(bitmap, format, x, w, y, y + h);
+    return true;
+  }
+
+  if (!same_storage) {
+    /* Any rows not ready yet may still be being written to, so leave them */
+    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, format.internal_format, bitmap->width,
+        bitmap->height, 0, format.format, format.type, NULL);
+    canvas->cache.texture_width = bitmap->width;
+    canvas->cache.texture_height = bitmap->height;
+    canvas->cache.texture_format = format.internal_format;
+  }
+  return false;
 }
 
-static void draw_bitmap(struct imv_canvas *canvas,
-                        struct imv_bitmap *bitmap,
+static bool draw_bitmap(struct imv_canvas *canvas,
+                        struct imv_image *image,
                         int bx, int by, double scale,
                         double rotation, bool mirrored,
                         enum upscaling_method upscaling_method,
                         bool cache_invalidated)
 {
+  struct imv_bitmap *bitmap = imv_image_get_bitmap(image);
+  const int width = imv_image_width(image);
+  const int height = imv_image_height(image);
+  int first_row, last_row;
+  imv_image_get_ready_rows(image, &first_row, &last_row);
+
   GLint viewport[4];
   glGetIntegerv(GL_VIEWPORT, viewport);
 
@@ -283,9 +614,8 @@ static void draw_bitmap(struct imv_canvas *canvas,
     glGenTextures(1, &canvas->cache.texture);
   }
 
-  const int format = convert_pixelformat(bitmap->format);
-
-  glBindTexture(GL_TEXTURE_RECTANGLE, canvas->cache.texture);
+  const struct gl_format format = convert_pixelformat(bitmap->format);
+  const int row_length = abs(bitmap->stride) / imv_pixelformat_bytes(bitmap->format);
 
   GLint upscaling = 0;
   if (upscaling_method == UPSCALING_LINEAR) {
@@ -297,16 +627,47 @@ static void draw_bitmap(struct imv_canvas *canvas,
     abort();
   }
 
-  if (canvas->cache.bitmap != bitmap || cache_invalidated) {
+  /* rows of 1 and 3 byte pixels aren't necessarily 4 byte aligned */
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+
+  const unsigned long serial = imv_image_serial(image);
+  if (canvas->cache.serial != serial) {
+    glBindTexture(GL_TEXTURE_RECTANGLE, canvas->cache.texture);
     glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, upscaling);
     glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, upscaling);
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, bitmap->width);
-    glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
-    glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
-    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, bitmap->width, bitmap->height,
-        0, format, GL_UNSIGNED_INT_8_8_8_8_REV, bitmap->data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+    canvas->cache.has_preview = false;
+    const bool complete = replace_cached_image(canvas, image, bitmap, format,
+        first_row, last_row);
+    canvas->cache.serial = serial;
+    if (complete) {
+      canvas->cache.first_row = 0;
+      canvas->cache.last_row = bitmap->height;
+    } else {
+      canvas->cache.first_row = first_row;
+      canvas->cache.last_row = first_row;
+
+      /* Only worth it if the whole image is ready, otherwise the decoded rows
+       * are already appearing a bit at a time anyway */
+      if (first_row == 0 && last_row == bitmap->height
+          && (size_t)abs(bitmap->stride) * bitmap->height > PREVIEW_THRESHOLD) {
+        upload_preview(canvas, bitmap, format, upscaling);
+        glBindTexture(GL_TEXTURE_RECTANGLE, canvas->cache.texture);
+      }
+    }
+  } else {
+    glBindTexture(GL_TEXTURE_RECTANGLE, canvas->cache.texture);
+    if (cache_invalidated) {
+      glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, upscaling);
+      glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, upscaling);
+    }
   }
-  canvas->cache.bitmap = bitmap;
+
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+  const bool pending = upload_pending_rows(canvas, bitmap, format, first_row, last_row);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 
   glEnable(GL_TEXTURE_RECTANGLE);
 
@@ -314,10 +675,19 @@ static void draw_bitmap(struct imv_canvas *canvas,
 
   const int left = bx;
   const int top = by;
-  const int right = left + bitmap->width * scale;
-  const int bottom = top + bitmap->height * scale;
-  const int center_x = left + bitmap->width * scale / 2;
-  const int center_y = top + bitmap->height * scale / 2;
+  /* the bitmap may have been decoded at reduced resolution, in which case
+   * it's stretched over the full size of the image */
+  const int right = left + width * scale;
+  const int bottom = top + height * scale;
+  const int center_x = left + width * scale / 2;
+  const int center_y = top + height * scale / 2;
+
+  /* only draw the rows that have been uploaded */
+  const int uploaded_first = canvas->cache.first_row;
+  const int uploaded_last = canvas->cache.last_row;
+  const double row_scale = (double)height * scale / bitmap->height;
+  const int ready_top = top + uploaded_first * row_scale;
+  const int ready_bottom = uploaded_last == bitmap->height ? bottom : top + uploaded_last * row_scale;
 
   glTranslated(center_x, center_y, 0);
   if (mirrored) {
@@ -329,11 +699,33 @@ static void draw_bitmap(struct imv_canvas *canvas,
   glEnable(GL_BLEND);
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
+  if (pending && canvas->cache.has_preview) {
+    /* the preview only covers what's missing, or alpha would be blended twice */
+    const int pw = canvas->cache.preview_width;
+    const int ph = canvas->cache.preview_height;
+    const double preview_scale = (double)ph / bitmap->height;
+    glBindTexture(GL_TEXTURE_RECTANGLE, canvas->cache.preview_texture);
+    glBegin(GL_QUADS);
+    glTexCoord2d(0,  0);                             glVertex2i(left, top);
+    glTexCoord2d(pw, 0);                             glVertex2i(right, top);
+    glTexCoord2d(pw, uploaded_first * preview_scale); glVertex2i(right, ready_top);
+    glTexCoord2d(0,  uploaded_first * preview_scale); glVertex2i(left, ready_top);
+    glTexCoord2d(0,  uploaded_last * preview_scale);  glVertex2i(left, ready_bottom);
+    glTexCoord2d(pw, uploaded_last * preview_scale);  glVertex2i(right, ready_bottom);
+    glTexCoord2d(pw, ph);                            glVertex2i(right, bottom);
+    glTexCoord2d(0,  ph);                            glVertex2i(left, bottom);
+    glEnd();
+    glBindTexture(GL_TEXTURE_RECTANGLE, canvas->cache.texture);
+  }
+
+  const int tex_top = texture_row(bitmap, uploaded_first);
+  const int tex_bottom = texture_row(bitmap, uploaded_last);
+
   glBegin(GL_TRIANGLE_FAN);
-  glTexCoord2i(0,             0);              glVertex2i(left, top);
-  glTexCoord2i(bitmap->width, 0);              glVertex2i(right, top);
-  glTexCoord2i(bitmap->width, bitmap->height); glVertex2i(right, bottom);
-  glTexCoord2i(0,             bitmap->height); glVertex2i(left, bottom);
+  glTexCoord2i(0,             tex_top);    glVertex2i(left, ready_top);
+  glTexCoord2i(bitmap->width, tex_top);    glVertex2i(right, ready_top);
+  glTexCoord2i(bitmap->width, tex_bottom); glVertex2i(right, ready_bottom);
+  glTexCoord2i(0,             tex_bottom); glVertex2i(left, ready_bottom);
   glEnd();
 
   glDisable(GL_BLEND);
@@ -341,23 +733,23 @@ static void draw_bitmap(struct imv_canvas *canvas,
   glBindTexture(GL_TEXTURE_RECTANGLE, 0);
   glDisable(GL_TEXTURE_RECTANGLE);
   glPopMatrix();
+
+  return pending;
 }
 
 #ifdef IMV_BACKEND_LIBRSVG
 RsvgHandle *imv_image_get_svg(const struct imv_image *image);
 #endif
 
-void imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
+bool imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
                            int x, int y, double scale,
                            double rotation, bool mirrored,
                            enum upscaling_method upscaling_method,
                            bool cache_invalidated)
 {
-  struct imv_bitmap *bitmap = imv_image_get_bitmap(image);
-  if (bitmap) {
-    draw_bitmap(canvas, bitmap, x, y, scale, rotation, mirrored,
-                upscaling_method, cache_invalidated);
-    return;
+  if (imv_image_get_bitmap(image)) {
+    return draw_bitmap(canvas, image, x, y, scale, rotation, mirrored,
+                       upscaling_method, cache_invalidated);
   }
 
 #ifdef IMV_BACKEND_LIBRSVG
@@ -374,8 +766,10 @@ void imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
     cairo_translate(canvas->cairo, -imv_image_width(image) / 2, -imv_image_height(image) / 2);
     rsvg_handle_render_cairo(svg, canvas->cairo);
     cairo_identity_matrix(canvas->cairo);
+    mark_all_drawn(canvas);
     imv_canvas_draw(canvas);
-    return;
+    return false;
   }
 #endif
+  return false;
 }
@@ -58,8 +58,11 @@ int imv_canvas_printf(struct imv_canvas *canvas, int x, int y, const char *fmt,
 /* Blit the canvas to the current OpenGL framebuffer */
 void imv_canvas_draw(struct imv_canvas *canvas);
 
-/* Blit the given image to the current OpenGL framebuffer */
-void imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
+/* Blit the given image to the current OpenGL framebuffer. Large images are
+ * uploaded over several frames, in which case this returns true and should be
+ * called again soon to finish the job.
+ */
+bool imv_canvas_draw_image(struct imv_canvas *canvas, struct imv_image *image,
                            int x, int y, double scale,
                            double rotation, bool mirrored,
                            enum upscaling_method upscaling_method,
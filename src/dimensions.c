@@ -0,0 +1,246 @@
+#include "dimensions.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+
+/* Gives up on a JPEG if its frame header isn't within this many segments, or
+ * a TIFF if its size isn't within this many tags */
+#define MAX_ENTRIES 1024
+
+/* The start of a file, and the file to read anything beyond it from */
+struct header {
+  int fd;
+  unsigned char data[IMV_BACKEND_HEADER_LEN];
+  size_t len;
+};
+
+static uint32_t be16(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 8 | p[1];
+}
+
+static uint32_t be32(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t le16(const unsigned char *p)
+{
+  return (uint32_t)p[1] << 8 | p[0];
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+  return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+/* Copies len bytes from offset into buf, only going back to the file if
+ * they're past what's already been read */
+static bool read_bytes(struct header *header, size_t offset, void *buf,
+    size_t len)
+{
+  if (offset + len <= header->len) {
+    memcpy(buf, header->data + offset, len);
+    return true;
+  }
+
+  size_t total = 0;
+  while (total < len) {
+    const ssize_t got = pread(header->fd, (char *)buf + total, len - total,
+        (off_t)(offset + total));
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    total += (size_t)got;
+  }
+  return true;
+}
+
+static bool png_dimensions(struct header *header, int *width, int *height)
+{
+  const unsigned char *data = header->data;
+  if (header->len < 24 || memcmp(data, "\x89PNG\r\n\x1a\n", 8) ||
+      memcmp(data + 12, "IHDR", 4)) {
+    return false;
+  }
+  *width = (int)be32(data + 16);
+  *height = (int)be32(data + 20);
+  return true;
+}
+
+static bool gif_dimensions(struct header *header, int *width, int *height)
+{
+  const unsigned char *data = header->data;
+  if (header->len < 10 ||
+      (memcmp(data, "GIF87a", 6) && memcmp(data, "GIF89a", 6))) {
+    return false;
+  }
+  *width = (int)le16(data + 6);
+  *height = (int)le16(data + 8);
+  return true;
+}
+
+static bool bmp_dimensions(struct header *header, int *width, int *height)
+{
+  const unsigned char *data = header->data;
+  if (header->len < 26 || memcmp(data, "BM", 2)) {
+    return false;
+  }
+  if (le32(data + 14) == 12) {
+    /* the old OS/2 header has 16 bit sizes */
+    *width = (int)le16(data + 18);
+    *height = (int)le16(data + 20);
+  } else {
+    /* a negative height means the rows are stored top down */
+    *width = (int)(int32_t)le32(data + 18);
+    *height = abs((int)(int32_t)le32(data + 22));
+  }
+  return true;
+}
+
+static bool jpeg_dimensions(struct header *header, int *width, int *height)
+{
+  if (header->len < 4 || header->data[0] != 0xFF || header->data[1] != 0xD8) {
+    return false;
+  }
+
+  /* the frame header can come after some large segments, such as a
+   * thumbnail, so skip from one segment to the next until it turns up */
+  size_t offset = 2;
+  for (int i = 0; i < MAX_ENTRIES; ++i) {
+    unsigned char segment[9];
+    if (!read_bytes(header, offset, segment, 4) || segment[0] != 0xFF) {
+      return false;
+    }
+
+    const unsigned char marker = segment[1];
+    if (marker == 0xFF) {
+      /* padding */
+      offset++;
+      continue;
+    }
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD9)) {
+      /* markers without a length */
+      offset += 2;
+      continue;
+    }
+
+    /* any start of frame, except the huffman, arithmetic coding and JPEG
+     * extension markers that share the range */
+    if (marker >= 0xC0 && marker <= 0xCF &&
+        marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      if (!read_bytes(header, offset, segment, sizeof segment)) {
+        return false;
+      }
+      *height = (int)be16(segment + 5);
+      *width = (int)be16(segment + 7);
+      return true;
+    }
+
+    offset += 2 + be16(segment + 2);
+  }
+  return false;
+}
+
+static bool tiff_dimensions(struct header *header, int *width, int *height)
+{
+  const unsigned char *data = header->data;
+  if (header->len < 8) {
+    return false;
+  }
+
+  bool little_endian;
+  if (!memcmp(data, "II*\0", 4)) {
+    little_endian = true;
+  } else if (!memcmp(data, "MM\0*", 4)) {
+    little_endian = false;
+  } else {
+    return false;
+  }
+  uint32_t (*u16)(const unsigned char *) = little_endian ? le16 : be16;
+  uint32_t (*u32)(const unsigned char *) = little_endian ? le32 : be32;
+
+  /* the size is in the first image's directory of tags */
+  const size_t dir = u32(data + 4);
+  unsigned char buf[12];
+  if (!read_bytes(header, dir, buf, 2)) {
+    return false;
+  }
+  const uint32_t num_entries = u16(buf);
+
+  *width = 0;
+  *height = 0;
+  for (uint32_t i = 0; i < num_entries && i < MAX_ENTRIES; ++i) {
+    if (!read_bytes(header, dir + 2 + 12 * i, buf, sizeof buf)) {
+      return false;
+    }
+    const uint32_t tag = u16(buf);
+    const uint32_t type = u16(buf + 2);
+
+    /* the value is either a short or a long, stored in place */
+    uint32_t value;
+    if (type == 3) {
+      value = u16(buf + 8);
+    } else if (type == 4) {
+      value = u32(buf + 8);
+    } else {
+      continue;
+    }
+
+    if (tag == 256) {
+      *width = (int)value;
+    } else if (tag == 257) {
+      *height = (int)value;
+    }
+  }
+  return true;
+}
+
+bool imv_read_dimensions(const char *path, int *width, int *height)
+{
+  struct header header;
+  header.fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (header.fd < 0) {
+    return false;
+  }
+
+  header.len = 0;
+  while (header.len < sizeof header.data) {
+    const ssize_t got = read(header.fd, header.data + header.len,
+        sizeof header.data - header.len);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+    header.len += (size_t)got;
+  }
+
+  int w = 0;
+  int h = 0;
+  const bool found = png_dimensions(&header, &w, &h) ||
+                     jpeg_dimensions(&header, &w, &h) ||
+                     gif_dimensions(&header, &w, &h) ||
+                     bmp_dimensions(&header, &w, &h) ||
+                     tiff_dimensions(&header, &w, &h);
+  close(header.fd);
+
+  if (!found || w <= 0 || h <= 0) {
+    return false;
+  }
+  *width = w;
+  *height = h;
+  return true;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,13 @@
+#ifndef IMV_DIMENSIONS_H
+#define IMV_DIMENSIONS_H
+
+#include <stdbool.h>
+
+/* Reads an image's width and height from its header, without decoding it.
+ * Understands PNG, JPEG, GIF, BMP and TIFF files. Returns false if the file
+ * couldn't be read or isn't one of those. */
+bool imv_read_dimensions(const char *path, int *width, int *height);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,437 @@
+#include "dir_watch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef IMV_HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#include "list.h"
+#include "log.h"
+#include "resolve.h"
+
+/* Some systems like GNU/Hurd don't define PATH_MAX */
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifdef IMV_HAVE_INOTIFY
+
+/* After a batch is passed on, new paths are held back for this long so that a
+ * burst of them is gathered into a few large batches rather than many small
+ * ones. The first path after a quiet spell goes straight through. */
+#define BATCH_INTERVAL_MS 50
+
+/* Subdirectories are always watched for being created, so that a directory
+ * can be made recursive after it's first watched */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR)
+
+struct watched_dir {
+  /* NULL if the watch descriptor isn't in use */
+  char *path;
+  bool recursive;
+};
+
+struct request {
+  char *path;
+  bool recursive;
+};
+
+struct imv_dir_watch {
+  imv_dir_watch_callback callback;
+  void *data;
+
+  int inotify_fd;
+
+  /* written to so that the thread notices new requests, or to quit */
+  int wake_fds[2];
+
+  pthread_t thread;
+
+  /* protects requests and quit */
+  pthread_mutex_t lock;
+  struct list *requests;
+  bool quit;
+
+  /* Everything below is only used by the thread */
+
+  /* indexed by watch descriptor, which the kernel hands out in sequence */
+  struct watched_dir *dirs;
+  size_t num_dirs;
+
+  /* paths found but not yet passed on */
+  char **pending;
+  size_t num_pending;
+  size_t pending_cap;
+  struct timespec last_batch;
+};
+
+static void queue_path(struct imv_dir_watch *watch, const char *path)
+{
+  if (watch->num_pending == watch->pending_cap) {
+    watch->pending_cap = watch->pending_cap ? watch->pending_cap * 2 : 64;
+    watch->pending = realloc(watch->pending,
+        watch->pending_cap * sizeof *watch->pending);
+  }
+  watch->pending[watch->num_pending++] = strdup(path);
+}
+
+static void send_batch(struct imv_dir_watch *watch)
+{
+  /* canonicalise the paths here rather than leaving it to the receiver, as
+   * the directories were only just looked at so are likely still cached */
+  struct imv_resolver *resolver = imv_resolver_create();
+  for (size_t i = 0; i < watch->num_pending; ++i) {
+    char *real_path = imv_resolve_path(resolver, watch->pending[i], NULL);
+    if (real_path) {
+      free(watch->pending[i]);
+      watch->pending[i] = real_path;
+    }
+  }
+  imv_resolver_free(resolver);
+
+  watch->callback(watch->pending, watch->num_pending, watch->data);
+  watch->pending = NULL;
+  watch->num_pending = 0;
+  watch->pending_cap = 0;
+  clock_gettime(CLOCK_MONOTONIC, &watch->last_batch);
+}
+
+/* Returns how long to wait before the pending paths can be sent, in ms */
+static int batch_delay(struct imv_dir_watch *watch)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const long elapsed = (now.tv_sec - watch->last_batch.tv_sec) * 1000 +
+    (now.tv_nsec - watch->last_batch.tv_nsec) / 1000000;
+  return elapsed >= BATCH_INTERVAL_MS ? 0 : (int)(BATCH_INTERVAL_MS - elapsed);
+}
+
+static bool is_dir(int dir_fd, const struct dirent *ent)
+{
+#ifdef DT_UNKNOWN
+  /* symlinks are followed, so they have to be looked at too */
+  if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK) {
+    return ent->d_type == DT_DIR;
+  }
+#endif
+  struct stat info;
+  return !fstatat(dir_fd, ent->d_name, &info, 0) && S_ISDIR(info.st_mode);
+}
+
+/* Watches a directory, and its subdirectories if recursive. Any files
+ * already in it are passed on too, as they may have been written before the
+ * watch was in place, even if it's only since the caller last listed it. */
+static void watch_dir(struct imv_dir_watch *watch, const char *path,
+    bool recursive)
+{
+  const int wd = inotify_add_watch(watch->inotify_fd, path, WATCH_MASK);
+  if (wd < 0) {
+    if (errno == ENOSPC) {
+      imv_log(IMV_WARNING, "dir_watch: too many directories to watch %s\n",
+          path);
+    }
+    return;
+  }
+
+  if ((size_t)wd >= watch->num_dirs) {
+    size_t num_dirs = watch->num_dirs ? watch->num_dirs : 64;
+    while ((size_t)wd >= num_dirs) {
+      num_dirs *= 2;
+    }
+    watch->dirs = realloc(watch->dirs, num_dirs * sizeof *watch->dirs);
+    memset(watch->dirs + watch->num_dirs, 0,
+        (num_dirs - watch->num_dirs) * sizeof *watch->dirs);
+    watch->num_dirs = num_dirs;
+  }
+
+  /* the kernel hands back the same descriptor for a directory that's already
+   * watched, which also stops symlink loops being followed forever */
+  struct watched_dir *dir = &watch->dirs[wd];
+  if (dir->path && (dir->recursive || !recursive)) {
+    return;
+  }
+  if (!dir->path) {
+    dir->path = strdup(path);
+  }
+  dir->recursive = recursive;
+
+  const int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  DIR *listing = fdopendir(fd);
+  if (!listing) {
+    close(fd);
+    return;
+  }
+
+  char child[PATH_MAX];
+  struct dirent *ent;
+  while ((ent = readdir(listing))) {
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+      continue;
+    }
+    if ((size_t)snprintf(child, sizeof child, "%s/%s", path, ent->d_name)
+        >= sizeof child) {
+      continue;
+    }
+    if (is_dir(fd, ent)) {
+      if (recursive) {
+        watch_dir(watch, child, true);
+      }
+    } else {
+      queue_path(watch, child);
+    }
+  }
+  closedir(listing);
+}
+
+static void read_events(struct imv_dir_watch *watch)
+{
+  union {
+    struct inotify_event event;
+    char buf[16384];
+  } events;
+  char path[PATH_MAX];
+
+  ssize_t len;
+  while ((len = read(watch->inotify_fd, &events, sizeof events)) > 0) {
+    for (char *ptr = events.buf; ptr < events.buf + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)ptr;
+      ptr += sizeof *event + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        imv_log(IMV_WARNING, "dir_watch: too many changes at once, "
+            "some new files may have been missed\n");
+        continue;
+      }
+      if (event->wd < 0 || (size_t)event->wd >= watch->num_dirs) {
+        continue;
+      }
+
+      struct watched_dir *dir = &watch->dirs[event->wd];
+      if (event->mask & IN_IGNORED) {
+        /* the directory's gone, or been unmounted */
+        free(dir->path);
+        dir->path = NULL;
+        continue;
+      }
+      if (!dir->path || event->len == 0) {
+        continue;
+      }
+      if ((size_t)snprintf(path, sizeof path, "%s/%s", dir->path, event->name)
+          >= sizeof path) {
+        continue;
+      }
+
+      if (event->mask & IN_ISDIR) {
+        if (dir->recursive && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+          watch_dir(watch, path, true);
+        }
+      } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        /* files are only passed on once they've been written, not when
+         * they're first created */
+        queue_path(watch, path);
+      }
+    }
+  }
+}
+
+static void *watch_thread(void *data)
+{
+  struct imv_dir_watch *watch = data;
+
+  while (1) {
+    int timeout = -1;
+    if (watch->num_pending > 0) {
+      timeout = batch_delay(watch);
+      if (timeout == 0) {
+        send_batch(watch);
+        timeout = -1;
+      }
+    }
+
+    struct pollfd fds[] = {
+      {.fd = watch->inotify_fd, .events = POLLIN},
+      {.fd = watch->wake_fds[0], .events = POLLIN},
+    };
+    if (poll(fds, sizeof fds / sizeof *fds, timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      char buf[64];
+      while (read(watch->wake_fds[0], buf, sizeof buf) > 0) {
+        continue;
+      }
+
+      pthread_mutex_lock(&watch->lock);
+      struct list *requests = watch->requests;
+      watch->requests = list_create();
+      const bool quit = watch->quit;
+      pthread_mutex_unlock(&watch->lock);
+
+      for (size_t i = 0; i < requests->len; ++i) {
+        struct request *request = requests->items[i];
+        if (!quit) {
+          watch_dir(watch, request->path, request->recursive);
+        }
+        free(request->path);
+      }
+      list_deep_free(requests);
+
+      if (quit) {
+        break;
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      read_events(watch);
+    }
+  }
+
+  return NULL;
+}
+
+static void set_nonblocking(int fd)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+/* Wakes the watching thread to pick up new requests, or to quit */
+static void wake_thread(struct imv_dir_watch *watch)
+{
+  ssize_t rc;
+  do {
+    rc = write(watch->wake_fds[1], "", 1);
+    /* if the pipe's full the thread's due to wake anyway */
+  } while (rc < 0 && errno == EINTR);
+}
+
+struct imv_dir_watch *imv_dir_watch_create(imv_dir_watch_callback callback,
+    void *data)
+{
+  struct imv_dir_watch *watch = calloc(1, sizeof *watch);
+  watch->callback = callback;
+  watch->data = data;
+
+  watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch->inotify_fd < 0) {
+    free(watch);
+    return NULL;
+  }
+
+  if (pipe(watch->wake_fds)) {
+    close(watch->inotify_fd);
+    free(watch);
+    return NULL;
+  }
+  set_nonblocking(watch->wake_fds[0]);
+  set_nonblocking(watch->wake_fds[1]);
+
+  pthread_mutex_init(&watch->lock, NULL);
+  watch->requests = list_create();
+
+  if (pthread_create(&watch->thread, NULL, &watch_thread, watch)) {
+    list_free(watch->requests);
+    pthread_mutex_destroy(&watch->lock);
+    close(watch->wake_fds[0]);
+    close(watch->wake_fds[1]);
+    close(watch->inotify_fd);
+    free(watch);
+    return NULL;
+  }
+
+  return watch;
+}
+
+void imv_dir_watch_free(struct imv_dir_watch *watch)
+{
+  if (!watch) {
+    return;
+  }
+
+  pthread_mutex_lock(&watch->lock);
+  watch->quit = true;
+  pthread_mutex_unlock(&watch->lock);
+  wake_thread(watch);
+  pthread_join(watch->thread, NULL);
+
+  for (size_t i = 0; i < watch->requests->len; ++i) {
+    struct request *request = watch->requests->items[i];
+    free(request->path);
+  }
+  list_deep_free(watch->requests);
+
+  for (size_t i = 0; i < watch->num_dirs; ++i) {
+    free(watch->dirs[i].path);
+  }
+  free(watch->dirs);
+
+  for (size_t i = 0; i < watch->num_pending; ++i) {
+    free(watch->pending[i]);
+  }
+  free(watch->pending);
+
+  pthread_mutex_destroy(&watch->lock);
+  close(watch->wake_fds[0]);
+  close(watch->wake_fds[1]);
+  close(watch->inotify_fd);
+  free(watch);
+}
+
+void imv_dir_watch_add(struct imv_dir_watch *watch, const char *path,
+    bool recursive)
+{
+  struct request *request = malloc(sizeof *request);
+  request->path = strdup(path);
+  request->recursive = recursive;
+
+  pthread_mutex_lock(&watch->lock);
+  list_append(watch->requests, request);
+  pthread_mutex_unlock(&watch->lock);
+  wake_thread(watch);
+}
+
+#else
+
+struct imv_dir_watch *imv_dir_watch_create(imv_dir_watch_callback callback,
+    void *data)
+{
+  (void)callback;
+  (void)data;
+  return NULL;
+}
+
+void imv_dir_watch_free(struct imv_dir_watch *watch)
+{
+  (void)watch;
+}
+
+void imv_dir_watch_add(struct imv_dir_watch *watch, const char *path,
+    bool recursive)
+{
+  (void)watch;
+  (void)path;
+  (void)recursive;
+}
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,38 @@
+#ifndef IMV_DIR_WATCH_H
+#define IMV_DIR_WATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Watches directories for files being written into them or moved into them,
+ * and passes the new paths on in batches from a background thread, so that a
+ * burst of thousands of files costs the caller a handful of calls.
+ */
+struct imv_dir_watch;
+
+/* Called from the watch's thread with a batch of new paths, in the order they
+ * turned up. Paths are canonical, as realpath(3) makes them, unless they
+ * vanished before they could be resolved. Ownership of the array and each path
+ * in it is passed on. */
+typedef void (*imv_dir_watch_callback)(char **paths, size_t count, void *data);
+
+/* Creates an instance of imv_dir_watch. Returns NULL if directories can't be
+ * watched on this system. */
+struct imv_dir_watch *imv_dir_watch_create(imv_dir_watch_callback callback,
+    void *data);
+
+/* Stops watching and cleans up, waiting for the thread to finish */
+void imv_dir_watch_free(struct imv_dir_watch *watch);
+
+/* Start watching a directory. If recursive is set, its subdirectories are
+ * watched too, including ones created later. Once the watch is in place, the
+ * files already there are passed on as well, so that none written since the
+ * caller listed the directory are missed. The caller should skip those it
+ * already has. Paths that aren't directories are ignored. An internal copy of
+ * path is made. */
+void imv_dir_watch_add(struct imv_dir_watch *watch, const char *path,
+    bool recursive);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
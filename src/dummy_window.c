@@ -82,6 +82,12 @@ void imv_window_wait_for_event(struct imv_window *window, double timeout)
   (void)timeout;
 }
 
+void imv_window_watch_fd(struct imv_window *window, int fd)
+{
+  (void)window;
+  (void)fd;
+}
+
 void imv_window_push_event(struct imv_window *window, struct imv_event *e)
 {
   (void)window;
@@ -0,0 +1,263 @@
+#include "event_queue.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef IMV_HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+/* Must be a power of two. Big enough for a burst of paths from stdin without
+ * spilling over, while still fairly small. */
+#define RING_SIZE 1024
+
+struct slot {
+  /* equal to the position being written to this slot when it's free, and to
+   * that position plus one once it holds an event */
+  size_t sequence;
+  struct imv_event event;
+};
+
+struct overflow {
+  struct imv_event event;
+  struct overflow *next;
+};
+
+struct imv_event_queue {
+  struct slot slots[RING_SIZE];
+
+  /* next position to be claimed by a producer */
+  size_t tail;
+  /* next position to be popped, only touched by the consumer */
+  size_t head;
+
+  /* Events that didn't fit in the ring. While there are any, every new event
+   * goes here too so that they stay in order. */
+  pthread_mutex_t overflow_lock;
+  struct overflow *overflow_head;
+  struct overflow *overflow_tail;
+  size_t overflow_count;
+
+  /* set once the fd has been made readable, until the consumer next looks */
+  bool signalled;
+
+#ifdef IMV_HAVE_EVENTFD
+  int event_fd;
+#else
+  int pipe_fds[2];
+#endif
+};
+
+#ifndef IMV_HAVE_EVENTFD
+static void set_nonblocking(int fd)
+{
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+#endif
+
+struct imv_event_queue *imv_event_queue_create(void)
+{
+  struct imv_event_queue *queue = calloc(1, sizeof *queue);
+  for (size_t i = 0; i < RING_SIZE; ++i) {
+    queue->slots[i].sequence = i;
+  }
+  pthread_mutex_init(&queue->overflow_lock, NULL);
+
+#ifdef IMV_HAVE_EVENTFD
+  queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (queue->event_fd < 0) {
+    pthread_mutex_destroy(&queue->overflow_lock);
+    free(queue);
+    return NULL;
+  }
+#else
+  if (pipe(queue->pipe_fds)) {
+    pthread_mutex_destroy(&queue->overflow_lock);
+    free(queue);
+    return NULL;
+  }
+  set_nonblocking(queue->pipe_fds[0]);
+  set_nonblocking(queue->pipe_fds[1]);
+#endif
+
+  return queue;
+}
+
+void imv_event_queue_free(struct imv_event_queue *queue)
+{
+  if (!queue) {
+    return;
+  }
+
+  while (queue->overflow_head) {
+    struct overflow *next = queue->overflow_head->next;
+    free(queue->overflow_head);
+    queue->overflow_head = next;
+  }
+  pthread_mutex_destroy(&queue->overflow_lock);
+
+#ifdef IMV_HAVE_EVENTFD
+  close(queue->event_fd);
+#else
+  close(queue->pipe_fds[0]);
+  close(queue->pipe_fds[1]);
+#endif
+  free(queue);
+}
+
+int imv_event_queue_fd(struct imv_event_queue *queue)
+{
+#ifdef IMV_HAVE_EVENTFD
+  return queue->event_fd;
+#else
+  return queue->pipe_fds[0];
+#endif
+}
+
+static void signal_consumer(struct imv_event_queue *queue)
+{
+  /* one wakeup is enough, however many events arrive before it's noticed */
+  if (__atomic_exchange_n(&queue->signalled, true, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+
+#ifdef IMV_HAVE_EVENTFD
+  uint64_t one = 1;
+  ssize_t rc = write(queue->event_fd, &one, sizeof one);
+#else
+  char byte = 0;
+  ssize_t rc = write(queue->pipe_fds[1], &byte, sizeof byte);
+#endif
+  /* if it can't be written to it's already readable */
+  (void)rc;
+}
+
+static void clear_signal(struct imv_event_queue *queue)
+{
+#ifdef IMV_HAVE_EVENTFD
+  uint64_t count;
+  ssize_t rc = read(queue->event_fd, &count, sizeof count);
+  (void)rc;
+#else
+  char buf[64];
+  while (read(queue->pipe_fds[0], buf, sizeof buf) > 0) {
+  }
+#endif
+}
+
+/* Claim a free slot and fill it, returning false if the ring is full */
+static bool push_ring(struct imv_event_queue *queue, const struct imv_event *e)
+{
+  size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  while (1) {
+    struct slot *slot = &queue->slots[pos & (RING_SIZE - 1)];
+    const size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+    if (diff == 0) {
+      /* the slot's free, try and claim it. On failure pos is reloaded. */
+      if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        slot->event = *e;
+        __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+    } else if (diff < 0) {
+      /* the consumer hasn't got round to this slot yet */
+      return false;
+    } else {
+      /* another producer got here first */
+      pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static bool pop_ring(struct imv_event_queue *queue, struct imv_event *e)
+{
+  struct slot *slot = &queue->slots[queue->head & (RING_SIZE - 1)];
+  const size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+  if (sequence != queue->head + 1) {
+    return false;
+  }
+
+  *e = slot->event;
+  /* free the slot up for the producer that wraps around to it */
+  __atomic_store_n(&slot->sequence, queue->head + RING_SIZE, __ATOMIC_RELEASE);
+  queue->head++;
+  return true;
+}
+
+static void push_overflow(struct imv_event_queue *queue, const struct imv_event *e)
+{
+  struct overflow *node = malloc(sizeof *node);
+  node->event = *e;
+  node->next = NULL;
+
+  if (queue->overflow_tail) {
+    queue->overflow_tail->next = node;
+  } else {
+    queue->overflow_head = node;
+  }
+  queue->overflow_tail = node;
+  __atomic_store_n(&queue->overflow_count, queue->overflow_count + 1,
+      __ATOMIC_RELEASE);
+}
+
+void imv_event_queue_push(struct imv_event_queue *queue, const struct imv_event *e)
+{
+  bool pushed = false;
+  if (__atomic_load_n(&queue->overflow_count, __ATOMIC_ACQUIRE) == 0) {
+    pushed = push_ring(queue, e);
+  }
+
+  if (!pushed) {
+    pthread_mutex_lock(&queue->overflow_lock);
+    /* the overflow may have drained since, but keep the order simple */
+    if (queue->overflow_count > 0 || !push_ring(queue, e)) {
+      push_overflow(queue, e);
+    }
+    pthread_mutex_unlock(&queue->overflow_lock);
+  }
+
+  signal_consumer(queue);
+}
+
+bool imv_event_queue_pop(struct imv_event_queue *queue, struct imv_event *e)
+{
+  /* Reset the wakeup before looking, so that anything pushed from here on
+   * signals again */
+  if (__atomic_load_n(&queue->signalled, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(&queue->signalled, false, __ATOMIC_SEQ_CST);
+    clear_signal(queue);
+  }
+
+  /* anything still in the ring came before whatever overflowed */
+  if (pop_ring(queue, e)) {
+    return true;
+  }
+
+  if (__atomic_load_n(&queue->overflow_count, __ATOMIC_ACQUIRE) == 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&queue->overflow_lock);
+  struct overflow *node = queue->overflow_head;
+  queue->overflow_head = node->next;
+  if (!queue->overflow_head) {
+    queue->overflow_tail = NULL;
+  }
+  __atomic_store_n(&queue->overflow_count, queue->overflow_count - 1,
+      __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&queue->overflow_lock);
+
+  *e = node->event;
+  free(node);
+  return true;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,36 @@
+#ifndef IMV_EVENT_QUEUE_H
+#define IMV_EVENT_QUEUE_H
+
+#include <stdbool.h>
+
+#include "window.h"
+
+/* A queue of imv_events that any thread may push to, but only the thread
+ * running the event loop pops from. Events are copied into a fixed ring of
+ * slots without locking or allocating. Only if the ring fills up do they spill
+ * over into a locked list, so nothing is ever dropped.
+ *
+ * A file descriptor becomes readable when there are events waiting, so the
+ * event loop can poll it alongside the window system's.
+ */
+struct imv_event_queue;
+
+/* Create an empty queue */
+struct imv_event_queue *imv_event_queue_create(void);
+
+/* Clean up a queue, discarding any events still in it */
+void imv_event_queue_free(struct imv_event_queue *queue);
+
+/* Returns a file descriptor that polls as readable while events are waiting */
+int imv_event_queue_fd(struct imv_event_queue *queue);
+
+/* Push a copy of an event. Safe to call from any thread. */
+void imv_event_queue_push(struct imv_event_queue *queue, const struct imv_event *e);
+
+/* Pop the oldest event into e, returning false if the queue's empty. Only to be
+ * called from the thread running the event loop. */
+bool imv_event_queue_pop(struct imv_event_queue *queue, struct imv_event *e);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
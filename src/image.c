@@ -5,27 +5,57 @@
 #include <stdlib.h>
 
 struct imv_image {
+  /* number of holders, images may be shared between threads */
+  int refs;
+  /* unique for the lifetime of the process, unlike the image's address */
+  unsigned long serial;
   int width;
   int height;
+  /* the rows of the bitmap decoded so far, while being progressively loaded */
+  int first_ready_row;
+  int last_ready_row;
+  /* the only area that differs from the image with serial damage_base */
+  unsigned long damage_base;
+  int damage_x, damage_y, damage_width, damage_height;
   struct imv_bitmap *bitmap;
   #ifdef IMV_BACKEND_LIBRSVG
   RsvgHandle *svg;
   #endif
 };
 
+static unsigned long next_serial(void)
+{
+  static unsigned long serial = 0;
+  return __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED);
+}
+
 struct imv_image *imv_image_create_from_bitmap(struct imv_bitmap *bmp)
 {
   struct imv_image *image = calloc(1, sizeof *image);
+  image->refs = 1;
+  image->serial = next_serial();
   image->width = bmp->width;
   image->height = bmp->height;
+  image->last_ready_row = bmp->height;
   image->bitmap = bmp;
   return image;
 }
 
+struct imv_image *imv_image_create_from_scaled_bitmap(struct imv_bitmap *bmp,
+    int width, int height)
+{
+  struct imv_image *image = imv_image_create_from_bitmap(bmp);
+  image->width = width;
+  image->height = height;
+  return image;
+}
+
 #ifdef IMV_BACKEND_LIBRSVG
 struct imv_image *imv_image_create_from_svg(RsvgHandle *handle)
 {
   struct imv_image *image = calloc(1, sizeof *image);
+  image->refs = 1;
+  image->serial = next_serial();
   image->svg = handle;
 
   RsvgDimensionData dim;
@@ -36,12 +66,22 @@ struct imv_image *imv_image_create_from_svg(RsvgHandle *handle)
 }
 #endif
 
+struct imv_image *imv_image_ref(struct imv_image *image)
+{
+  __atomic_add_fetch(&image->refs, 1, __ATOMIC_RELAXED);
+  return image;
+}
+
 void imv_image_free(struct imv_image *image)
 {
   if (!image) {
     return;
   }
 
+  if (__atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+
   if (image->bitmap) {
     imv_bitmap_free(image->bitmap);
   }
@@ -65,6 +105,77 @@ int imv_image_height(const struct imv_image *image)
   return image ? image->height : 0;
 }
 
+int imv_image_decoded_width(const struct imv_image *image)
+{
+  if (image && image->bitmap) {
+    return image->bitmap->width;
+  }
+  return imv_image_width(image);
+}
+
+int imv_image_decoded_height(const struct imv_image *image)
+{
+  if (image && image->bitmap) {
+    return image->bitmap->height;
+  }
+  return imv_image_height(image);
+}
+
+void imv_image_set_ready_rows(struct imv_image *image, int first_row, int last_row)
+{
+  image->first_ready_row = first_row;
+  image->last_ready_row = last_row;
+}
+
+void imv_image_get_ready_rows(const struct imv_image *image, int *first_row,
+    int *last_row)
+{
+  if (!image->bitmap) {
+    *first_row = 0;
+    *last_row = image->height;
+    return;
+  }
+  *first_row = image->first_ready_row;
+  *last_row = image->last_ready_row;
+}
+
+unsigned long imv_image_serial(const struct imv_image *image)
+{
+  return image->serial;
+}
+
+void imv_image_set_damage(struct imv_image *image, unsigned long base,
+    int x, int y, int width, int height)
+{
+  image->damage_base = base;
+  image->damage_x = x;
+  image->damage_y = y;
+  image->damage_width = width;
+  image->damage_height = height;
+}
+
+bool imv_image_get_damage(const struct imv_image *image, unsigned long base,
+    int *x, int *y, int *width, int *height)
+{
+  if (!base || image->damage_base != base) {
+    return false;
+  }
+  *x = image->damage_x;
+  *y = image->damage_y;
+  *width = image->damage_width;
+  *height = image->damage_height;
+  return true;
+}
+
+size_t imv_image_memory_usage(const struct imv_image *image)
+{
+  if (!image || !image->bitmap) {
+    /* vector images are rendered on demand, so hold very little */
+    return 0;
+  }
+  return (size_t)abs(image->bitmap->stride) * image->bitmap->height;
+}
+
 /* Non-public functions, only used by imv_canvas */
 struct imv_bitmap *imv_image_get_bitmap(const struct imv_image *image)
 {
@@ -3,6 +3,9 @@
 
 #include "bitmap.h"
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #ifdef IMV_BACKEND_LIBRSVG
 #include <librsvg/rsvg.h>
 #endif
@@ -11,11 +14,22 @@ struct imv_image;
 
 struct imv_image *imv_image_create_from_bitmap(struct imv_bitmap *bmp);
 
+/* Create an image from a bitmap that was decoded at reduced resolution. The
+ * image reports its full width and height, and the bitmap is stretched to
+ * fit when drawn. */
+struct imv_image *imv_image_create_from_scaled_bitmap(struct imv_bitmap *bmp,
+    int width, int height);
+
 #ifdef IMV_BACKEND_LIBRSVG
 struct imv_image *imv_image_create_from_svg(RsvgHandle *handle);
 #endif
 
-/* Cleans up an imv_image instance */
+/* Takes an extra reference to an imv_image, so that it can be held in more
+ * than one place at once. Returns the image for convenience. */
+struct imv_image *imv_image_ref(struct imv_image *image);
+
+/* Releases a reference to an imv_image, cleaning it up once the last
+ * reference is gone */
 void imv_image_free(struct imv_image *image);
 
 /* Get the image width */
@@ -24,6 +38,38 @@ int imv_image_width(const struct imv_image *image);
 /* Get the image height */
 int imv_image_height(const struct imv_image *image);
 
+/* Get the size the image was actually decoded at, which is smaller than its
+ * width and height if it was decoded at reduced resolution */
+int imv_image_decoded_width(const struct imv_image *image);
+int imv_image_decoded_height(const struct imv_image *image);
+
+/* Set which rows of the image have been decoded so far, the rest shouldn't be
+ * read or drawn. Images start out fully decoded. Only for use by whichever
+ * thread displays the image, not the one decoding it. */
+void imv_image_set_ready_rows(struct imv_image *image, int first_row, int last_row);
+
+/* Get which rows of the bitmap may be drawn, from first_row up to but not
+ * including last_row */
+void imv_image_get_ready_rows(const struct imv_image *image, int *first_row,
+    int *last_row);
+
+/* Get a number identifying this image, never reused by another image */
+unsigned long imv_image_serial(const struct imv_image *image);
+
+/* Record that this image only differs from the image with the given serial
+ * within the given rectangle, such as for an animation frame that only
+ * redraws part of the previous one. */
+void imv_image_set_damage(struct imv_image *image, unsigned long base,
+    int x, int y, int width, int height);
+
+/* If the image only differs from the one with the given serial within a
+ * rectangle, get that rectangle and return true */
+bool imv_image_get_damage(const struct imv_image *image, unsigned long base,
+    int *x, int *y, int *width, int *height);
+
+/* Get the approximate number of bytes of memory held by the image */
+size_t imv_image_memory_usage(const struct imv_image *image);
+
 #endif
 
 
@@ -3,28 +3,38 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <wordexp.h>
 
 #include "backend.h"
 #include "binds.h"
+#include "cache.h"
 #include "canvas.h"
 #include "commands.h"
 #include "console.h"
+#include "dir_watch.h"
 #include "image.h"
 #include "ini.h"
 #include "ipc.h"
 #include "list.h"
 #include "log.h"
 #include "navigator.h"
+#include "prefetch.h"
+#include "resolve.h"
 #include "source.h"
+#include "stream.h"
+#include "template.h"
+#include "thread_pool.h"
 #include "viewport.h"
 #include "window.h"
 
@@ -33,6 +43,16 @@
 #define PATH_MAX 4096
 #endif
 
+/* Upper limit on how many images ahead we'll prefetch */
+#define MAX_PREFETCH_DEPTH 16
+
+/* How much of stdin is read at once when reading paths from it */
+#define PATH_READ_SIZE 65536
+
+/* Paths read from stdin are passed on in batches that double in size up to
+ * this many, starting with a single path so that it can be shown at once */
+#define MAX_PATH_BATCH 16384
+
 static const char *scaling_label[] = {
   "actual size",
   "shrink to fit",
@@ -50,7 +70,14 @@ enum internal_event_type {
   NEW_IMAGE,
   BAD_IMAGE,
   NEW_PATH,
-  COMMAND
+  NEW_PATHS,
+  READ_PATHS,
+  COMMAND,
+  PREFETCHED_IMAGE,
+  SOURCE_OPENED,
+  CACHE_CHECKED,
+  TEXT_UPDATED,
+  SORT_KEYS
 };
 
 struct color_rgb {
@@ -59,18 +86,45 @@ struct color_rgb {
 
 struct internal_event {
   enum internal_event_type type;
+  /* the next unused event, while held in the pool */
+  struct internal_event *next;
   union {
     struct {
+      struct imv_source *source;
       struct imv_image *image;
       int frametime;
       bool is_new_image;
+      /* the image is still being decoded, with only these rows ready */
+      bool partial;
+      int first_row;
+      int last_row;
     } new_image;
     struct {
       char *path;
     } new_path;
+    struct {
+      char **paths;
+      size_t count;
+    } new_paths;
     struct {
       char *text;
     } command;
+    struct {
+      /* NULL if the path couldn't be opened */
+      struct imv_source *source;
+      char *path;
+      unsigned int generation;
+    } source_opened;
+    struct {
+      char *path;
+      unsigned int generation;
+      /* the file's current version, unless it's gone */
+      bool exists;
+      struct imv_file_id id;
+    } cache_checked;
+    struct {
+      struct imv_sort_keys *keys;
+    } sort_keys;
   } data;
 };
 
@@ -81,6 +135,27 @@ struct imv {
   /* indicates a new image is being loaded */
   bool loading;
 
+  /* the current image is being loaded by the prefetcher */
+  bool awaiting_prefetch;
+
+  /* bumped every time we start loading the selection, so that the results
+   * of opening a path the user has since moved away from can be ignored */
+  unsigned int load_generation;
+
+  /* the size images are decoded for, so that large images may be decoded at
+   * reduced resolution. 0 if they should be decoded in full. Read by the
+   * worker threads, so only ever accessed atomically. */
+  int target_width;
+  int target_height;
+
+  /* the current image was decoded at reduced resolution, and the user has
+   * zoomed in far enough to need it in full, which is being loaded */
+  bool full_res_pending;
+
+  /* the current image is as sharp as it gets, either because it was decoded
+   * in full or because it's animated, so there's no reloading it in full */
+  bool full_res;
+
   /* initial fullscreen state */
   bool start_fullscreen;
 
@@ -94,6 +169,8 @@ struct imv {
     bool enabled;
     /* the user-specified format strings for the overlay*/
     char *text;
+    /* text, parsed ready to fill in, created when first needed */
+    struct imv_template *template;
     struct color_rgb text_color;
     unsigned char text_alpha;
     struct color_rgb background_color;
@@ -113,6 +190,23 @@ struct imv {
   /* method for scaling up images: interpolate or nearest neighbour */
   enum upscaling_method upscaling_method;
 
+  /* Unused internal events, recycled rather than allocated every time as
+   * there can be a lot of them, such as one per path read from stdin */
+  struct {
+    pthread_mutex_t lock;
+    struct internal_event *free;
+    size_t count;
+  } event_pool;
+
+  /* Input merged across a pump of the event queue, so that a burst of it
+   * only costs one update. Applied by flush_input. */
+  struct {
+    int motion_x, motion_y;
+    int scroll;
+    bool resized;
+    struct imv_event resize;
+  } pending_input;
+
   /* dirty state flags */
   bool need_redraw;
   bool need_rescale;
@@ -121,6 +215,12 @@ struct imv {
   /* traverse sub-directories for more images */
   bool recursive_load;
 
+  /* keep adding files that appear in the directories given */
+  bool watch_dirs;
+
+  /* select each file as it's added by watching */
+  bool watch_follow;
+
   /* 'next' on the last image goes back to the first */
   bool loop_input;
 
@@ -130,8 +230,20 @@ struct imv {
   /* read paths from stdin, as opposed to image data */
   bool paths_from_stdin;
 
-  /* FILE to use when reading paths from stdin */
-  FILE *stdin_pipe;
+  /* number of background worker threads, 0 to pick automatically */
+  int worker_threads;
+
+  /* how many images to prefetch in the direction of travel, 0 to disable */
+  int prefetch_depth;
+
+  /* memory budget for prefetched images, in bytes */
+  size_t prefetch_size;
+
+  /* memory budget for recently viewed images, in bytes, 0 to disable */
+  size_t cache_size;
+
+  /* written to, to stop the thread reading paths from stdin */
+  int stdin_wake_fds[2];
 
   /* scale up / down images to match window, or actual size */
   enum scaling_mode scaling_mode;
@@ -153,6 +265,18 @@ struct imv {
     double elapsed;
   } slideshow;
 
+  /* the most recent sort asked for, which may be waiting on file details
+   * being looked up in the background */
+  struct {
+    enum imv_sort_order order;
+    bool reverse;
+    uint64_t seed;
+    /* it's yet to be applied */
+    bool pending;
+    /* the details being looked up on the worker pool, or NULL */
+    struct imv_sort_keys *gathering;
+  } sort;
+
   struct {
     /* for animated images, the getTime() time to display the next frame */
     double due;
@@ -175,13 +299,24 @@ struct imv {
 
   /* the user-specified format strings for the overlay and window title */
   char *title_text;
+  struct imv_template *title_template;
+  /* the title last given to the window */
+  char *title;
 
   /* imv subsystems */
   struct imv_binds *binds;
   struct imv_navigator *navigator;
+  struct imv_dir_watch *dir_watch;
+  /* directories to watch once the window's there to post new paths to */
+  struct list *watch_paths;
   struct list *backends;
   struct imv_source *current_source;
   struct imv_source *last_source;
+  /* the path current_source was opened from */
+  char *current_path;
+  struct imv_thread_pool *thread_pool;
+  struct imv_prefetch *prefetch;
+  struct imv_cache *cache;
   struct imv_commands *commands;
   struct imv_console *console;
   struct imv_ipc *ipc;
@@ -189,9 +324,11 @@ struct imv {
   struct imv_canvas *canvas;
   struct imv_window *window;
 
-  /* if reading an image from stdin, this is the buffer for it */
-  void *stdin_image_data;
-  size_t stdin_image_data_len;
+  /* if reading an image from stdin, this is what's been read of it. Only the
+   * main thread changes it, but workers opening it take references under the
+   * lock, so that it isn't freed from under them. */
+  struct imv_stream *stdin_stream;
+  pthread_mutex_t stdin_lock;
 };
 
 static void command_quit(struct list *args, const char *argstr, void *data);
@@ -204,6 +341,7 @@ static void command_rotate(struct list *args, const char *argstr, void *data);
 static void command_flip(struct list *args, const char *argstr, void *data);
 static void command_open(struct list *args, const char *argstr, void *data);
 static void command_close(struct list *args, const char *argstr, void *data);
+static void command_sort(struct list *args, const char *argstr, void *data);
 static void command_fullscreen(struct list *args, const char *argstr, void *data);
 static void command_overlay(struct list *args, const char *argstr, void *data);
 static void command_exec(struct list *args, const char *argstr, void *data);
@@ -219,10 +357,50 @@ static void command_bind(struct list *args, const char *argstr, void *data);
 
 static bool setup_window(struct imv *imv);
 static void consume_internal_event(struct imv *imv, struct internal_event *event);
+static void handle_new_image(struct imv *imv, struct imv_image *image, int frametime);
+static void update_target_size(struct imv *imv);
 static void render_window(struct imv *imv);
 static void update_env_vars(struct imv *imv);
-static size_t generate_env_text(struct imv *imv, char *buf, size_t len, const char *format);
-static size_t read_from_stdin(void **buffer);
+static size_t generate_env_text(struct imv *imv, char *buf, size_t len,
+    struct imv_template **tmpl, const char *format);
+static void update_title(struct imv *imv);
+static void apply_sort(struct imv *imv);
+static void start_sort(struct imv *imv);
+static void gather_sort_keys(struct imv *imv, struct imv_sort_keys *keys);
+
+/* Most unused internal events kept around for reuse */
+#define EVENT_POOL_SIZE 256
+
+/* Returns a zeroed internal event. Safe to call from any thread. */
+static struct internal_event *alloc_internal_event(struct imv *imv)
+{
+  pthread_mutex_lock(&imv->event_pool.lock);
+  struct internal_event *event = imv->event_pool.free;
+  if (event) {
+    imv->event_pool.free = event->next;
+    imv->event_pool.count--;
+  }
+  pthread_mutex_unlock(&imv->event_pool.lock);
+
+  if (!event) {
+    return calloc(1, sizeof *event);
+  }
+  memset(event, 0, sizeof *event);
+  return event;
+}
+
+static void free_internal_event(struct imv *imv, struct internal_event *event)
+{
+  pthread_mutex_lock(&imv->event_pool.lock);
+  if (imv->event_pool.count < EVENT_POOL_SIZE) {
+    event->next = imv->event_pool.free;
+    imv->event_pool.free = event;
+    imv->event_pool.count++;
+    event = NULL;
+  }
+  pthread_mutex_unlock(&imv->event_pool.lock);
+  free(event);
+}
 
 /* Finds the next split between commands in a string (';'). Provides a pointer
  * to the next character after the delimiter as out, or a pointer to '\0' if
@@ -354,11 +532,15 @@ static void source_callback(struct imv_source_message *msg)
     return;
   }
 
-  struct internal_event *event = calloc(1, sizeof *event);
+  struct internal_event *event = alloc_internal_event(imv);
   if (msg->image) {
     event->type = NEW_IMAGE;
+    event->data.new_image.source = msg->source;
     event->data.new_image.image = msg->image;
     event->data.new_image.frametime = msg->frametime;
+    event->data.new_image.partial = msg->partial;
+    event->data.new_image.first_row = msg->first_row;
+    event->data.new_image.last_row = msg->last_row;
 
     /* Keep track of the last source to send us an image in order to detect
      * when we're getting a new image, as opposed to a new frame from the
@@ -384,7 +566,7 @@ static void command_callback(const char *text, void *data)
 {
   struct imv *imv = data;
 
-  struct internal_event *event = calloc(1, sizeof *event);
+  struct internal_event *event = alloc_internal_event(imv);
   event->type = COMMAND;
   event->data.command.text = strdup(text);
 
@@ -397,6 +579,40 @@ static void command_callback(const char *text, void *data)
   imv_window_push_event(imv->window, &e);
 }
 
+static void dir_watch_callback(char **paths, size_t count, void *data)
+{
+  struct imv *imv = data;
+
+  struct internal_event *event = alloc_internal_event(imv);
+  event->type = NEW_PATHS;
+  event->data.new_paths.paths = paths;
+  event->data.new_paths.count = count;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
+static void prefetch_ready_callback(void *data)
+{
+  struct imv *imv = data;
+
+  struct internal_event *event = alloc_internal_event(imv);
+  event->type = PREFETCHED_IMAGE;
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
 static void key_handler(struct imv *imv, const struct imv_event *event)
 {
   if (imv_console_is_active(imv->console)) {
@@ -434,40 +650,72 @@ static void key_handler(struct imv *imv, const struct imv_event *event)
 }
 
 
+/* Applies any input merged by event_handler */
+static void flush_input(struct imv *imv)
+{
+  if (imv->pending_input.resized) {
+    const struct imv_event *e = &imv->pending_input.resize;
+    const int ww = e->data.resize.width;
+    const int wh = e->data.resize.height;
+    const int bw = e->data.resize.buffer_width;
+    const int bh = e->data.resize.buffer_height;
+    const double scale = e->data.resize.scale;
+    imv_viewport_update(imv->view, ww, wh, bw, bh, imv->current_image, imv->scaling_mode);
+    imv_canvas_resize(imv->canvas, bw, bh, scale);
+    update_target_size(imv);
+    imv->pending_input.resized = false;
+  }
+
+  if (imv->pending_input.motion_x || imv->pending_input.motion_y) {
+    imv_viewport_move(imv->view, imv->pending_input.motion_x,
+        imv->pending_input.motion_y, imv->current_image);
+    imv->pending_input.motion_x = 0;
+    imv->pending_input.motion_y = 0;
+  }
+
+  if (imv->pending_input.scroll) {
+    double x, y;
+    imv_window_get_mouse_position(imv->window, &x, &y);
+    imv_viewport_zoom(imv->view, imv->current_image, IMV_ZOOM_MOUSE,
+        x, y, imv->pending_input.scroll);
+    imv->pending_input.scroll = 0;
+  }
+}
+
 static void event_handler(void *data, const struct imv_event *e)
 {
   struct imv *imv = data;
+
+  /* Motion, scrolling and resizing are merged with any more of the same that
+   * follows. Anything else has to see their effects first. */
   switch (e->type) {
-    case IMV_EVENT_CLOSE:
-      imv->quit = true;
-      break;
     case IMV_EVENT_RESIZE:
-      {
-        const int ww = e->data.resize.width;
-        const int wh = e->data.resize.height;
-        const int bw = e->data.resize.buffer_width;
-        const int bh = e->data.resize.buffer_height;
-        const double scale = e->data.resize.scale;
-        imv_viewport_update(imv->view, ww, wh, bw, bh, imv->current_image, imv->scaling_mode);
-        imv_canvas_resize(imv->canvas, bw, bh, scale);
-        break;
-      }
-    case IMV_EVENT_KEYBOARD:
-      key_handler(imv, e);
-      break;
+      /* only the most recent size matters */
+      imv->pending_input.resize = *e;
+      imv->pending_input.resized = true;
+      return;
     case IMV_EVENT_MOUSE_MOTION:
       if (imv_window_get_mouse_button(imv->window, 1)) {
-        imv_viewport_move(imv->view, e->data.mouse_motion.dx,
-            e->data.mouse_motion.dy, imv->current_image);
+        imv->pending_input.motion_x += (int)e->data.mouse_motion.dx;
+        imv->pending_input.motion_y += (int)e->data.mouse_motion.dy;
       }
-      break;
+      return;
     case IMV_EVENT_MOUSE_SCROLL:
-      {
-        double x, y;
-        imv_window_get_mouse_position(imv->window, &x, &y);
-        imv_viewport_zoom(imv->view, imv->current_image, IMV_ZOOM_MOUSE,
-            x, y, -e->data.mouse_scroll.dy);
-      }
+      /* zooming multiplies the scale by a fixed factor per step, so the steps
+       * can be added up */
+      imv->pending_input.scroll += (int)-e->data.mouse_scroll.dy;
+      return;
+    default:
+      flush_input(imv);
+      break;
+  }
+
+  switch (e->type) {
+    case IMV_EVENT_CLOSE:
+      imv->quit = true;
+      break;
+    case IMV_EVENT_KEYBOARD:
+      key_handler(imv, e);
       break;
     case IMV_EVENT_CUSTOM:
       consume_internal_event(imv, e->data.custom);
@@ -478,6 +726,12 @@ static void event_handler(void *data, const struct imv_event *e)
 
 }
 
+static void pump_events(struct imv *imv)
+{
+  imv_window_pump_events(imv->window, event_handler, imv);
+  flush_input(imv);
+}
+
 static bool hex_value_to_color_rgb(const char* hex, struct color_rgb* color)
 {
     if (*hex == '#')
@@ -523,6 +777,8 @@ struct imv *imv_create(void)
   imv_log_add_log_callback(&log_to_stderr, NULL);
 
   struct imv *imv = calloc(1, sizeof *imv);
+  pthread_mutex_init(&imv->event_pool.lock, NULL);
+  pthread_mutex_init(&imv->stdin_lock, NULL);
   imv->initial_width = 1280;
   imv->initial_height = 720;
   imv->need_redraw = true;
@@ -533,6 +789,7 @@ struct imv *imv_create(void)
   imv->overlay.font.size = 24;
   imv->binds = imv_binds_create();
   imv->navigator = imv_navigator_create();
+  imv->watch_paths = list_create();
   imv->backends = list_create();
   imv->commands = imv_commands_create();
   imv->console = imv_console_create();
@@ -560,6 +817,9 @@ struct imv *imv_create(void)
   imv->overlay.background_color.b = 0;
   imv->overlay.background_alpha = 195;
   imv->overlay.position_at_bottom = false;
+  imv->prefetch_depth = 2;
+  imv->prefetch_size = (size_t)512 * 1024 * 1024;
+  imv->cache_size = (size_t)512 * 1024 * 1024;
   imv->startup_commands = list_create();
 
   imv_command_register(imv->commands, "quit", &command_quit);
@@ -572,6 +832,7 @@ struct imv *imv_create(void)
   imv_command_register(imv->commands, "flip", &command_flip);
   imv_command_register(imv->commands, "open", &command_open);
   imv_command_register(imv->commands, "close", &command_close);
+  imv_command_register(imv->commands, "sort", &command_sort);
   imv_command_register(imv->commands, "fullscreen", &command_fullscreen);
   imv_command_register(imv->commands, "overlay", &command_overlay);
   imv_command_register(imv->commands, "exec", &command_exec);
@@ -637,12 +898,33 @@ void imv_free(struct imv *imv)
 {
   free(imv->overlay.font.name);
   free(imv->title_text);
+  free(imv->title);
+  free(imv->current_path);
   free(imv->overlay.text);
   imv_binds_free(imv->binds);
+  /* stop watching first, as new paths are posted to the window */
+  imv_dir_watch_free(imv->dir_watch);
+  /* and stop reading stdin, so that nothing's left waiting on it */
+  imv_stream_stop(imv->stdin_stream);
+  /* and don't wait for every file to be looked at before quitting */
+  if (imv->sort.gathering) {
+    imv_sort_keys_cancel(imv->sort.gathering);
+  }
+  list_deep_free(imv->watch_paths);
   imv_navigator_free(imv->navigator);
   if (imv->current_source) {
     imv_source_free(imv->current_source);
   }
+  /* finish off any outstanding background work while the window, which its
+   * results are posted to, still exists */
+  imv_prefetch_free(imv->prefetch);
+  imv_template_free(imv->title_template);
+  imv_template_free(imv->overlay.template);
+  imv_cache_free(imv->cache);
+  imv_source_set_thread_pool(NULL);
+  imv_thread_pool_free(imv->thread_pool);
+  /* the event it was handed back in is never seen now */
+  imv_sort_keys_free(imv->sort.gathering);
   imv_commands_free(imv->commands);
   imv_console_free(imv->console);
   imv_ipc_free(imv->ipc);
@@ -654,9 +936,7 @@ void imv_free(struct imv *imv)
   if (imv->next_frame.image) {
     imv_image_free(imv->next_frame.image);
   }
-  if (imv->stdin_image_data) {
-    free(imv->stdin_image_data);
-  }
+  imv_stream_free(imv->stdin_stream);
   if (imv->window) {
     imv_window_free(imv->window);
   }
@@ -665,6 +945,14 @@ void imv_free(struct imv *imv)
 
   list_free(imv->startup_commands);
 
+  while (imv->event_pool.free) {
+    struct internal_event *next = imv->event_pool.free->next;
+    free(imv->event_pool.free);
+    imv->event_pool.free = next;
+  }
+  pthread_mutex_destroy(&imv->event_pool.lock);
+  pthread_mutex_destroy(&imv->stdin_lock);
+
   free(imv);
 }
 
@@ -731,6 +1019,64 @@ static bool parse_upscaling_method(struct imv *imv, const char *method)
   return false;
 }
 
+static bool parse_worker_threads(struct imv *imv, const char *threads)
+{
+  if (!strcmp(threads, "auto")) {
+    imv->worker_threads = 0;
+    imv_navigator_set_max_threads(imv->navigator, 0);
+    return true;
+  }
+
+  char *end;
+  long num = strtol(threads, &end, 10);
+  if (*end != '\0' || num < 1 || num > 256) {
+    imv_log(IMV_ERROR, "Invalid number of worker threads: '%s'\n", threads);
+    return false;
+  }
+  imv->worker_threads = (int)num;
+  /* paths given up front are walked before the pool is started */
+  imv_navigator_set_max_threads(imv->navigator, imv->worker_threads);
+  return true;
+}
+
+static bool parse_prefetch_depth(struct imv *imv, const char *depth)
+{
+  char *end;
+  long num = strtol(depth, &end, 10);
+  if (*end != '\0' || num < 0 || num > MAX_PREFETCH_DEPTH) {
+    imv_log(IMV_ERROR, "Invalid prefetch depth: '%s'\n", depth);
+    return false;
+  }
+  imv->prefetch_depth = (int)num;
+  return true;
+}
+
+/* Parses a size in bytes, with an optional K, M or G suffix */
+static bool parse_byte_size(const char *str, size_t *size)
+{
+  char *end;
+  errno = 0;
+  unsigned long long num = strtoull(str, &end, 10);
+  if (errno || end == str) {
+    return false;
+  }
+
+  unsigned long long multiplier = 1;
+  switch (toupper(*end)) {
+    case 'G': multiplier *= 1024; /* fall through */
+    case 'M': multiplier *= 1024; /* fall through */
+    case 'K': multiplier *= 1024; ++end; break;
+    case '\0': break;
+    default: return false;
+  }
+  if (*end != '\0' || num > SIZE_MAX / multiplier) {
+    return false;
+  }
+
+  *size = num * multiplier;
+  return true;
+}
+
 static bool parse_initial_pan(struct imv *imv, const char *pan_params)
 {
   char *next_val;
@@ -743,50 +1089,154 @@ static bool parse_initial_pan(struct imv *imv, const char *pan_params)
   return true;
 }
 
-static void *pipe_stdin(void *data)
+static void push_path_event(struct imv *imv, struct internal_event *event)
 {
-  int *fd = data;
-  while (1) {
-    char buf[PIPE_BUF];
-    ssize_t err = read(STDIN_FILENO, buf, PIPE_BUF);
-    if (err > 0) {
-      /* writes up to PIPE_BUF are atomic */
-      write(*fd, buf, err);
-    } else if (err == 0 || errno != EINTR) {
-      /* break if EOF or actual read error */
-      break;
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
     }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
+struct path_batch {
+  char **paths;
+  size_t count;
+  size_t limit;
+
+  /* only kept for a batch, as its directories could be renamed before the
+   * next one's read */
+  struct imv_resolver *resolver;
+};
+
+static void send_path_batch(struct imv *imv, struct path_batch *batch)
+{
+  imv_resolver_free(batch->resolver);
+  batch->resolver = imv_resolver_create();
+
+  if (batch->count == 0) {
+    return;
   }
 
-  return NULL;
+  struct internal_event *event = alloc_internal_event(imv);
+  event->type = READ_PATHS;
+  event->data.new_paths.paths = batch->paths;
+  event->data.new_paths.count = batch->count;
+  push_path_event(imv, event);
+
+  batch->limit = batch->limit * 2 < MAX_PATH_BATCH
+               ? batch->limit * 2 : MAX_PATH_BATCH;
+  batch->paths = malloc(batch->limit * sizeof *batch->paths);
+  batch->count = 0;
 }
 
+static void read_path(struct imv *imv, struct path_batch *batch,
+    const char *path)
+{
+  bool is_dir = false;
+  char *real_path = imv_resolve_path(batch->resolver, path, &is_dir);
+
+  if (is_dir) {
+    /* directories are expanded by the navigator as usual, after the paths
+     * before them */
+    free(real_path);
+    send_path_batch(imv, batch);
+    struct internal_event *event = alloc_internal_event(imv);
+    event->type = NEW_PATH;
+    event->data.new_path.path = strdup(path);
+    push_path_event(imv, event);
+    return;
+  }
+
+  /* paths that can't be resolved are kept as they were given */
+  batch->paths[batch->count++] = real_path ? real_path : strdup(path);
+  if (batch->count == batch->limit) {
+    send_path_batch(imv, batch);
+  }
+}
+
+/* Reads paths from stdin, one per line, resolving them here rather than on
+ * the main thread. Whatever's been read is passed on whenever stdin has
+ * nothing more for now, or the batch is full. */
 static void *load_paths_from_stdin(void *data)
 {
   struct imv *imv = data;
 
   imv_log(IMV_INFO, "Reading paths from stdin...\n");
 
-  char buf[PATH_MAX];
-  while (fgets(buf, sizeof(buf), imv->stdin_pipe) != NULL) {
-    size_t len = strlen(buf);
-    if (buf[len-1] == '\n') {
-      buf[--len] = 0;
-    }
-    if (len > 0) {
-      struct internal_event *event = calloc(1, sizeof *event);
-      event->type = NEW_PATH;
-      event->data.new_path.path = strdup(buf);
-
-      struct imv_event e = {
-        .type = IMV_EVENT_CUSTOM,
-        .data = {
-          .custom = event
-        }
-      };
-      imv_window_push_event(imv->window, &e);
+  struct path_batch batch = {
+    .paths = malloc(sizeof(char *)),
+    .limit = 1,
+    .resolver = imv_resolver_create(),
+  };
+  char *buf = malloc(PATH_READ_SIZE);
+  size_t len = 0;
+
+  /* part way through a line too long to be a path */
+  bool skipping = false;
+
+  while (1) {
+    struct pollfd fds[] = {
+      {.fd = STDIN_FILENO, .events = POLLIN},
+      {.fd = imv->stdin_wake_fds[0], .events = POLLIN},
+    };
+    const int ready = poll(fds, 2, batch.count > 0 ? 0 : -1);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ready < 0 || fds[1].revents) {
+      break;
+    }
+    if (ready == 0) {
+      send_path_batch(imv, &batch);
+      continue;
+    }
+
+    /* one byte is always kept spare for the terminator */
+    const ssize_t got = read(STDIN_FILENO, buf + len,
+        PATH_READ_SIZE - 1 - len);
+    if (got < 0 && (errno == EINTR || errno == EAGAIN)) {
+      continue;
+    }
+    if (got <= 0) {
+      /* the last line needn't end with a newline */
+      if (len > 0 && !skipping) {
+        buf[len] = 0;
+        read_path(imv, &batch, buf);
+      }
+      send_path_batch(imv, &batch);
+      break;
     }
+
+    const size_t end = len + (size_t)got;
+    size_t start = 0;
+    for (size_t i = len; i < end; ++i) {
+      if (buf[i] != '\n') {
+        continue;
+      }
+      buf[i] = 0;
+      if (i > start && !skipping) {
+        read_path(imv, &batch, buf + start);
+      }
+      skipping = false;
+      start = i + 1;
+    }
+
+    len = end - start;
+    memmove(buf, buf + start, len);
+    if (len == PATH_READ_SIZE - 1) {
+      skipping = true;
+      len = 0;
+    }
+  }
+
+  for (size_t i = 0; i < batch.count; ++i) {
+    free(batch.paths[i]);
   }
+  free(batch.paths);
+  free(buf);
+  imv_resolver_free(batch.resolver);
   return NULL;
 }
 
@@ -823,10 +1273,12 @@ bool imv_parse_args(struct imv *imv, int argc, char **argv)
   int o;
 
  /* TODO getopt_long */
-  while ((o = getopt(argc, argv, "frdxhvlu:s:n:b:t:c:")) != -1) {
+  while ((o = getopt(argc, argv, "frwWdxhvlu:s:n:b:t:c:")) != -1) {
     switch(o) {
       case 'f': imv->start_fullscreen = true;                    break;
       case 'r': imv->recursive_load = true;                      break;
+      case 'w': imv->watch_dirs = true;                          break;
+      case 'W': imv->watch_dirs = imv->watch_follow = true;      break;
       case 'd': imv->overlay.enabled = true;                     break;
       case 'x': imv->loop_input = false;                         break;
       case 'l': imv->list_files_at_exit = true;                  break;
@@ -870,41 +1322,555 @@ bool imv_parse_args(struct imv *imv, int argc, char **argv)
     }
   }
 
-  argc -= optind;
-  argv += optind;
+  argc -= optind;
+  argv += optind;
+
+  /* if no paths are given as args, expect them from stdin */
+  if (argc == 0) {
+    imv->paths_from_stdin = true;
+  } else {
+    /* otherwise, add the paths */
+    bool data_from_stdin = false;
+    for (int i = 0; i < argc; ++i) {
+
+      /* Special case: '-' denotes reading image data from stdin */
+      if (!strcmp("-", argv[i])) {
+        if (imv->paths_from_stdin) {
+          imv_log(IMV_ERROR, "Can't read paths AND image data from stdin. Aborting.\n");
+          return false;
+        } else if (data_from_stdin) {
+          imv_log(IMV_ERROR, "Can't read image data from stdin twice. Aborting.\n");
+          return false;
+        }
+        data_from_stdin = true;
+
+        /* read in the background, so it can be shown as it arrives */
+        imv->stdin_stream = imv_stream_create(STDIN_FILENO);
+        if (!imv->stdin_stream) {
+          imv_log(IMV_ERROR, "Can't read image data from stdin. Aborting.\n");
+          return false;
+        }
+      }
+
+      imv_add_path(imv, argv[i]);
+    }
+  }
+
+  return true;
+}
+
+static void watch_path(struct imv *imv, const char *path, bool recursive)
+{
+  if (!imv->watch_dirs) {
+    return;
+  }
+  if (imv->dir_watch) {
+    imv_dir_watch_add(imv->dir_watch, path, recursive);
+  } else if (imv->watch_paths) {
+    /* recursive is the same for every path given before imv_run */
+    list_append(imv->watch_paths, strdup(path));
+  }
+}
+
+void imv_add_path(struct imv *imv, const char *path)
+{
+  imv_navigator_add(imv->navigator, path, imv->recursive_load);
+  watch_path(imv, path, imv->recursive_load);
+}
+
+/* Read the start of a file, to work out which backends to offer it to */
+static ssize_t read_header(const char *path, void *buf, size_t len)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  ssize_t total = 0;
+  while ((size_t)total < len) {
+    ssize_t got = read(fd, (char *)buf + total, len - total);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      break;
+    }
+    total += got;
+  }
+  close(fd);
+  return total;
+}
+
+/* Files bigger than this are left to backends to read for themselves, rather
+ * than holding all of them in memory at once */
+#define MAX_READ_FILE ((size_t)256 * 1024 * 1024)
+
+/* The contents of an image file. It's read once and offered to every backend
+ * in turn, and stays alive for as long as the source opened from it. It's
+ * copied rather than mapped, as a mapped file being truncated while it's
+ * decoded, such as by a render writing it again, would kill imv with SIGBUS.
+ */
+struct file_data {
+  void *data;
+  size_t len;
+};
+
+static void release_file(void *data)
+{
+  struct file_data *file = data;
+  free(file->data);
+  free(file);
+}
+
+static void release_stream(void *data)
+{
+  imv_stream_free(data);
+}
+
+static void file_id_from_stat(struct imv_file_id *id, const struct stat *st)
+{
+  id->dev = st->st_dev;
+  id->ino = st->st_ino;
+  id->mtime = st->st_mtim;
+}
+
+/* Returns NULL if the file can't be read whole, such as if it's a pipe or
+ * too big. Whatever the file is, st is filled in if it could be opened, and
+ * zeroed otherwise. */
+static struct file_data *read_file(const char *path, struct stat *st_out)
+{
+  memset(st_out, 0, sizeof *st_out);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return NULL;
+  }
+  /* taken before anything's read, so that it's never newer than the data */
+  *st_out = st;
+  if (!S_ISREG(st.st_mode) || st.st_size <= 0
+      || (size_t)st.st_size > MAX_READ_FILE) {
+    close(fd);
+    return NULL;
+  }
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  unsigned char *data = malloc(st.st_size);
+  size_t len = 0;
+  while (data && len < (size_t)st.st_size) {
+    ssize_t got = pread(fd, data + len, st.st_size - len, len);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      /* it's been cut short since, so make do with what's there */
+      break;
+    }
+    len += got;
+  }
+  close(fd);
+
+  if (len == 0) {
+    free(data);
+    return NULL;
+  }
+
+  struct file_data *file = malloc(sizeof *file);
+  file->data = data;
+  file->len = len;
+  return file;
+}
+
+static enum backend_result open_source(struct imv *imv, const char *path,
+    struct imv_source **src)
+{
+  const bool path_is_stdin = !strcmp("-", path);
+  enum backend_result result = BACKEND_UNSUPPORTED;
+
+  if (!imv->backends) {
+    imv_log(IMV_ERROR, "No backends installed. Unable to load image.\n");
+  }
+
+  unsigned char header_buf[IMV_BACKEND_HEADER_LEN];
+  const void *header = header_buf;
+  size_t header_len;
+  struct file_data *file = NULL;
+  struct stat st = {0};
+  struct imv_stream *stream = NULL;
+  if (path_is_stdin) {
+    pthread_mutex_lock(&imv->stdin_lock);
+    if (imv->stdin_stream) {
+      stream = imv_stream_ref(imv->stdin_stream);
+    }
+    pthread_mutex_unlock(&imv->stdin_lock);
+    if (!stream) {
+      return BACKEND_BAD_PATH;
+    }
+    /* waits for enough to have arrived to tell what it is */
+    header_len = imv_stream_read(stream, 0, header_buf, sizeof header_buf,
+        NULL);
+  } else if ((file = read_file(path, &st))) {
+    header = file->data;
+    header_len = file->len;
+  } else {
+    ssize_t len = read_header(path, header_buf, sizeof header_buf);
+    if (len < 0) {
+      return BACKEND_BAD_PATH;
+    }
+    header_len = len;
+  }
+  if (header_len > IMV_BACKEND_HEADER_LEN) {
+    header_len = IMV_BACKEND_HEADER_LEN;
+  }
+
+  for (size_t i = 0; i < imv->backends->len; ++i) {
+    const struct imv_backend *backend = imv->backends->items[i];
+
+    if (!imv_backend_accepts(backend, header, header_len)) {
+      /* not a format this backend understands, don't bother asking */
+      continue;
+    }
+
+    if (file && backend->open_memory && !backend->prefers_path) {
+      result = backend->open_memory(file->data, file->len, src);
+    } else if (stream && backend->open_stream) {
+      result = backend->open_stream(stream, src);
+    } else if (stream) {
+
+      if (!backend->open_memory) {
+        /* memory loading unsupported by backend */
+        continue;
+      }
+
+      /* the backend can't start until it has the lot */
+      size_t len;
+      void *data = imv_stream_data(stream, &len);
+      result = backend->open_memory(data, len, src);
+    } else {
+
+      if (!backend->open_path) {
+        /* path loading unsupported by backend */
+        continue;
+      }
+
+      result = backend->open_path(path, src);
+    }
+    if (result == BACKEND_UNSUPPORTED) {
+      /* Try the next backend */
+      continue;
+    } else {
+      break;
+    }
+  }
+
+  if (result == BACKEND_SUCCESS && S_ISREG(st.st_mode)) {
+    /* lets its images be cached, until the file changes */
+    struct imv_file_id id;
+    file_id_from_stat(&id, &st);
+    imv_source_set_file_id(*src, &id);
+  }
+
+  if (result == BACKEND_SUCCESS) {
+    imv_source_set_target_size(*src,
+        __atomic_load_n(&imv->target_width, __ATOMIC_RELAXED),
+        __atomic_load_n(&imv->target_height, __ATOMIC_RELAXED));
+  }
+
+  if (stream) {
+    if (result == BACKEND_SUCCESS) {
+      /* the source may keep reading from the stream until it's freed */
+      imv_source_set_release(*src, &release_stream, stream);
+    } else {
+      imv_stream_free(stream);
+    }
+  }
+
+  if (file) {
+    if (result == BACKEND_SUCCESS) {
+      /* the source may keep reading from the data until it's freed */
+      imv_source_set_release(*src, &release_file, file);
+    } else {
+      release_file(file);
+    }
+  }
+
+  return result;
+}
+
+/* Called from the worker pool to open images ahead of time */
+static struct imv_source *prefetch_open(const char *path, void *data)
+{
+  struct imv *imv = data;
+  struct imv_source *source;
+  if (open_source(imv, path, &source) != BACKEND_SUCCESS) {
+    return NULL;
+  }
+  return source;
+}
+
+/* Ask the prefetcher for the images we're likely to visit next: mostly those
+ * in the direction the user is moving, plus a few behind them.
+ */
+static void update_prefetch(struct imv *imv)
+{
+  if (!imv->prefetch) {
+    return;
+  }
+
+  const ssize_t len = (ssize_t)imv_navigator_length(imv->navigator);
+  const ssize_t index = (ssize_t)imv_navigator_index(imv->navigator);
+  const int dir = imv_navigator_last_direction(imv->navigator);
+  const int behind = imv->prefetch_depth / 2;
+
+  const char *paths[MAX_PREFETCH_DEPTH + MAX_PREFETCH_DEPTH / 2];
+  size_t count = 0;
+
+  for (int i = 1; i <= imv->prefetch_depth + behind; ++i) {
+    ssize_t offset = i <= imv->prefetch_depth ? dir * i
+                                              : -dir * (i - imv->prefetch_depth);
+    ssize_t pos = index + offset;
+    if (pos < 0 || pos >= len) {
+      if (!imv->loop_input) {
+        continue;
+      }
+      pos = ((pos % len) + len) % len;
+    }
+    if (pos == index) {
+      continue;
+    }
+
+    const char *path = imv_navigator_at(imv->navigator, pos);
+    if (!strcmp(path, "-")) {
+      /* image data from stdin is already held in memory, so cheap to reload */
+      continue;
+    }
+    if (imv->cache && imv_cache_contains(imv->cache, path)) {
+      continue;
+    }
+
+    bool duplicate = false;
+    for (size_t j = 0; j < count; ++j) {
+      if (paths[j] == path) {
+        duplicate = true;
+        break;
+      }
+    }
+    if (!duplicate) {
+      paths[count++] = path;
+    }
+  }
+
+  imv_prefetch_update(imv->prefetch, paths, count);
+}
+
+struct open_request {
+  struct imv *imv;
+  char *path;
+  unsigned int generation;
+};
+
+/* Runs on the worker pool, so that slow probing and header parsing (or
+ * entire decodes, for some backends) never stall the main loop */
+static void open_job(void *data)
+{
+  struct open_request *req = data;
+  struct imv *imv = req->imv;
+
+  struct imv_source *source = NULL;
+  if (open_source(imv, req->path, &source) != BACKEND_SUCCESS) {
+    source = NULL;
+  }
+
+  struct internal_event *event = alloc_internal_event(imv);
+  event->type = SOURCE_OPENED;
+  event->data.source_opened.source = source;
+  event->data.source_opened.path = req->path;
+  event->data.source_opened.generation = req->generation;
+  free(req);
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
+/* Open a path on the worker pool, for the current load generation */
+static void request_open(struct imv *imv, const char *path)
+{
+  struct open_request *req = calloc(1, sizeof *req);
+  req->imv = imv;
+  req->path = strdup(path);
+  req->generation = imv->load_generation;
+  imv_thread_pool_submit(imv->thread_pool, IMV_PRIORITY_HIGH, &open_job, req);
+}
+
+/* Looks up the version of a file on the worker pool, as on a network
+ * filesystem even a stat can take a while */
+static void check_cache_job(void *data)
+{
+  struct open_request *req = data;
+  struct imv *imv = req->imv;
+
+  struct internal_event *event = alloc_internal_event(imv);
+  event->type = CACHE_CHECKED;
+  event->data.cache_checked.path = req->path;
+  event->data.cache_checked.generation = req->generation;
+
+  struct stat st;
+  event->data.cache_checked.exists = !stat(req->path, &st);
+  if (event->data.cache_checked.exists) {
+    file_id_from_stat(&event->data.cache_checked.id, &st);
+  }
+  free(req);
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
+/* Make sure a cached image is still up to date before showing it */
+static void request_cache_check(struct imv *imv, const char *path)
+{
+  struct open_request *req = calloc(1, sizeof *req);
+  req->imv = imv;
+  req->path = strdup(path);
+  req->generation = imv->load_generation;
+  imv_thread_pool_submit(imv->thread_pool, IMV_PRIORITY_HIGH,
+      &check_cache_job, req);
+}
+
+/* If the current image was decoded at reduced resolution, and the user has
+ * zoomed in too far for it, load it again in full */
+static void check_resolution(struct imv *imv)
+{
+  if (!imv->current_image || imv->loading || imv->full_res_pending
+      || imv->full_res) {
+    return;
+  }
+
+  const struct imv_image *image = imv->current_image;
+  if (imv_image_decoded_width(image) >= imv_image_width(image)
+      && imv_image_decoded_height(image) >= imv_image_height(image)) {
+    /* however far it's zoomed in, there's nothing more to load */
+    imv->full_res = true;
+    return;
+  }
+
+  double scale;
+  imv_viewport_get_scale(imv->view, &scale);
+  if (scale * imv_image_width(image) <= imv_image_decoded_width(image) + 1
+      && scale * imv_image_height(image) <= imv_image_decoded_height(image) + 1) {
+    return;
+  }
 
-  /* if no paths are given as args, expect them from stdin */
-  if (argc == 0) {
-    imv->paths_from_stdin = true;
+  imv_log(IMV_DEBUG, "Loading %s at full resolution\n", imv->current_path);
+  imv->full_res_pending = true;
+  if (imv->current_source) {
+    imv_source_set_target_size(imv->current_source, 0, 0);
+    imv_source_async_load_first_frame(imv->current_source);
   } else {
-    /* otherwise, add the paths */
-    bool data_from_stdin = false;
-    for (int i = 0; i < argc; ++i) {
-
-      /* Special case: '-' denotes reading image data from stdin */
-      if (!strcmp("-", argv[i])) {
-        if (imv->paths_from_stdin) {
-          imv_log(IMV_ERROR, "Can't read paths AND image data from stdin. Aborting.\n");
-          return false;
-        } else if (data_from_stdin) {
-          imv_log(IMV_ERROR, "Can't read image data from stdin twice. Aborting.\n");
-          return false;
-        }
-        data_from_stdin = true;
+    /* it came from the cache, so there's no source to reuse */
+    request_open(imv, imv->current_path);
+  }
+}
 
-        imv->stdin_image_data_len = read_from_stdin(&imv->stdin_image_data);
-      }
+static void remove_bad_path(struct imv *imv, const char *path)
+{
+  /* Special case: the image came from stdin */
+  if (strcmp(path, "-") == 0) {
+    pthread_mutex_lock(&imv->stdin_lock);
+    struct imv_stream *stream = imv->stdin_stream;
+    imv->stdin_stream = NULL;
+    pthread_mutex_unlock(&imv->stdin_lock);
+    /* any worker still opening it holds its own reference */
+    imv_stream_free(stream);
+    imv_log(IMV_ERROR, "Failed to load image from stdin.\n");
+  }
+
+  imv_navigator_remove(imv->navigator, path);
+}
 
-      imv_add_path(imv, argv[i]);
+/* Start displaying whatever the navigator currently has selected */
+static void load_selection(struct imv *imv)
+{
+  const char *current_path = imv_navigator_selection(imv->navigator);
+  imv->awaiting_prefetch = false;
+  imv->full_res_pending = false;
+  imv->full_res = false;
+  imv->load_generation++;
+
+  /* check we got a path back */
+  if (!strcmp("", current_path)) {
+    /* No image currently selected */
+    if (imv->current_image) {
+      imv_image_free(imv->current_image);
+      imv->current_image = NULL;
     }
+    return;
   }
 
-  return true;
-}
+  struct imv_source *new_source = NULL;
+  struct imv_image *ready_image = NULL;
+  int frametime = 0;
 
-void imv_add_path(struct imv *imv, const char *path)
-{
-  imv_navigator_add(imv->navigator, path, imv->recursive_load);
+  /* A still image we've shown recently needs no source at all, as long as
+   * the file hasn't changed since */
+  const bool cached = imv->cache && imv_cache_contains(imv->cache, current_path);
+
+  enum imv_prefetch_result prefetched = PREFETCH_MISSING;
+  if (!cached && imv->prefetch) {
+    prefetched = imv_prefetch_take(imv->prefetch, current_path, &new_source,
+        &ready_image, &frametime);
+  }
+
+  if (imv->current_source) {
+    imv_source_async_free(imv->current_source);
+  }
+  /* if the image is cached, or is still being opened, there's no source
+   * yet */
+  imv->current_source = new_source;
+  if (new_source) {
+    imv_source_set_callback(new_source, &source_callback, imv);
+  }
+  free(imv->current_path);
+  imv->current_path = strdup(current_path);
+
+  imv->loading = true;
+  imv_viewport_set_playing(imv->view, true);
+
+  if (ready_image) {
+    if (imv->cache && !frametime) {
+      imv_cache_put(imv->cache, current_path, imv_source_file_id(new_source),
+          ready_image);
+    }
+    imv->last_source = new_source;
+    handle_new_image(imv, ready_image, frametime);
+  } else if (cached) {
+    request_cache_check(imv, current_path);
+  } else if (prefetched == PREFETCH_PENDING) {
+    imv->awaiting_prefetch = true;
+  } else {
+    request_open(imv, current_path);
+  }
+
+  /* anything run for the title or overlay most likely depends on the file */
+  imv_template_invalidate(imv->title_template);
+  imv_template_invalidate(imv->overlay.template);
+  update_title(imv);
+
+  update_prefetch(imv);
 }
 
 int imv_run(struct imv *imv)
@@ -914,26 +1880,52 @@ int imv_run(struct imv *imv)
 
   if (!setup_window(imv))
     return 1;
+  update_target_size(imv);
+
+  imv->thread_pool = imv_thread_pool_create(imv->worker_threads);
+  if (!imv->thread_pool) {
+    imv_log(IMV_ERROR, "Failed to start worker threads\n");
+    return 1;
+  }
+  imv_source_set_thread_pool(imv->thread_pool);
+  /* directories walked and files looked at from here on share the pool's
+   * limit, rather than each starting threads of their own on top of it */
+  imv_navigator_set_max_threads(imv->navigator,
+      imv_thread_pool_size(imv->thread_pool));
+
+  if (imv->cache_size > 0) {
+    imv->cache = imv_cache_create(imv->cache_size);
+  }
+
+  if (imv->prefetch_depth > 0) {
+    imv->prefetch = imv_prefetch_create(imv->thread_pool, &prefetch_open,
+        &prefetch_ready_callback, imv);
+    imv_prefetch_set_budget(imv->prefetch, imv->prefetch_size);
+  }
+
+  if (imv->watch_dirs) {
+    imv->dir_watch = imv_dir_watch_create(&dir_watch_callback, imv);
+    if (!imv->dir_watch) {
+      imv_log(IMV_WARNING, "Unable to watch directories for new files\n");
+    }
+    for (size_t i = 0; imv->dir_watch && i < imv->watch_paths->len; ++i) {
+      imv_dir_watch_add(imv->dir_watch, imv->watch_paths->items[i],
+          imv->recursive_load);
+    }
+    list_deep_free(imv->watch_paths);
+    imv->watch_paths = NULL;
+  }
 
   /* if loading paths from stdin, kick off a thread to do that - we'll receive
    * events back via internal events */
-  int *stdin_pipe_fds = NULL;
-  pthread_t pipe_stdin_thread;
   pthread_t load_paths_thread;
   if (imv->paths_from_stdin) {
-    /* this array is allocated on the heap because it's passed to pthread_create */
-    stdin_pipe_fds = calloc(2, sizeof *stdin_pipe_fds);
-
-    if (pipe(stdin_pipe_fds)) {
+    if (pipe(imv->stdin_wake_fds)) {
       /* if pipe creation fails, we should exit */
-      free(stdin_pipe_fds);
       return 1;
     }
 
-    imv->stdin_pipe = fdopen(stdin_pipe_fds[0], "re");
-
-    if (pthread_create(&load_paths_thread, NULL, load_paths_from_stdin, imv)
-        || pthread_create(&pipe_stdin_thread, NULL, pipe_stdin, stdin_pipe_fds + 1)) {
+    if (pthread_create(&load_paths_thread, NULL, load_paths_from_stdin, imv)) {
       return 1;
     }
   }
@@ -957,7 +1949,7 @@ int imv_run(struct imv *imv)
         if (max_tries <= 0) {
           cont = false;
         }
-        imv_window_pump_events(imv->window, event_handler, imv);
+        pump_events(imv);
         if (index == -1) {
           ssize_t img_index = imv_navigator_find_path(imv->navigator, imv->starting_path);
           if(img_index != -1) {
@@ -1014,72 +2006,7 @@ int imv_run(struct imv *imv)
      * load in a while loop until the navigation stops.
      */
     while (imv_navigator_poll_changed(imv->navigator)) {
-      const char *current_path = imv_navigator_selection(imv->navigator);
-      /* check we got a path back */
-      if (strcmp("", current_path)) {
-
-        const bool path_is_stdin = !strcmp("-", current_path);
-        struct imv_source *new_source;
-
-        enum backend_result result = BACKEND_UNSUPPORTED;
-
-        if (!imv->backends) {
-          imv_log(IMV_ERROR, "No backends installed. Unable to load image.\n");
-        }
-
-        for (size_t i = 0; i < imv->backends->len; ++i) {
-          const struct imv_backend *backend = imv->backends->items[i];
-          if (path_is_stdin) {
-
-            if (!backend->open_memory) {
-              /* memory loading unsupported by backend */
-              continue;
-            }
-
-            result = backend->open_memory(imv->stdin_image_data,
-                imv->stdin_image_data_len, &new_source);
-          } else {
-
-            if (!backend->open_path) {
-              /* path loading unsupported by backend */
-              continue;
-            }
-
-            result = backend->open_path(current_path, &new_source);
-          }
-          if (result == BACKEND_UNSUPPORTED) {
-            /* Try the next backend */
-            continue;
-          } else {
-            break;
-          }
-        }
-
-        if (result == BACKEND_SUCCESS) {
-          if (imv->current_source) {
-            imv_source_async_free(imv->current_source);
-          }
-          imv->current_source = new_source;
-          imv_source_set_callback(imv->current_source, &source_callback, imv);
-          imv_source_async_load_first_frame(imv->current_source);
-
-          imv->loading = true;
-          imv_viewport_set_playing(imv->view, true);
-
-          char title[1024];
-          generate_env_text(imv, title, sizeof title, imv->title_text);
-          imv_window_set_title(imv->window, title);
-        } else {
-          /* Error loading path so remove it from the navigator */
-          imv_navigator_remove(imv->navigator, current_path);
-        }
-      } else {
-        /* No image currently selected */
-        if (imv->current_image) {
-          imv_image_free(imv->current_image);
-          imv->current_image = NULL;
-        }
-      }
+      load_selection(imv);
     }
 
     if (imv->need_rescale) {
@@ -1087,6 +2014,8 @@ int imv_run(struct imv *imv)
       imv_viewport_rescale(imv->view, imv->current_image, imv->scaling_mode);
     }
 
+    check_resolution(imv);
+
     current_time = cur_time();
 
     /* Check if a new frame is due */
@@ -1142,8 +2071,10 @@ int imv_run(struct imv *imv)
       imv_window_present(imv->window);
     }
 
-    /* sleep until we have something to do */
-    double timeout = 1.0; /* seconds */
+    /* sleep until we have something to do, only waking up to check the
+     * current file hasn't changed if the navigator can't tell us */
+    double timeout = imv_navigator_watching(imv->navigator)
+                   ? -1.0 : 1.0; /* seconds */
 
     /* If we need to display the next frame of an animation soon we should
      * limit our sleep until the next frame is due.
@@ -1157,16 +2088,21 @@ int imv_run(struct imv *imv)
 
     if (imv->slideshow.duration > 0) {
       double timeleft = imv->slideshow.duration - imv->slideshow.elapsed;
-      if (timeleft > 0.0 && timeleft < timeout) {
+      if (timeleft > 0.0 && (timeout < 0.0 || timeleft < timeout)) {
         timeout = timeleft + 0.001;
       }
     }
 
+    /* Don't sleep at all if the last frame was left unfinished */
+    if (imv->need_redraw) {
+      timeout = 0.0;
+    }
+
     /* Go to sleep until an input/internal event or the timeout expires */
     imv_window_wait_for_event(imv->window, timeout);
 
     /* Handle the new events that have arrived */
-    imv_window_pump_events(imv->window, event_handler, imv);
+    pump_events(imv);
   }
 
   if (imv->list_files_at_exit) {
@@ -1175,18 +2111,15 @@ int imv_run(struct imv *imv)
   }
 
   if (imv->paths_from_stdin) {
-    /* stop the thread before closing the pipe */
-    pthread_cancel(pipe_stdin_thread);
-    pthread_join(pipe_stdin_thread, NULL);
-
     /* will cause the thread running load_paths_from_stdin() to exit */
-    close(stdin_pipe_fds[1]);
-    free(stdin_pipe_fds);
-
-    /* join the other thread to avoid a race when closing imv->stdin_pipe */
+    ssize_t rc;
+    do {
+      rc = write(imv->stdin_wake_fds[1], "", 1);
+    } while (rc < 0 && errno == EINTR);
     pthread_join(load_paths_thread, NULL);
 
-    fclose(imv->stdin_pipe);
+    close(imv->stdin_wake_fds[0]);
+    close(imv->stdin_wake_fds[1]);
   }
 
   return 0;
@@ -1201,6 +2134,8 @@ static bool setup_window(struct imv *imv)
     return false;
   }
 
+  imv_window_watch_fd(imv->window, imv_navigator_watch_fd(imv->navigator));
+
   {
     int ww, wh, bw, bh;
     imv_window_get_size(imv->window, &ww, &wh);
@@ -1226,6 +2161,19 @@ static bool setup_window(struct imv *imv)
 }
 
 
+/* Only images that are fit to the window can get away with being decoded at
+ * reduced resolution */
+static void update_target_size(struct imv *imv)
+{
+  int width = 0;
+  int height = 0;
+  if (imv->scaling_mode == SCALING_FULL || imv->scaling_mode == SCALING_DOWN) {
+    imv_window_get_framebuffer_size(imv->window, &width, &height);
+  }
+  __atomic_store_n(&imv->target_width, width, __ATOMIC_RELAXED);
+  __atomic_store_n(&imv->target_height, height, __ATOMIC_RELAXED);
+}
+
 static void handle_new_image(struct imv *imv, struct imv_image *image, int frametime)
 {
   if (imv->current_image) {
@@ -1238,6 +2186,16 @@ static void handle_new_image(struct imv *imv, struct imv_image *image, int frame
   imv->next_frame.due = frametime ? cur_time() + frametime * 0.001 : 0.0;
   imv->next_frame.duration = 0.0;
 
+  /* An animation's frames replace each other rather than being swapped for
+   * sharper versions, so it's never reloaded in full, and a reload that
+   * turned out to be one has nothing more to wait for */
+  imv->full_res = frametime
+    || (imv_image_decoded_width(image) >= imv_image_width(image)
+      && imv_image_decoded_height(image) >= imv_image_height(image));
+  if (frametime) {
+    imv->full_res_pending = false;
+  }
+
   /* If this is an animated image, we should kick off loading the next frame */
   if (imv->current_source && frametime) {
     imv_source_async_load_next_frame(imv->current_source);
@@ -1254,9 +2212,74 @@ static void handle_new_frame(struct imv *imv, struct imv_image *image, int frame
   imv->next_frame.duration = frametime * 0.001;
 }
 
+/* Show as much of an image as has been decoded so far */
+static void handle_partial_image(struct imv *imv, struct imv_source *source,
+    struct imv_image *image, int first_row, int last_row)
+{
+  if (source != imv->current_source || imv->full_res_pending) {
+    /* Either stale, or we've already got a reduced version to show until the
+     * full one is done */
+    imv_image_free(image);
+    return;
+  }
+
+  imv_image_set_ready_rows(image, first_row, last_row);
+  if (image == imv->current_image) {
+    /* we already hold a reference */
+    imv_image_free(image);
+    imv->need_redraw = true;
+  } else {
+    handle_new_image(imv, image, 0);
+    /* still not done */
+    imv->loading = true;
+  }
+}
+
 static void consume_internal_event(struct imv *imv, struct internal_event *event)
 {
-  if (event->type == NEW_IMAGE) {
+  if (event->type == NEW_IMAGE && event->data.new_image.partial) {
+    handle_partial_image(imv, event->data.new_image.source,
+        event->data.new_image.image, event->data.new_image.first_row,
+        event->data.new_image.last_row);
+
+  } else if (event->type == NEW_IMAGE
+      && event->data.new_image.image == imv->current_image) {
+    /* A partially displayed image has finished decoding */
+    struct imv_image *image = event->data.new_image.image;
+    imv_image_set_ready_rows(image, 0, imv_image_decoded_height(image));
+    if (imv->cache && event->data.new_image.source == imv->current_source) {
+      imv_cache_put(imv->cache, imv->current_path,
+          imv_source_file_id(imv->current_source), image);
+    }
+    imv_image_free(image);
+    imv->loading = false;
+    imv->need_redraw = true;
+
+  } else if (event->type == NEW_IMAGE && imv->full_res_pending
+      && event->data.new_image.source == imv->current_source
+      && !event->data.new_image.frametime) {
+    /* The full resolution version of what we're already showing. It's the
+     * same size, so swap it in without disturbing the viewport. */
+    imv->full_res_pending = false;
+    imv->full_res = true;
+    if (imv->cache) {
+      imv_cache_put(imv->cache, imv->current_path,
+          imv_source_file_id(imv->current_source), event->data.new_image.image);
+    }
+    imv_image_free(imv->current_image);
+    imv->current_image = event->data.new_image.image;
+    imv->need_redraw = true;
+
+  } else if (event->type == NEW_IMAGE) {
+    /* Remember still images in case the user comes back to them. Check the
+     * source, as the selection may have changed since the image was sent. */
+    if (imv->cache && event->data.new_image.is_new_image
+        && !event->data.new_image.frametime
+        && event->data.new_image.source == imv->current_source) {
+      imv_cache_put(imv->cache, imv->current_path,
+          imv_source_file_id(imv->current_source), event->data.new_image.image);
+    }
+
     /* New image vs just a new frame of the same image */
     if (event->data.new_image.is_new_image) {
       handle_new_image(imv, event->data.new_image.image, event->data.new_image.frametime);
@@ -1266,27 +2289,122 @@ static void consume_internal_event(struct imv *imv, struct internal_event *event
 
   } else if (event->type == BAD_IMAGE) {
     /* An image failed to load, remove it from our image list */
-    const char *err_path = imv_navigator_selection(imv->navigator);
-
-    /* Special case: the image came from stdin */
-    if (strcmp(err_path, "-") == 0) {
-      if (imv->stdin_image_data) {
-        free(imv->stdin_image_data);
-        imv->stdin_image_data = NULL;
-        imv->stdin_image_data_len = 0;
+    remove_bad_path(imv, imv_navigator_selection(imv->navigator));
+
+  } else if (event->type == SOURCE_OPENED) {
+    struct imv_source *source = event->data.source_opened.source;
+    if (event->data.source_opened.generation != imv->load_generation) {
+      /* The user has moved on since this was requested */
+      if (source) {
+        imv_source_async_free(source);
+      }
+    } else if (!source) {
+      /* Error loading path so remove it from the navigator */
+      remove_bad_path(imv, event->data.source_opened.path);
+    } else {
+      imv->current_source = source;
+      imv_source_set_callback(source, &source_callback, imv);
+      if (imv->full_res_pending) {
+        imv_source_set_target_size(source, 0, 0);
       }
-      imv_log(IMV_ERROR, "Failed to load image from stdin.\n");
+      imv_source_async_load_first_frame(source);
+    }
+    free(event->data.source_opened.path);
+
+  } else if (event->type == CACHE_CHECKED) {
+    struct imv_image *image = NULL;
+    if (event->data.cache_checked.generation != imv->load_generation) {
+      /* The user has moved on since this was requested */
+    } else if (event->data.cache_checked.exists && imv->cache
+        && (image = imv_cache_get(imv->cache, event->data.cache_checked.path,
+               &event->data.cache_checked.id))) {
+      imv->last_source = NULL;
+      handle_new_image(imv, image, 0);
+    } else {
+      /* it's changed since, so load it again */
+      request_open(imv, event->data.cache_checked.path);
     }
-
-    imv_navigator_remove(imv->navigator, err_path);
+    free(event->data.cache_checked.path);
 
   } else if (event->type == NEW_PATH) {
-    /* Received a new path from the stdin reading thread */
+    /* Received a directory from the stdin reading thread, to be expanded */
     imv_add_path(imv, event->data.new_path.path);
     free(event->data.new_path.path);
     /* Need to update image count in title */
     imv->need_redraw = true;
 
+  } else if (event->type == NEW_PATHS) {
+    /* Files have appeared in a watched directory */
+    char **paths = event->data.new_paths.paths;
+    const size_t count = event->data.new_paths.count;
+
+    /* the last to turn up is the newest, ignoring any that were already
+     * listed when the watch started */
+    const char *newest = NULL;
+    for (size_t i = count; imv->watch_follow && i > 0 && !newest; --i) {
+      if (imv_navigator_find_path(imv->navigator, paths[i - 1]) < 0) {
+        newest = paths[i - 1];
+      }
+    }
+
+    imv_navigator_insert(imv->navigator, paths, count);
+    if (newest) {
+      const ssize_t index = imv_navigator_find_path(imv->navigator, newest);
+      if (index >= 0) {
+        imv_navigator_select_abs(imv->navigator, index);
+      }
+    }
+    for (size_t i = 0; i < count; ++i) {
+      free(paths[i]);
+    }
+    free(paths);
+    /* Need to update image count in title */
+    imv->need_redraw = true;
+
+  } else if (event->type == READ_PATHS) {
+    /* Received a batch of resolved paths from the stdin reading thread */
+    char **paths = event->data.new_paths.paths;
+    const size_t count = event->data.new_paths.count;
+    imv_navigator_append(imv->navigator, paths, count);
+    for (size_t i = 0; i < count; ++i) {
+      free(paths[i]);
+    }
+    free(paths);
+    /* Need to update image count in title */
+    imv->need_redraw = true;
+
+  } else if (event->type == TEXT_UPDATED) {
+    /* A command in the title or overlay has finished */
+    imv->need_redraw = true;
+
+  } else if (event->type == SORT_KEYS) {
+    /* The file details for a sort have been looked up */
+    struct imv_sort_keys *keys = event->data.sort_keys.keys;
+    imv_navigator_apply_keys(imv->navigator, keys);
+    const bool covered = imv_sort_keys_cover(keys, imv->sort.order);
+    imv_sort_keys_free(keys);
+    imv->sort.gathering = NULL;
+    if (imv->sort.pending && covered) {
+      /* paths added while those were looked up still need theirs, which
+       * sorting would otherwise look up here, blocking */
+      struct imv_sort_keys *missing = imv_navigator_missing_keys(
+          imv->navigator, imv->sort.order);
+      if (missing) {
+        gather_sort_keys(imv, missing);
+      } else {
+        apply_sort(imv);
+      }
+    } else if (imv->sort.pending) {
+      /* a different order's been asked for since, needing other details */
+      start_sort(imv);
+    }
+
+  } else if (event->type == PREFETCHED_IMAGE) {
+    /* The image we were waiting on has been prefetched, go and collect it */
+    if (imv->awaiting_prefetch) {
+      load_selection(imv);
+    }
+
   } else if (event->type == COMMAND) {
     struct list *commands = list_create();
     list_append(commands, event->data.command.text);
@@ -1295,7 +2413,7 @@ static void consume_internal_event(struct imv *imv, struct internal_event *event
     imv->need_redraw = true;
   }
 
-  free(event);
+  free_internal_event(imv, event);
   return;
 }
 
@@ -1304,24 +2422,16 @@ static void render_window(struct imv *imv)
   int ww, wh;
   imv_window_get_size(imv->window, &ww, &wh);
 
-  /* update window title */
-  char title_text[1024];
-  generate_env_text(imv, title_text, sizeof title_text, imv->title_text);
-  imv_window_set_title(imv->window, title_text);
+  update_title(imv);
 
-  /* first we draw the background */
+  /* first we draw the background, no need to go through the canvas for that */
   if (imv->background.type == BACKGROUND_SOLID) {
-    imv_canvas_clear(imv->canvas);
-    imv_canvas_color(imv->canvas,
-        imv->background.color.r / 255.f,
-        imv->background.color.g / 255.f,
-        imv->background.color.b / 255.f,
-        1.0);
-    imv_canvas_fill(imv->canvas);
-    imv_canvas_draw(imv->canvas);
+    imv_window_clear(imv->window, imv->background.color.r,
+        imv->background.color.g, imv->background.color.b);
   }
 
   /* draw our actual image */
+  bool upload_pending = false;
   if (imv->current_image) {
     int x, y;
     double scale, rotation;
@@ -1334,7 +2444,7 @@ static void render_window(struct imv *imv)
       imv_canvas_fill_checkers(imv->canvas, imv->current_image,
                                x, y, scale, rotation, mirrored);
     }
-    imv_canvas_draw_image(imv->canvas, imv->current_image,
+    upload_pending = imv_canvas_draw_image(imv->canvas, imv->current_image,
                           x, y, scale, rotation, mirrored,
                           imv->upscaling_method, imv->cache_invalidated);
   }
@@ -1344,7 +2454,8 @@ static void render_window(struct imv *imv)
   /* if the overlay needs to be drawn, draw that too */
   if (imv->overlay.enabled) {
     char overlay_text[1024];
-    generate_env_text(imv, overlay_text, sizeof overlay_text, imv->overlay.text);
+    generate_env_text(imv, overlay_text, sizeof overlay_text,
+        &imv->overlay.template, imv->overlay.text);
     PangoLayout *layout = imv_canvas_make_layout(imv->canvas, overlay_text);
 
     int width, height;
@@ -1400,8 +2511,9 @@ static void render_window(struct imv *imv)
 
   imv_canvas_draw(imv->canvas);
 
-  /* redraw complete, unset the flag */
-  imv->need_redraw = false;
+  /* redraw complete, unset the flag, unless there's more of the image to
+   * upload, in which case we want to come straight back */
+  imv->need_redraw = upload_pending;
   imv->cache_invalidated = false;
 }
 
@@ -1493,6 +2605,16 @@ static int handle_ini_value(void *user, const char *section, const char *name,
       return 1;
     }
 
+    if (!strcmp(name, "watch")) {
+      imv->watch_dirs = parse_bool(value);
+      return 1;
+    }
+
+    if (!strcmp(name, "watch_follow")) {
+      imv->watch_follow = parse_bool(value);
+      return 1;
+    }
+
     if (!strcmp(name, "loop_input")) {
       imv->loop_input = parse_bool(value);
       return 1;
@@ -1507,6 +2629,30 @@ static int handle_ini_value(void *user, const char *section, const char *name,
       return parse_scaling_mode(imv, value);
     }
 
+    if (!strcmp(name, "worker_threads")) {
+      return parse_worker_threads(imv, value);
+    }
+
+    if (!strcmp(name, "cache_size")) {
+      if (!parse_byte_size(value, &imv->cache_size)) {
+        imv_log(IMV_ERROR, "Invalid cache size: '%s'\n", value);
+        return false;
+      }
+      return 1;
+    }
+
+    if (!strcmp(name, "prefetch_depth")) {
+      return parse_prefetch_depth(imv, value);
+    }
+
+    if (!strcmp(name, "prefetch_size")) {
+      if (!parse_byte_size(value, &imv->prefetch_size)) {
+        imv_log(IMV_ERROR, "Invalid prefetch size: '%s'\n", value);
+        return false;
+      }
+      return 1;
+    }
+
     if (!strcmp(name, "initial_pan")) {
       return parse_initial_pan(imv, value);
     }
@@ -1574,12 +2720,16 @@ static int handle_ini_value(void *user, const char *section, const char *name,
     if (!strcmp(name, "overlay_text")) {
       free(imv->overlay.text);
       imv->overlay.text = strdup(value);
+      imv_template_free(imv->overlay.template);
+      imv->overlay.template = NULL;
       return 1;
     }
 
     if (!strcmp(name, "title_text")) {
       free(imv->title_text);
       imv->title_text = strdup(value);
+      imv_template_free(imv->title_template);
+      imv->title_template = NULL;
       return 1;
     }
 
@@ -1752,6 +2902,7 @@ static void command_open(struct list *args, const char *argstr, void *data)
     if (wordexp(args->items[i], &word, 0) == 0) {
       for (size_t j = 0; j < word.we_wordc; ++j) {
         imv_navigator_add(imv->navigator, word.we_wordv[j], recursive);
+        watch_path(imv, word.we_wordv[j], recursive);
       }
       wordfree(&word);
     }
@@ -1781,6 +2932,141 @@ static void command_close(struct list *args, const char *argstr, void *data)
   imv->slideshow.elapsed = 0;
 }
 
+/* Sorts the navigator as last asked for. Any file details it needs must have
+ * been looked up already, or it blocks. */
+static void apply_sort(struct imv *imv)
+{
+  imv->sort.pending = false;
+  imv_navigator_sort(imv->navigator, imv->sort.order, imv->sort.reverse,
+      imv->sort.seed);
+
+  /* the same image is still open, but its index and neighbours have moved */
+  imv_template_invalidate(imv->title_template);
+  imv_template_invalidate(imv->overlay.template);
+  update_title(imv);
+  update_prefetch(imv);
+  imv->need_redraw = true;
+}
+
+struct sort_keys_request {
+  struct imv *imv;
+  struct imv_sort_keys *keys;
+};
+
+/* Runs on the worker pool, as looking at every file can take a long time on a
+ * slow disk or network */
+static void sort_keys_job(void *data)
+{
+  struct sort_keys_request *req = data;
+  struct imv *imv = req->imv;
+  imv_sort_keys_gather(req->keys);
+
+  struct internal_event *event = alloc_internal_event(imv);
+  event->type = SORT_KEYS;
+  event->data.sort_keys.keys = req->keys;
+  free(req);
+
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
+    }
+  };
+  imv_window_push_event(imv->window, &e);
+}
+
+/* Looks up the file details for a sort in the background */
+static void gather_sort_keys(struct imv *imv, struct imv_sort_keys *keys)
+{
+  struct sort_keys_request *req = calloc(1, sizeof *req);
+  req->imv = imv;
+  req->keys = keys;
+  imv->sort.gathering = keys;
+  /* low priority, so that images can still be loaded in the meantime */
+  imv_thread_pool_submit(imv->thread_pool, IMV_PRIORITY_LOW, &sort_keys_job,
+      req);
+}
+
+/* Applies the sort last asked for, once the file details it needs have been
+ * looked up in the background */
+static void start_sort(struct imv *imv)
+{
+  if (!imv_navigator_sort_needs_keys(imv->sort.order)) {
+    apply_sort(imv);
+    return;
+  }
+
+  if (imv->sort.gathering) {
+    /* it's picked up once the details being looked up are in, though if
+     * they're no use for it there's no point finishing */
+    if (!imv_sort_keys_cover(imv->sort.gathering, imv->sort.order)) {
+      imv_sort_keys_cancel(imv->sort.gathering);
+    }
+    return;
+  }
+
+  struct imv_sort_keys *keys = imv_navigator_sort_keys(imv->navigator,
+      imv->sort.order);
+  if (!keys) {
+    /* there's nothing to sort */
+    apply_sort(imv);
+    return;
+  }
+  gather_sort_keys(imv, keys);
+}
+
+static void command_sort(struct list *args, const char *argstr, void *data)
+{
+  (void)argstr;
+  struct imv *imv = data;
+  if (args->len < 2) {
+    return;
+  }
+
+  enum imv_sort_order order;
+  const char *name = args->items[1];
+  if (!strcmp(name, "natural")) {
+    order = IMV_SORT_NATURAL;
+  } else if (!strcmp(name, "mtime")) {
+    order = IMV_SORT_MTIME;
+  } else if (!strcmp(name, "size")) {
+    order = IMV_SORT_SIZE;
+  } else if (!strcmp(name, "dimensions")) {
+    order = IMV_SORT_DIMENSIONS;
+  } else if (!strcmp(name, "random")) {
+    order = IMV_SORT_RANDOM;
+  } else {
+    imv_log(IMV_ERROR, "Unknown sort order: %s\n", name);
+    return;
+  }
+
+  /* a different shuffle each time, unless a seed is given */
+  bool reverse = false;
+  uint64_t seed = (uint64_t)time(NULL) ^ (uint64_t)clock();
+  for (size_t i = 2; i < args->len; ++i) {
+    const char *arg = args->items[i];
+    if (!strcmp(arg, "reverse")) {
+      reverse = true;
+      continue;
+    }
+
+    /* strtoull would take a sign, and anything else as 0 */
+    char *end;
+    errno = 0;
+    seed = strtoull(arg, &end, 10);
+    if (!isdigit((unsigned char)*arg) || *end != '\0' || errno) {
+      imv_log(IMV_ERROR, "Invalid sort argument: '%s'\n", arg);
+      return;
+    }
+  }
+
+  imv->sort.order = order;
+  imv->sort.reverse = reverse;
+  imv->sort.seed = seed;
+  imv->sort.pending = true;
+  start_sort(imv);
+}
+
 static void command_fullscreen(struct list *args, const char *argstr, void *data)
 {
   (void)args;
@@ -1864,6 +3150,7 @@ static void command_set_scaling_mode(struct list *args, const char *argstr, void
     return;
   }
 
+  update_target_size(imv);
   imv->need_rescale = true;
   imv->need_redraw = true;
 }
@@ -1940,95 +3227,144 @@ static void command_bind(struct list *args, const char *argstr, void *data)
   }
 }
 
-static void update_env_vars(struct imv *imv)
-{
-  char str[64];
-
-  snprintf(str, sizeof str, "%d", getpid());
-  setenv("imv_pid", str, 1);
-
-  setenv("imv_current_file", imv_navigator_selection(imv->navigator), 1);
-  setenv("imv_scaling_mode", scaling_label[imv->scaling_mode], 1);
-  setenv("imv_loading", imv->loading ? "1" : "0", 1);
-
-  if (imv_navigator_length(imv->navigator)) {
-    snprintf(str, sizeof str, "%zu", imv_navigator_index(imv->navigator) + 1);
-    setenv("imv_current_index", str, 1);
-  } else {
-    setenv("imv_current_index", "0", 1);
-  }
-
-  snprintf(str, sizeof str, "%zu", imv_navigator_length(imv->navigator));
-  setenv("imv_file_count", str, 1);
-
-  snprintf(str, sizeof str, "%d", imv_image_width(imv->current_image));
-  setenv("imv_width", str, 1);
+/* Variables made available to the title, overlay, and commands */
+static const char *env_var_names[] = {
+  "imv_pid",
+  "imv_current_file",
+  "imv_scaling_mode",
+  "imv_loading",
+  "imv_current_index",
+  "imv_file_count",
+  "imv_width",
+  "imv_height",
+  "imv_scale",
+  "imv_slideshow_duration",
+  "imv_slideshow_elapsed",
+  "imv_queue_depth",
+  "imv_cache_hits",
+  "imv_cache_misses",
+  "imv_cache_evictions",
+};
 
-  snprintf(str, sizeof str, "%d", imv_image_height(imv->current_image));
-  setenv("imv_height", str, 1);
+/* Gets the value of one of env_var_names straight from imv's state, writing it
+ * to buf if need be. Returns NULL for anything else. */
+static const char *lookup_env_var(const char *name, char *buf, size_t len,
+    void *data)
+{
+  struct imv *imv = data;
 
-  {
+  if (strncmp(name, "imv_", 4)) {
+    return NULL;
+  }
+  name += 4;
+
+  if (!strcmp(name, "pid")) {
+    snprintf(buf, len, "%d", getpid());
+  } else if (!strcmp(name, "current_file")) {
+    return imv_navigator_selection(imv->navigator);
+  } else if (!strcmp(name, "scaling_mode")) {
+    return scaling_label[imv->scaling_mode];
+  } else if (!strcmp(name, "loading")) {
+    return imv->loading ? "1" : "0";
+  } else if (!strcmp(name, "current_index")) {
+    if (imv_navigator_length(imv->navigator)) {
+      snprintf(buf, len, "%zu", imv_navigator_index(imv->navigator) + 1);
+    } else {
+      snprintf(buf, len, "0");
+    }
+  } else if (!strcmp(name, "file_count")) {
+    snprintf(buf, len, "%zu", imv_navigator_length(imv->navigator));
+  } else if (!strcmp(name, "width")) {
+    snprintf(buf, len, "%d", imv_image_width(imv->current_image));
+  } else if (!strcmp(name, "height")) {
+    snprintf(buf, len, "%d", imv_image_height(imv->current_image));
+  } else if (!strcmp(name, "scale")) {
     double scale;
     imv_viewport_get_scale(imv->view, &scale);
-    snprintf(str, sizeof str, "%d", (int)(scale * 100.0));
-    setenv("imv_scale", str, 1);
+    snprintf(buf, len, "%d", (int)(scale * 100.0));
+  } else if (!strcmp(name, "slideshow_duration")) {
+    snprintf(buf, len, "%f", imv->slideshow.duration);
+  } else if (!strcmp(name, "slideshow_elapsed")) {
+    snprintf(buf, len, "%f", imv->slideshow.elapsed);
+  } else if (!strcmp(name, "queue_depth")) {
+    snprintf(buf, len, "%zu",
+        imv->thread_pool ? imv_thread_pool_queue_depth(imv->thread_pool) : 0);
+  } else if (!strncmp(name, "cache_", 6)) {
+    struct imv_cache_stats cache_stats = {0};
+    if (imv->cache) {
+      cache_stats = imv_cache_get_stats(imv->cache);
+    }
+    if (!strcmp(name, "cache_hits")) {
+      snprintf(buf, len, "%zu", cache_stats.hits);
+    } else if (!strcmp(name, "cache_misses")) {
+      snprintf(buf, len, "%zu", cache_stats.misses);
+    } else if (!strcmp(name, "cache_evictions")) {
+      snprintf(buf, len, "%zu", cache_stats.evictions);
+    } else {
+      return NULL;
+    }
+  } else {
+    return NULL;
   }
 
-  snprintf(str, sizeof str, "%f", imv->slideshow.duration);
-  setenv("imv_slideshow_duration", str, 1);
-
-  snprintf(str, sizeof str, "%f", imv->slideshow.elapsed);
-  setenv("imv_slideshow_elapsed", str, 1);
+  return buf;
 }
 
-static size_t generate_env_text(struct imv *imv, char *buf, size_t buf_len, const char *format)
+static void update_env_vars(struct imv *imv)
 {
-  update_env_vars(imv);
-
-  size_t len = 0;
-  wordexp_t word;
-  setenv("IFS", "", 1);
-  if (wordexp(format, &word, 0) == 0) {
-    for (size_t i = 0; i < word.we_wordc; ++i) {
-      len += snprintf(buf + len, buf_len - len, "%s ", word.we_wordv[i]);
-    }
-    wordfree(&word);
-  } else {
-    len += snprintf(buf, buf_len, "error expanding text");
+  char str[64];
+  const size_t count = sizeof env_var_names / sizeof *env_var_names;
+  for (size_t i = 0; i < count; ++i) {
+    const char *value = lookup_env_var(env_var_names[i], str, sizeof str, imv);
+    setenv(env_var_names[i], value, 1);
   }
-  unsetenv("IFS");
+}
 
-  return len;
+static void export_env_vars(void *data)
+{
+  update_env_vars(data);
 }
 
-static size_t read_from_stdin(void **buffer)
+static void text_updated_callback(void *data)
 {
-  size_t len = 0;
-  ssize_t r;
-  size_t step = 4096; /* Arbitrary value of 4 KiB */
-  void *p;
+  struct imv *imv = data;
 
-  errno = 0; /* clear errno */
+  struct internal_event *event = alloc_internal_event(imv);
+  event->type = TEXT_UPDATED;
 
-  for (*buffer = NULL; (*buffer = realloc((p = *buffer), len + step));
-      len += (size_t)r) {
-    if ((r = read(STDIN_FILENO, (uint8_t *)*buffer + len, step)) == -1) {
-      perror(NULL);
-      break;
-    } else if (r == 0) {
-      break;
+  struct imv_event e = {
+    .type = IMV_EVENT_CUSTOM,
+    .data = {
+      .custom = event
     }
-  }
+  };
+  imv_window_push_event(imv->window, &e);
+}
 
-  /* realloc(3) leaves old buffer allocated in case of error */
-  if (*buffer == NULL && p != NULL) {
-    int save = errno;
-    free(p);
-    errno = save;
-    len = 0;
+static size_t generate_env_text(struct imv *imv, char *buf, size_t buf_len,
+    struct imv_template **tmpl, const char *format)
+{
+  /* parsed the first time it's needed, then reused for every redraw */
+  if (!*tmpl) {
+    *tmpl = imv_template_create(format, imv->thread_pool, &lookup_env_var,
+        &export_env_vars, &text_updated_callback, imv);
   }
-  return len;
+  return imv_template_render(*tmpl, buf, buf_len);
 }
 
+static void update_title(struct imv *imv)
+{
+  char title[1024];
+  generate_env_text(imv, title, sizeof title, &imv->title_template,
+      imv->title_text);
+
+  /* don't bother the window system unless it's actually changed */
+  if (imv->title && !strcmp(imv->title, title)) {
+    return;
+  }
+  free(imv->title);
+  imv->title = strdup(title);
+  imv_window_set_title(imv->window, title);
+}
 
 /* vim:set ts=2 sts=2 sw=2 et: */
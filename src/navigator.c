@@ -1,122 +1,1562 @@
 #include "navigator.h"
 
 #include <assert.h>
-#include <dirent.h>
-#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
-#include <errno.h>
+#include <unistd.h>
 
-#include "list.h"
+#ifdef IMV_HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#include "dimensions.h"
+#include "resolve.h"
+#include "walk.h"
+
+/* Paths are packed end to end into chunks of this size, rather than each
+ * being allocated separately */
+#define ARENA_CHUNK_SIZE ((size_t)1024 * 1024)
+
+/* Removed items are left behind as tombstones, and only swept out once they
+ * outnumber the live ones. This keeps pruning many paths linear overall,
+ * rather than shifting the rest of the list along for every one. */
+#define MIN_TOMBSTONES_TO_COMPACT 64
+
+/* Item positions are stored as 32 bits to keep the per-path overhead down.
+ * These mean there isn't an item, and that an index slot's items have all been
+ * removed. */
+#define NONE UINT32_MAX
+#define DELETED (UINT32_MAX - 1)
+
+/* Looking up file details is mostly spent waiting on the disk or network
+ * rather than the CPU, so this isn't tied to the number of cores. It counts
+ * the calling thread, and is the most used when no other limit is given. */
+#define GATHER_THREADS 8
+
+/* How many items a thread gathering details takes on at a time */
+#define GATHER_CHUNK 256
+
+enum {
+  INDEX_PATH, /* the full path */
+  INDEX_NAME, /* the final component of the path */
+  INDEX_DIR,  /* the directory, up to and including the last separator */
+  NUM_INDEXES
+};
+
+struct nav_item {
+  /* points into the arena, NULL once removed */
+  const char *path;
+
+  /* position of the next item with the same key in each index, in list
+   * order, or NONE */
+  uint32_t next[NUM_INDEXES];
+};
+
+/* Which of an item's sort keys have been looked up */
+enum {
+  KEY_STAT = 1,       /* mtime and size */
+  KEY_DIMENSIONS = 2, /* pixels */
+};
+
+/* Details of an item that it may be sorted by, kept apart from the items so
+ * that they only cost anything once sorting by them has been asked for. Keys
+ * are arranged to be sorted as unsigned integers, and are UINT64_MAX if the
+ * file couldn't be looked at, so that it sorts last. */
+struct nav_keys {
+  uint64_t mtime;
+  uint64_t size;
+  uint64_t pixels;
+
+  /* position in natural order, while natural_valid is set */
+  uint32_t natural;
+
+  uint8_t have;
+};
+
+struct index_slot {
+  /* positions of the first and last items with the slot's key, or NONE if
+   * the slot's never been used, or DELETED */
+  uint32_t first;
+  uint32_t last;
+};
+
+/* An open addressing hash table mapping each key to the items with it */
+struct index {
+  struct index_slot *slots;
+  size_t capacity;
+
+  /* slots holding items */
+  size_t count;
+
+  /* slots holding items or that once did */
+  size_t used;
+};
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+struct imv_navigator {
+  /* every item added, in order, including tombstones */
+  struct nav_item *items;
+  size_t len;
+  size_t cap;
+
+  /* how many of items are tombstones */
+  size_t removed;
+
+  /* A Fenwick tree counting the live items, 1-based. Used to convert between
+   * indexes and positions while there are tombstones. */
+  uint32_t *counts;
+
+  struct index indexes[NUM_INDEXES];
+
+  /* INDEX_DIR is up to date. Only inserting uses it, so it isn't built until
+   * then, and sorting drops it rather than relinking every directory's long
+   * chain, leaving the next insert to build it again. */
+  bool dirs_indexed;
+
+  /* storage for the paths, most recently allocated chunk first */
+  struct arena_chunk *arena;
+
+  /* parallel to items, or NULL until a sort needs them */
+  struct nav_keys *keys;
+
+  /* the natural keys are up to date, no paths having been added since */
+  bool natural_valid;
+
+  /* bumped whenever items change position, so that keys gathered elsewhere
+   * can tell whether they still line up */
+  unsigned int layout;
+
+  /* the most threads walking directories or gathering keys may use, or 0 for
+   * the defaults */
+  int max_threads;
+
+  size_t cur_path;
+  struct timespec last_change;
+  time_t last_check;
+
+  /* Watches the current path's directory for the file being rewritten or
+   * replaced, or -1 if it has to be polled instead */
+  int inotify_fd;
+  int watch;
+  char *watch_name;
+  int last_move_direction;
+  int changed;
+  int wrapped;
+};
+
+static const char *arena_store(struct imv_navigator *nav, const char *str)
+{
+  const size_t len = strlen(str) + 1;
+
+  struct arena_chunk *chunk = nav->arena;
+  if (!chunk || chunk->size - chunk->used < len) {
+    const size_t size = len > ARENA_CHUNK_SIZE ? len : ARENA_CHUNK_SIZE;
+    chunk = malloc(sizeof *chunk + size);
+    chunk->next = nav->arena;
+    chunk->used = 0;
+    chunk->size = size;
+    nav->arena = chunk;
+  }
+
+  char *copy = chunk->data + chunk->used;
+  memcpy(copy, str, len);
+  chunk->used += len;
+  return copy;
+}
+
+static void arena_free(struct imv_navigator *nav)
+{
+  while (nav->arena) {
+    struct arena_chunk *next = nav->arena->next;
+    free(nav->arena);
+    nav->arena = next;
+  }
+}
+
+/* Returns the key an item is indexed by, which is len bytes long and not
+ * necessarily terminated, or NULL if it isn't indexed */
+static const char *item_key(struct imv_navigator *nav, size_t pos, int which,
+    size_t *len)
+{
+  const char *path = nav->items[pos].path;
+  if (which == INDEX_PATH) {
+    *len = strlen(path);
+    return path;
+  }
+
+  const char *last_sep = strrchr(path, '/');
+  if (which == INDEX_DIR) {
+    /* paths without a directory share an empty one */
+    *len = last_sep ? (size_t)(last_sep - path) + 1 : 0;
+    return path;
+  }
+
+  /* paths without a directory aren't matched by name */
+  if (!last_sep) {
+    return NULL;
+  }
+  *len = strlen(last_sep + 1);
+  return last_sep + 1;
+}
+
+static size_t hash_key(const char *key, size_t len)
+{
+  /* FNV-1a */
+  size_t hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* Returns the slot holding key, or the slot it should be stored in if absent */
+static struct index_slot *index_slot(struct imv_navigator *nav, int which,
+    const char *key, size_t len)
+{
+  struct index *index = &nav->indexes[which];
+  struct index_slot *free_slot = NULL;
+  const size_t mask = index->capacity - 1;
+
+  for (size_t i = hash_key(key, len) & mask; ; i = (i + 1) & mask) {
+    struct index_slot *slot = &index->slots[i];
+    if (slot->first == NONE) {
+      return free_slot ? free_slot : slot;
+    } else if (slot->first == DELETED) {
+      if (!free_slot) {
+        free_slot = slot;
+      }
+    } else {
+      size_t slot_len;
+      const char *slot_key = item_key(nav, slot->first, which, &slot_len);
+      if (slot_len == len && !memcmp(slot_key, key, len)) {
+        return slot;
+      }
+    }
+  }
+}
+
+/* Returns the position of the first item with key, or NONE */
+static uint32_t index_find(struct imv_navigator *nav, int which, const char *key,
+    size_t len)
+{
+  if (nav->indexes[which].capacity == 0) {
+    return NONE;
+  }
+  const uint32_t first = index_slot(nav, which, key, len)->first;
+  return first == DELETED ? NONE : first;
+}
+
+static void index_reset(struct imv_navigator *nav, int which)
+{
+  struct index *index = &nav->indexes[which];
+  for (size_t i = 0; i < index->capacity; ++i) {
+    index->slots[i].first = NONE;
+  }
+  index->count = 0;
+  index->used = 0;
+}
+
+static void index_rehash(struct imv_navigator *nav, int which)
+{
+  struct index *index = &nav->indexes[which];
+  struct index old = *index;
+
+  /* only grow if it's filling up with items rather than deleted slots */
+  index->capacity = old.capacity ? old.capacity : 64;
+  if ((index->count + 1) * 2 > index->capacity) {
+    index->capacity *= 2;
+  }
+  index->slots = malloc(index->capacity * sizeof *index->slots);
+  index_reset(nav, which);
+  index->count = old.count;
+  index->used = old.count;
+
+  for (size_t i = 0; i < old.capacity; ++i) {
+    const struct index_slot *slot = &old.slots[i];
+    if (slot->first != NONE && slot->first != DELETED) {
+      size_t len;
+      const char *key = item_key(nav, slot->first, which, &len);
+      *index_slot(nav, which, key, len) = *slot;
+    }
+  }
+  free(old.slots);
+}
+
+/* Adds the item at pos to an index. If ordered isn't set, an item belonging
+ * in the middle of its chain is put on the end rather than walking the chain
+ * for its place, and false is returned, so that the chain can be sorted once a
+ * whole batch is in. */
+static bool index_insert(struct imv_navigator *nav, int which, size_t pos,
+    bool ordered)
+{
+  nav->items[pos].next[which] = NONE;
+  if (which == INDEX_DIR && !nav->dirs_indexed) {
+    return true;
+  }
+
+  size_t len;
+  const char *key = item_key(nav, pos, which, &len);
+  if (!key) {
+    return true;
+  }
+
+  struct index *index = &nav->indexes[which];
+  if ((index->used + 1) * 4 > index->capacity * 3) {
+    index_rehash(nav, which);
+  }
+
+  struct index_slot *slot = index_slot(nav, which, key, len);
+  if (slot->first != NONE && slot->first != DELETED) {
+    /* keep the chain in list order, which is usually just appending */
+    if (pos > slot->last) {
+      nav->items[slot->last].next[which] = pos;
+      slot->last = pos;
+    } else if (pos < slot->first) {
+      nav->items[pos].next[which] = slot->first;
+      slot->first = pos;
+    } else if (!ordered) {
+      nav->items[slot->last].next[which] = pos;
+      slot->last = pos;
+      return false;
+    } else {
+      uint32_t prev = slot->first;
+      while (nav->items[prev].next[which] < pos) {
+        prev = nav->items[prev].next[which];
+      }
+      nav->items[pos].next[which] = nav->items[prev].next[which];
+      nav->items[prev].next[which] = pos;
+    }
+    return true;
+  }
+
+  if (slot->first == NONE) {
+    index->used++;
+  }
+  index->count++;
+  slot->first = pos;
+  slot->last = pos;
+  return true;
+}
+
+static void index_remove(struct imv_navigator *nav, int which, size_t pos)
+{
+  if (which == INDEX_DIR && !nav->dirs_indexed) {
+    return;
+  }
+
+  size_t len;
+  const char *key = item_key(nav, pos, which, &len);
+  if (!key) {
+    return;
+  }
+
+  struct index_slot *slot = index_slot(nav, which, key, len);
+  const uint32_t next = nav->items[pos].next[which];
+
+  if (slot->first == pos) {
+    if (next != NONE) {
+      slot->first = next;
+    } else {
+      slot->first = DELETED;
+      nav->indexes[which].count--;
+    }
+    return;
+  }
+
+  uint32_t prev = slot->first;
+  while (nav->items[prev].next[which] != pos) {
+    prev = nav->items[prev].next[which];
+  }
+  nav->items[prev].next[which] = next;
+  if (slot->last == pos) {
+    slot->last = prev;
+  }
+}
+
+static void index_clear(struct imv_navigator *nav, int which)
+{
+  struct index *index = &nav->indexes[which];
+  free(index->slots);
+  memset(index, 0, sizeof *index);
+}
+
+/* Builds INDEX_DIR if it isn't up to date */
+static void index_dirs(struct imv_navigator *nav)
+{
+  if (nav->dirs_indexed) {
+    return;
+  }
+  index_reset(nav, INDEX_DIR);
+  nav->dirs_indexed = true;
+  for (size_t pos = 0; pos < nav->len; ++pos) {
+    if (nav->items[pos].path) {
+      index_insert(nav, INDEX_DIR, pos, true);
+    }
+  }
+}
+
+static int compare_slots(const void *a, const void *b)
+{
+  const struct index_slot *slot_a = *(struct index_slot *const *)a;
+  const struct index_slot *slot_b = *(struct index_slot *const *)b;
+  return slot_a < slot_b ? -1 : slot_a > slot_b;
+}
+
+static int compare_positions(const void *a, const void *b)
+{
+  const uint32_t pos_a = *(const uint32_t *)a;
+  const uint32_t pos_b = *(const uint32_t *)b;
+  return pos_a < pos_b ? -1 : pos_a > pos_b;
+}
+
+/* Puts an index slot's chain of items back into list order */
+static void sort_chain(struct imv_navigator *nav, int which,
+    struct index_slot *slot, uint32_t **buf, size_t *buf_cap)
+{
+  size_t len = 0;
+  for (uint32_t pos = slot->first; pos != NONE;
+      pos = nav->items[pos].next[which]) {
+    if (len == *buf_cap) {
+      *buf_cap = *buf_cap ? *buf_cap * 2 : 64;
+      *buf = realloc(*buf, *buf_cap * sizeof **buf);
+    }
+    (*buf)[len++] = pos;
+  }
+
+  uint32_t *chain = *buf;
+  qsort(chain, len, sizeof *chain, &compare_positions);
+  for (size_t i = 0; i + 1 < len; ++i) {
+    nav->items[chain[i]].next[which] = chain[i + 1];
+  }
+  nav->items[chain[len - 1]].next[which] = NONE;
+  slot->first = chain[0];
+  slot->last = chain[len - 1];
+}
+
+static size_t lowest_bit(size_t i)
+{
+  return i & -i;
+}
+
+/* Returns how many live items there are before pos */
+static size_t count_before(struct imv_navigator *nav, size_t pos)
+{
+  size_t count = 0;
+  for (size_t i = pos; i > 0; i -= lowest_bit(i)) {
+    count += nav->counts[i];
+  }
+  return count;
+}
+
+/* Accounts for an item just appended */
+static void count_appended(struct imv_navigator *nav)
+{
+  const size_t i = nav->len;
+  nav->counts[i] = 1 + count_before(nav, i - 1) - count_before(nav, i - lowest_bit(i));
+}
+
+static void count_removed(struct imv_navigator *nav, size_t pos)
+{
+  for (size_t i = pos + 1; i <= nav->len; i += lowest_bit(i)) {
+    nav->counts[i]--;
+  }
+}
+
+/* Rebuilds the counts from scratch, in linear time */
+static void count_all(struct imv_navigator *nav)
+{
+  for (size_t i = 1; i <= nav->len; ++i) {
+    nav->counts[i] = nav->items[i - 1].path ? 1 : 0;
+  }
+  for (size_t i = 1; i <= nav->len; ++i) {
+    const size_t parent = i + lowest_bit(i);
+    if (parent <= nav->len) {
+      nav->counts[parent] += nav->counts[i];
+    }
+  }
+}
+
+/* Returns the index of the live item at pos */
+static size_t index_of(struct imv_navigator *nav, size_t pos)
+{
+  return nav->removed ? count_before(nav, pos) : pos;
+}
+
+/* Returns the position of the live item at index */
+static size_t position_of(struct imv_navigator *nav, size_t index)
+{
+  if (!nav->removed) {
+    return index;
+  }
+
+  size_t step = 1;
+  while (step * 2 <= nav->len) {
+    step *= 2;
+  }
+
+  /* find the last position with no more than index live items before it */
+  size_t pos = 0;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= nav->len && nav->counts[pos + step] <= index) {
+      pos += step;
+      index -= nav->counts[pos];
+    }
+  }
+  return pos;
+}
+
+/* Sweeps the tombstones out in a single pass. The space their paths took up
+ * in the arena isn't reclaimed until everything is removed. */
+static void compact(struct imv_navigator *nav)
+{
+  size_t len = 0;
+  for (size_t i = 0; i < nav->len; ++i) {
+    if (nav->items[i].path) {
+      if (nav->keys) {
+        nav->keys[len] = nav->keys[i];
+      }
+      nav->items[len++] = nav->items[i];
+    }
+  }
+  nav->len = len;
+  nav->removed = 0;
+  nav->layout++;
+
+  for (int i = 0; i < NUM_INDEXES; ++i) {
+    index_reset(nav, i);
+  }
+  for (size_t pos = 0; pos < len; ++pos) {
+    for (int i = 0; i < NUM_INDEXES; ++i) {
+      index_insert(nav, i, pos, true);
+    }
+  }
+
+  count_all(nav);
+}
+
+/* Makes room for count more items */
+static void reserve(struct imv_navigator *nav, size_t count)
+{
+  if (nav->len + count <= nav->cap) {
+    return;
+  }
+  while (nav->len + count > nav->cap) {
+    nav->cap = nav->cap ? nav->cap * 2 : 64;
+  }
+  nav->items = realloc(nav->items, nav->cap * sizeof *nav->items);
+  nav->counts = realloc(nav->counts, (nav->cap + 1) * sizeof *nav->counts);
+  if (nav->keys) {
+    nav->keys = realloc(nav->keys, nav->cap * sizeof *nav->keys);
+  }
+}
+
+/* Accounts for an item just stored at pos, which has no keys yet */
+static void item_added(struct imv_navigator *nav, size_t pos)
+{
+  if (nav->keys) {
+    nav->keys[pos].have = 0;
+  }
+  nav->natural_valid = false;
+}
+
+struct imv_navigator *imv_navigator_create(void)
+{
+  struct imv_navigator *nav = calloc(1, sizeof *nav);
+  nav->last_move_direction = 1;
+#ifdef IMV_HAVE_INOTIFY
+  nav->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+  nav->inotify_fd = -1;
+#endif
+  nav->watch = -1;
+  return nav;
+}
+
+void imv_navigator_set_max_threads(struct imv_navigator *nav,
+    int max_threads)
+{
+  nav->max_threads = max_threads;
+}
+
+void imv_navigator_free(struct imv_navigator *nav)
+{
+  for (int i = 0; i < NUM_INDEXES; ++i) {
+    index_clear(nav, i);
+  }
+  arena_free(nav);
+  free(nav->items);
+  free(nav->counts);
+  free(nav->keys);
+  free(nav->watch_name);
+  if (nav->inotify_fd >= 0) {
+    close(nav->inotify_fd);
+  }
+  free(nav);
+}
+
+/* Stores path on the end of the list, which must have room for it */
+static void append_item(struct imv_navigator *nav, const char *path)
+{
+  const size_t pos = nav->len++;
+  nav->items[pos].path = arena_store(nav, path);
+  item_added(nav, pos);
+
+  count_appended(nav);
+  for (int i = 0; i < NUM_INDEXES; ++i) {
+    index_insert(nav, i, pos, true);
+  }
+}
+
+/* Adds a path that's already canonical */
+static int add_canonical_item(struct imv_navigator *nav, const char *path)
+{
+  if (nav->len >= DELETED) {
+    return 1;
+  }
+
+  reserve(nav, 1);
+  append_item(nav, path);
+
+  if (imv_navigator_length(nav) == 1) {
+    nav->cur_path = 0;
+    nav->changed = 1;
+  }
+
+  return 0;
+}
+
+static int add_item(struct imv_navigator *nav, const char *path)
+{
+  char *real_path = realpath(path, NULL);
+  const int ret = add_canonical_item(nav, real_path ? real_path : path);
+  free(real_path);
+  return ret;
+}
+
+struct walk_state {
+  struct imv_navigator *nav;
+
+  /* the directory being walked was made canonical first */
+  bool canonical;
+
+  /* only looks at each directory once, for paths that need resolving */
+  struct imv_resolver *resolver;
+};
+
+static int add_walked_item(const char *path, bool via_link, void *data)
+{
+  struct walk_state *state = data;
+  if (state->canonical && !via_link) {
+    /* nothing to resolve, as it's built from a canonical directory */
+    return add_canonical_item(state->nav, path);
+  }
+
+  char *real_path = imv_resolve_path(state->resolver, path, NULL);
+  const int ret = add_canonical_item(state->nav, real_path ? real_path : path);
+  free(real_path);
+  return ret;
+}
+
+int imv_navigator_add(struct imv_navigator *nav, const char *path,
+                       int recursive)
+{
+  struct stat path_info;
+  if ((stat(path, &path_info) == 0) &&
+      S_ISDIR(path_info.st_mode)) {
+    /* resolving the directory up front means the paths found in it are
+     * canonical already, apart from those reached through links */
+    char *real_path = realpath(path, NULL);
+    struct walk_state state = {
+      .nav = nav,
+      .canonical = real_path != NULL,
+      .resolver = imv_resolver_create(),
+    };
+    const int ret = imv_walk_directory(real_path ? real_path : path,
+        recursive, nav->max_threads, &add_walked_item, &state);
+    imv_resolver_free(state.resolver);
+    free(real_path);
+    return ret;
+  } else {
+    return add_item(nav, path);
+  }
+}
+
+int imv_navigator_append(struct imv_navigator *nav, char *const *paths,
+                          size_t count)
+{
+  if (count > DELETED - nav->len) {
+    return 1;
+  }
+
+  reserve(nav, count);
+  for (size_t i = 0; i < count; ++i) {
+    append_item(nav, paths[i]);
+  }
+
+  if (count > 0 && imv_navigator_length(nav) == count) {
+    nav->cur_path = 0;
+    nav->changed = 1;
+  }
+  return 0;
+}
+
+/* A path waiting to be inserted */
+struct insertion {
+  const char *path;
+
+  /* length of the path's directory, including the trailing separator */
+  size_t dir_len;
+
+  /* position in the list to insert it before */
+  size_t at;
+
+  /* position in the batch once sorted by name, to keep ties in order */
+  size_t order;
+};
+
+static int compare_by_name(const void *a, const void *b)
+{
+  const struct insertion *ins_a = a;
+  const struct insertion *ins_b = b;
+
+  /* grouped by directory, then sorted by name within each one */
+  if (ins_a->dir_len != ins_b->dir_len) {
+    return ins_a->dir_len < ins_b->dir_len ? -1 : 1;
+  }
+  const int cmp = memcmp(ins_a->path, ins_b->path, ins_a->dir_len);
+  if (cmp) {
+    return cmp;
+  }
+  return strcoll(ins_a->path + ins_a->dir_len, ins_b->path + ins_b->dir_len);
+}
+
+static int compare_by_position(const void *a, const void *b)
+{
+  const struct insertion *ins_a = a;
+  const struct insertion *ins_b = b;
+  if (ins_a->at != ins_b->at) {
+    return ins_a->at < ins_b->at ? -1 : 1;
+  }
+  return ins_a->order < ins_b->order ? -1 : ins_a->order > ins_b->order;
+}
+
+/* Works out where each of a group of insertions from the same directory
+ * goes, by binary searching the items already in that directory */
+static void place_group(struct imv_navigator *nav, struct insertion *group,
+    size_t count, const uint32_t *positions, size_t num_positions)
+{
+  for (size_t i = 0; i < count; ++i) {
+    struct insertion *ins = &group[i];
+    if (num_positions == 0) {
+      ins->at = nav->len;
+      continue;
+    }
+
+    /* find the first item that sorts after it */
+    size_t lo = 0;
+    size_t hi = num_positions;
+    while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      const char *path = nav->items[positions[mid]].path;
+      if (strcoll(path + ins->dir_len, ins->path + ins->dir_len) <= 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    ins->at = lo > 0 ? positions[lo - 1] + 1u : positions[0];
+  }
+}
+
+/* Inserts the items before the positions they've been given, which must be in
+ * order, shifting everything else along in one pass */
+static void splice(struct imv_navigator *nav, struct insertion *ins,
+    size_t count)
+{
+  const size_t old_len = nav->len;
+  const bool had_items = imv_navigator_length(nav) > 0;
+  const size_t cur_pos = had_items ? position_of(nav, nav->cur_path) : 0;
+
+  /* where each existing item ends up */
+  uint32_t *moved_to = malloc((old_len + 1) * sizeof *moved_to);
+  size_t shift = 0;
+  for (size_t pos = 0; pos <= old_len; ++pos) {
+    while (shift < count && ins[shift].at <= pos) {
+      shift++;
+    }
+    moved_to[pos] = (uint32_t)(pos + shift);
+  }
+
+  for (int i = 0; i < NUM_INDEXES; ++i) {
+    struct index *index = &nav->indexes[i];
+    for (size_t s = 0; s < index->capacity; ++s) {
+      struct index_slot *slot = &index->slots[s];
+      if (slot->first != NONE && slot->first != DELETED) {
+        slot->first = moved_to[slot->first];
+        slot->last = moved_to[slot->last];
+      }
+    }
+  }
+  for (size_t pos = 0; pos < old_len; ++pos) {
+    for (int i = 0; i < NUM_INDEXES; ++i) {
+      if (nav->items[pos].next[i] != NONE) {
+        nav->items[pos].next[i] = moved_to[nav->items[pos].next[i]];
+      }
+    }
+  }
+
+  /* fill in from the back, so nothing's overwritten before it's moved */
+  size_t src = old_len;
+  size_t dst = old_len + count;
+  for (size_t i = count; i > 0; --i) {
+    while (src > ins[i - 1].at) {
+      --src;
+      --dst;
+      nav->items[dst] = nav->items[src];
+      if (nav->keys) {
+        nav->keys[dst] = nav->keys[src];
+      }
+    }
+    --dst;
+    nav->items[dst].path = arena_store(nav, ins[i - 1].path);
+    item_added(nav, dst);
+    ins[i - 1].at = dst;
+  }
+  nav->len += count;
+  nav->layout++;
+
+  /* items going in among others in the same chain are put on the end for
+   * now, and each chain sorted once, rather than walking a directory's whole
+   * chain for every file going into it */
+  uint32_t *unordered = malloc(count * sizeof *unordered);
+  struct index_slot **slots = malloc(count * sizeof *slots);
+  uint32_t *chain = NULL;
+  size_t chain_cap = 0;
+  for (int which = 0; which < NUM_INDEXES; ++which) {
+    size_t num_unordered = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (!index_insert(nav, which, ins[i].at, false)) {
+        unordered[num_unordered++] = (uint32_t)ins[i].at;
+      }
+    }
+
+    /* slots only move when the index grows, so they're settled by now */
+    for (size_t i = 0; i < num_unordered; ++i) {
+      size_t len;
+      const char *key = item_key(nav, unordered[i], which, &len);
+      slots[i] = index_slot(nav, which, key, len);
+    }
+    qsort(slots, num_unordered, sizeof *slots, &compare_slots);
+    for (size_t i = 0; i < num_unordered; ++i) {
+      if (i == 0 || slots[i] != slots[i - 1]) {
+        sort_chain(nav, which, slots[i], &chain, &chain_cap);
+      }
+    }
+  }
+  free(chain);
+  free(slots);
+  free(unordered);
+  count_all(nav);
+
+  if (had_items) {
+    nav->cur_path = index_of(nav, moved_to[cur_pos]);
+  }
+  free(moved_to);
+}
+
+int imv_navigator_insert(struct imv_navigator *nav, char *const *paths,
+    size_t count)
+{
+  if (count == 0) {
+    return 0;
+  }
+  if (nav->len + count >= DELETED) {
+    return 1;
+  }
+
+  struct insertion *ins = malloc(count * sizeof *ins);
+  size_t num = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const char *path = paths[i];
+    if (index_find(nav, INDEX_PATH, path, strlen(path)) != NONE) {
+      continue;
+    }
+    const char *last_sep = strrchr(path, '/');
+    ins[num].path = path;
+    ins[num].dir_len = last_sep ? (size_t)(last_sep - path) + 1 : 0;
+    num++;
+  }
+
+  qsort(ins, num, sizeof *ins, &compare_by_name);
+
+  /* the same path may turn up more than once in a batch */
+  size_t unique = 0;
+  for (size_t i = 0; i < num; ++i) {
+    if (unique == 0 || strcmp(ins[unique - 1].path, ins[i].path)) {
+      ins[unique] = ins[i];
+      ins[unique].order = unique;
+      unique++;
+    }
+  }
+  num = unique;
+
+  /* find the items already in each directory from its chain, which is in list
+   * order */
+  index_dirs(nav);
+  uint32_t *positions = NULL;
+  size_t positions_cap = 0;
+  for (size_t start = 0, end; start < num; start = end) {
+    const char *dir = ins[start].path;
+    const size_t dir_len = ins[start].dir_len;
+    for (end = start + 1; end < num && ins[end].dir_len == dir_len &&
+        !memcmp(ins[end].path, dir, dir_len); ++end) {
+      continue;
+    }
+
+    size_t num_positions = 0;
+    for (uint32_t pos = index_find(nav, INDEX_DIR, dir, dir_len); pos != NONE;
+        pos = nav->items[pos].next[INDEX_DIR]) {
+      if (num_positions == positions_cap) {
+        positions_cap = positions_cap ? positions_cap * 2 : 64;
+        positions = realloc(positions, positions_cap * sizeof *positions);
+      }
+      positions[num_positions++] = pos;
+    }
+    place_group(nav, &ins[start], end - start, positions, num_positions);
+  }
+  free(positions);
+
+  qsort(ins, num, sizeof *ins, &compare_by_position);
+  reserve(nav, num);
+
+  if (num > 0 && ins[0].at == nav->len) {
+    /* all going on the end, so nothing needs to move */
+    for (size_t i = 0; i < num; ++i) {
+      append_item(nav, ins[i].path);
+    }
+  } else if (num > 0) {
+    splice(nav, ins, num);
+  }
+
+  if (num > 0 && imv_navigator_length(nav) == num) {
+    nav->cur_path = 0;
+    nav->changed = 1;
+  }
 
-/* Some systems like GNU/Hurd don't define PATH_MAX */
-#ifndef PATH_MAX
-#define PATH_MAX 4096
-#endif
+  free(ins);
+  return 0;
+}
 
-struct nav_item {
-  char *path;
+/* A copy of the paths whose details are to be looked up, which can be done
+ * on another thread while the navigator carries on being used */
+struct imv_sort_keys {
+  int needed;
+
+  /* the most threads imv_sort_keys_gather may use, the caller's included */
+  int max_threads;
+
+  /* the navigator's layout when the copy was made, and where each path was,
+   * so the keys can be put straight back if nothing's moved since */
+  unsigned int layout;
+  uint32_t *positions;
+
+  /* the paths, packed end to end */
+  const char **paths;
+  char *storage;
+
+  /* what's known of each path so far */
+  struct nav_keys *keys;
+  size_t count;
+
+  /* the next path to be claimed by a thread */
+  size_t next;
+
+  bool cancelled;
 };
 
-struct imv_navigator {
-  struct list *paths;
-  size_t cur_path;
-  time_t last_change;
-  time_t last_check;
-  int last_move_direction;
-  int changed;
-  int wrapped;
+/* Returns which keys sorting in the given order needs, or 0 if none */
+static int keys_needed(enum imv_sort_order order)
+{
+  switch (order) {
+    case IMV_SORT_MTIME:
+    case IMV_SORT_SIZE:
+      return KEY_STAT;
+    case IMV_SORT_DIMENSIONS:
+      /* so that dimensions are only read again if the file's changed */
+      return KEY_STAT | KEY_DIMENSIONS;
+    default:
+      return 0;
+  }
+}
+
+static void gather_item(const char *path, struct nav_keys *keys, int needed)
+{
+  if ((needed & KEY_STAT) && !(keys->have & KEY_STAT)) {
+    uint64_t mtime = UINT64_MAX;
+    uint64_t size = UINT64_MAX;
+    struct stat info;
+    if (stat(path, &info) == 0) {
+      /* flipping the sign bit makes signed times sort as unsigned */
+      const int64_t ns = (int64_t)info.st_mtim.tv_sec * 1000000000 +
+                         info.st_mtim.tv_nsec;
+      mtime = (uint64_t)ns ^ ((uint64_t)1 << 63);
+      size = (uint64_t)info.st_size;
+    }
+    if (mtime != keys->mtime || size != keys->size) {
+      /* the file's been rewritten, so may not be the same size any more */
+      keys->have &= ~KEY_DIMENSIONS;
+    }
+    keys->mtime = mtime;
+    keys->size = size;
+    keys->have |= KEY_STAT;
+  }
+
+  if ((needed & KEY_DIMENSIONS) && !(keys->have & KEY_DIMENSIONS)) {
+    int width, height;
+    if (imv_read_dimensions(path, &width, &height)) {
+      keys->pixels = (uint64_t)width * (uint64_t)height;
+    } else {
+      keys->pixels = UINT64_MAX;
+    }
+    keys->have |= KEY_DIMENSIONS;
+  }
+}
+
+static void *gather_thread(void *data)
+{
+  struct imv_sort_keys *gather = data;
+
+  while (!__atomic_load_n(&gather->cancelled, __ATOMIC_RELAXED)) {
+    const size_t start = __atomic_fetch_add(&gather->next, GATHER_CHUNK,
+        __ATOMIC_RELAXED);
+    if (start >= gather->count) {
+      break;
+    }
+    const size_t end = start + GATHER_CHUNK < gather->count
+                     ? start + GATHER_CHUNK : gather->count;
+    for (size_t i = start; i < end; ++i) {
+      gather_item(gather->paths[i], &gather->keys[i], gather->needed);
+    }
+  }
+  return NULL;
+}
+
+static void alloc_keys(struct imv_navigator *nav)
+{
+  if (!nav->keys) {
+    nav->keys = calloc(nav->cap, sizeof *nav->keys);
+  }
+}
+
+/* Copies the paths missing any of the needed keys, or every path if refresh
+ * is set. Returns NULL if there are none. */
+static struct imv_sort_keys *copy_keys(struct imv_navigator *nav, int needed,
+    bool refresh)
+{
+  alloc_keys(nav);
+
+  size_t count = 0;
+  size_t size = 0;
+  for (size_t pos = 0; pos < nav->len; ++pos) {
+    if (nav->items[pos].path &&
+        (refresh || (nav->keys[pos].have & needed) != needed)) {
+      count++;
+      size += strlen(nav->items[pos].path) + 1;
+    }
+  }
+  if (count == 0) {
+    return NULL;
+  }
+
+  struct imv_sort_keys *gather = calloc(1, sizeof *gather);
+  gather->needed = needed;
+  gather->max_threads = nav->max_threads > 0 &&
+                        nav->max_threads < GATHER_THREADS
+                      ? nav->max_threads : GATHER_THREADS;
+  gather->layout = nav->layout;
+  gather->positions = malloc(count * sizeof *gather->positions);
+  gather->paths = malloc(count * sizeof *gather->paths);
+  gather->storage = malloc(size);
+  gather->keys = malloc(count * sizeof *gather->keys);
+
+  char *storage = gather->storage;
+  for (size_t pos = 0; pos < nav->len; ++pos) {
+    const char *path = nav->items[pos].path;
+    if (!path || (!refresh && (nav->keys[pos].have & needed) == needed)) {
+      continue;
+    }
+    const size_t len = strlen(path) + 1;
+    memcpy(storage, path, len);
+    gather->positions[gather->count] = (uint32_t)pos;
+    gather->paths[gather->count] = storage;
+    gather->keys[gather->count] = nav->keys[pos];
+    if (refresh) {
+      /* files may have been rewritten since they were last looked at */
+      gather->keys[gather->count].have &= ~KEY_STAT;
+    }
+    gather->count++;
+    storage += len;
+  }
+  return gather;
+}
+
+/* Stores one path's gathered keys, keeping the natural key as it is */
+static void store_keys(struct imv_navigator *nav, size_t pos,
+    const struct nav_keys *keys)
+{
+  const uint32_t natural = nav->keys[pos].natural;
+  nav->keys[pos] = *keys;
+  nav->keys[pos].natural = natural;
+}
+
+/* Looks up any keys that haven't been yet, spread across several threads */
+static void gather_keys(struct imv_navigator *nav, int needed)
+{
+  struct imv_sort_keys *gather = copy_keys(nav, needed, false);
+  if (gather) {
+    imv_sort_keys_gather(gather);
+    imv_navigator_apply_keys(nav, gather);
+    imv_sort_keys_free(gather);
+  }
+}
+
+bool imv_navigator_sort_needs_keys(enum imv_sort_order order)
+{
+  return keys_needed(order) != 0;
+}
+
+struct imv_sort_keys *imv_navigator_sort_keys(struct imv_navigator *nav,
+    enum imv_sort_order order)
+{
+  const int needed = keys_needed(order);
+  return needed ? copy_keys(nav, needed, true) : NULL;
+}
+
+struct imv_sort_keys *imv_navigator_missing_keys(struct imv_navigator *nav,
+    enum imv_sort_order order)
+{
+  const int needed = keys_needed(order);
+  return needed ? copy_keys(nav, needed, false) : NULL;
+}
+
+void imv_sort_keys_gather(struct imv_sort_keys *gather)
+{
+  /* the calling thread does its share too, or all of it if none start */
+  pthread_t threads[GATHER_THREADS - 1];
+  int num_threads = 0;
+  while (num_threads < gather->max_threads - 1 &&
+      (size_t)num_threads * GATHER_CHUNK < gather->count &&
+      !pthread_create(&threads[num_threads], NULL, &gather_thread, gather)) {
+    num_threads++;
+  }
+  gather_thread(gather);
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+void imv_sort_keys_cancel(struct imv_sort_keys *gather)
+{
+  __atomic_store_n(&gather->cancelled, true, __ATOMIC_RELAXED);
+}
+
+bool imv_sort_keys_cover(const struct imv_sort_keys *gather,
+    enum imv_sort_order order)
+{
+  const int needed = keys_needed(order);
+  return !gather->cancelled && (gather->needed & needed) == needed;
+}
+
+void imv_navigator_apply_keys(struct imv_navigator *nav,
+    const struct imv_sort_keys *gather)
+{
+  alloc_keys(nav);
+
+  for (size_t i = 0; i < gather->count; ++i) {
+    if (gather->layout == nav->layout) {
+      /* nothing's moved, though the path may have been removed */
+      const uint32_t pos = gather->positions[i];
+      if (nav->items[pos].path) {
+        store_keys(nav, pos, &gather->keys[i]);
+      }
+      continue;
+    }
+
+    /* the same path may be listed more than once */
+    const char *path = gather->paths[i];
+    for (uint32_t pos = index_find(nav, INDEX_PATH, path, strlen(path));
+        pos != NONE; pos = nav->items[pos].next[INDEX_PATH]) {
+      store_keys(nav, pos, &gather->keys[i]);
+    }
+  }
+}
+
+void imv_sort_keys_free(struct imv_sort_keys *gather)
+{
+  if (!gather) {
+    return;
+  }
+  free(gather->positions);
+  free(gather->paths);
+  free(gather->storage);
+  free(gather->keys);
+  free(gather);
+}
+
+/* Compares paths byte by byte, except for runs of digits, which are compared
+ * by their value so that "2" comes before "10" */
+static int natural_compare(const char *a, const char *b)
+{
+  while (*a && *b) {
+    if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+      while (*a == '0') {
+        ++a;
+      }
+      while (*b == '0') {
+        ++b;
+      }
+      size_t len_a = 0;
+      size_t len_b = 0;
+      while (isdigit((unsigned char)a[len_a])) {
+        ++len_a;
+      }
+      while (isdigit((unsigned char)b[len_b])) {
+        ++len_b;
+      }
+      if (len_a != len_b) {
+        return len_a < len_b ? -1 : 1;
+      }
+      const int cmp = memcmp(a, b, len_a);
+      if (cmp) {
+        return cmp;
+      }
+      a += len_a;
+      b += len_b;
+    } else if (*a != *b) {
+      return (unsigned char)*a < (unsigned char)*b ? -1 : 1;
+    } else {
+      ++a;
+      ++b;
+    }
+  }
+  return (unsigned char)*a - (unsigned char)*b;
+}
+
+struct natural_entry {
+  const char *path;
+  uint32_t pos;
 };
 
-struct imv_navigator *imv_navigator_create(void)
+static int compare_natural_entries(const void *a, const void *b)
 {
-  struct imv_navigator *nav = calloc(1, sizeof *nav);
-  nav->last_move_direction = 1;
-  nav->paths = list_create();
-  return nav;
+  const struct natural_entry *entry_a = a;
+  const struct natural_entry *entry_b = b;
+  return natural_compare(entry_a->path, entry_b->path);
 }
 
-void imv_navigator_free(struct imv_navigator *nav)
+/* Works out each item's place in natural order. This is the only sort that
+ * compares strings, so the result is kept until a path is added. */
+static void rank_natural(struct imv_navigator *nav)
 {
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *nav_item = nav->paths->items[i];
-    free(nav_item->path);
+  alloc_keys(nav);
+  if (nav->natural_valid) {
+    return;
   }
-  list_deep_free(nav->paths);
-  free(nav);
+
+  struct natural_entry *entries = malloc((nav->len + 1) * sizeof *entries);
+  size_t count = 0;
+  for (size_t pos = 0; pos < nav->len; ++pos) {
+    if (nav->items[pos].path) {
+      entries[count].path = nav->items[pos].path;
+      entries[count].pos = (uint32_t)pos;
+      count++;
+    }
+  }
+  qsort(entries, count, sizeof *entries, &compare_natural_entries);
+  for (size_t i = 0; i < count; ++i) {
+    nav->keys[entries[i].pos].natural = (uint32_t)i;
+  }
+  free(entries);
+  nav->natural_valid = true;
 }
 
-static int add_item(struct imv_navigator *nav, const char *path)
+static uint64_t mix(uint64_t x)
+{
+  /* splitmix64's finaliser */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9u;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebu;
+  x ^= x >> 31;
+  return x;
+}
+
+/* How many bits of the keys each radix sort pass sorts on. More would mean
+ * fewer passes, but each pass then scatters to so many places at once that
+ * the caches can't keep up. */
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_MASK (RADIX_SIZE - 1)
+#define RADIX_MAX_PASSES ((64 + RADIX_BITS - 1) / RADIX_BITS)
+
+/* Works out where each digit goes in every pass, counting them all in one
+ * read of the keys rather than one per pass */
+static void radix_offsets(const uint64_t *keys, size_t count, int shift,
+    int passes, size_t offsets[][RADIX_SIZE])
+{
+  memset(offsets, 0, passes * sizeof *offsets);
+  for (size_t i = 0; i < count; ++i) {
+    for (int p = 0; p < passes; ++p) {
+      offsets[p][(keys[i] >> (shift + p * RADIX_BITS)) & RADIX_MASK]++;
+    }
+  }
+
+  for (int p = 0; p < passes; ++p) {
+    size_t total = 0;
+    for (int d = 0; d < RADIX_SIZE; ++d) {
+      const size_t n = offsets[p][d];
+      offsets[p][d] = total;
+      total += n;
+    }
+  }
+}
+
+/* A stable least significant digit radix sort of the lowest bits of keys,
+ * moving the positions along with them */
+static void radix_sort_keyed(uint64_t *keys, uint32_t *positions,
+    size_t count, int bits)
 {
-  struct nav_item *nav_item = calloc(1, sizeof *nav_item);
+  const int passes = (bits + RADIX_BITS - 1) / RADIX_BITS;
+  size_t offsets[RADIX_MAX_PASSES][RADIX_SIZE];
+  radix_offsets(keys, count, 0, passes, offsets);
+
+  uint64_t *tmp_keys = malloc(count * sizeof *tmp_keys);
+  uint32_t *tmp_positions = malloc(count * sizeof *tmp_positions);
+  uint64_t *src_keys = keys, *dst_keys = tmp_keys;
+  uint32_t *src_positions = positions, *dst_positions = tmp_positions;
+
+  for (int p = 0; p < passes; ++p) {
+    const int shift = p * RADIX_BITS;
+    for (size_t i = 0; i < count; ++i) {
+      const size_t to = offsets[p][(src_keys[i] >> shift) & RADIX_MASK]++;
+      dst_keys[to] = src_keys[i];
+      dst_positions[to] = src_positions[i];
+    }
 
-  nav_item->path = realpath(path, NULL);
-  if (!nav_item->path) {
-    nav_item->path = strdup(path);
+    uint64_t *swap_keys = src_keys;
+    src_keys = dst_keys;
+    dst_keys = swap_keys;
+    uint32_t *swap_positions = src_positions;
+    src_positions = dst_positions;
+    dst_positions = swap_positions;
   }
 
-  list_append(nav->paths, nav_item);
+  if (src_keys != keys) {
+    memcpy(keys, src_keys, count * sizeof *keys);
+    memcpy(positions, src_positions, count * sizeof *positions);
+  }
+  free(tmp_keys);
+  free(tmp_positions);
+}
 
-  if (nav->paths->len == 1) {
-    nav->cur_path = 0;
-    nav->changed = 1;
+/* As radix_sort_keyed, for keys of up to 32 bits packed above their positions,
+ * which halves what has to be moved about */
+static void radix_sort_packed(uint64_t *packed, size_t count, int bits)
+{
+  const int passes = (bits + RADIX_BITS - 1) / RADIX_BITS;
+  size_t offsets[RADIX_MAX_PASSES][RADIX_SIZE];
+  radix_offsets(packed, count, 32, passes, offsets);
+
+  uint64_t *tmp = malloc(count * sizeof *tmp);
+  uint64_t *src = packed, *dst = tmp;
+
+  for (int p = 0; p < passes; ++p) {
+    const int shift = 32 + p * RADIX_BITS;
+    for (size_t i = 0; i < count; ++i) {
+      dst[offsets[p][(src[i] >> shift) & RADIX_MASK]++] = src[i];
+    }
+
+    uint64_t *swap = src;
+    src = dst;
+    dst = swap;
   }
 
-  return 0;
+  if (src != packed) {
+    memcpy(packed, src, count * sizeof *packed);
+  }
+  free(tmp);
 }
 
-int imv_navigator_add(struct imv_navigator *nav, const char *path,
-                       int recursive)
+/* Sorts the positions by their keys, keeping ties in order. Only the bits
+ * that differ between the keys are sorted on, which for most orders is far
+ * fewer than 64. Keys of UINT64_MAX go last without widening that range. The
+ * keys are left in no particular state. */
+static void sort_positions(uint64_t *keys, uint32_t *positions, size_t count)
 {
-  char path_buf[PATH_MAX+1];
-  struct stat path_info;
-  if ((stat(path, &path_info) == 0) &&
-      S_ISDIR(path_info.st_mode)) {
-    int result = 0;
-    struct dirent **dir_list;
-    int total_dirs = scandir(path, &dir_list, 0, alphasort);
-    if (total_dirs >= 0) {
-      for (int i = 0; i < total_dirs; ++i) {
-        struct dirent *dir = dir_list[i];
-        if (strcmp(dir->d_name, "..") == 0 || strcmp(dir->d_name, ".") == 0) {
-          continue;
-        }
-        snprintf(path_buf, sizeof path_buf, "%s/%s", path, dir->d_name);
-        struct stat new_path_info;
-        if (stat(path_buf, &new_path_info)) {
-          switch (errno) {
-          case ELOOP:
-          case ENOTDIR:
-          case ENOENT: continue;
-          default: result = 1; break;
-          }
-        }
-        int is_dir = S_ISDIR(new_path_info.st_mode);
-        if (is_dir && recursive) {
-          if (imv_navigator_add(nav, path_buf, recursive) != 0) {
-            result = 1;
-            break;
-          }
-        } else if (!is_dir) {
-          if (add_item(nav, path_buf) != 0) {
-            result = 1;
-            break;
-          }
-        }
-        free(dir_list[i]);
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+  bool unknown = false;
+  for (size_t i = 0; i < count; ++i) {
+    if (keys[i] == UINT64_MAX) {
+      unknown = true;
+      continue;
+    }
+    min = keys[i] < min ? keys[i] : min;
+    max = keys[i] > max ? keys[i] : max;
+  }
+  if (min > max) {
+    /* every key's unknown, so there's nothing to sort */
+    return;
+  }
+  if (unknown && max < UINT64_MAX - 1) {
+    max++;
+    for (size_t i = 0; i < count; ++i) {
+      keys[i] = keys[i] == UINT64_MAX ? max : keys[i];
+    }
+  }
+
+  int bits = 0;
+  while (bits < 64 && (max - min) >> bits) {
+    bits++;
+  }
+
+  if (bits > 32) {
+    for (size_t i = 0; i < count; ++i) {
+      keys[i] -= min;
+    }
+    radix_sort_keyed(keys, positions, count, bits);
+    return;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    keys[i] = (keys[i] - min) << 32 | positions[i];
+  }
+  radix_sort_packed(keys, count, bits);
+  for (size_t i = 0; i < count; ++i) {
+    positions[i] = (uint32_t)keys[i];
+  }
+}
+
+/* Rearranges the items so that the one at position order[i] ends up at i,
+ * dropping any tombstones. The indexes are patched up rather than rebuilt, so
+ * no paths are hashed. */
+static void reorder(struct imv_navigator *nav, const uint32_t *order,
+    size_t count)
+{
+  const size_t cur_pos = position_of(nav, nav->cur_path);
+
+  uint32_t *moved_to = malloc(nav->len * sizeof *moved_to);
+  for (size_t i = 0; i < count; ++i) {
+    moved_to[order[i]] = (uint32_t)i;
+  }
+
+  struct nav_item *items = malloc(nav->cap * sizeof *items);
+  struct nav_keys *keys = nav->keys ? malloc(nav->cap * sizeof *keys) : NULL;
+  for (size_t i = 0; i < count; ++i) {
+    items[i] = nav->items[order[i]];
+    items[i].next[INDEX_DIR] = NONE;
+    for (int which = 0; which < NUM_INDEXES; ++which) {
+      if (which != INDEX_DIR && items[i].next[which] != NONE) {
+        items[i].next[which] = moved_to[items[i].next[which]];
       }
-      free(dir_list);
     }
-    return result;
-  } else {
-    return add_item(nav, path);
+    if (keys) {
+      keys[i] = nav->keys[order[i]];
+    }
   }
+  free(nav->items);
+  free(nav->keys);
+  nav->items = items;
+  nav->keys = keys;
+  nav->len = count;
+  nav->removed = 0;
+  nav->layout++;
+  nav->cur_path = moved_to[cur_pos];
 
-  return 0;
+  /* every item's in a directory's chain, so it'd all need relinking */
+  index_reset(nav, INDEX_DIR);
+  nav->dirs_indexed = false;
+
+  uint32_t *chain = NULL;
+  size_t chain_cap = 0;
+  for (int which = 0; which < NUM_INDEXES; ++which) {
+    struct index *index = &nav->indexes[which];
+    for (size_t s = 0; s < index->capacity; ++s) {
+      struct index_slot *slot = &index->slots[s];
+      if (slot->first == NONE || slot->first == DELETED) {
+        continue;
+      }
+      slot->first = moved_to[slot->first];
+      slot->last = moved_to[slot->last];
+      if (slot->first != slot->last) {
+        sort_chain(nav, which, slot, &chain, &chain_cap);
+      }
+    }
+  }
+  free(chain);
+  free(moved_to);
+
+  count_all(nav);
+}
+
+void imv_navigator_sort(struct imv_navigator *nav, enum imv_sort_order order,
+                        bool reverse, uint64_t seed)
+{
+  const size_t count = imv_navigator_length(nav);
+  if (count == 0) {
+    return;
+  }
+
+  switch (order) {
+    case IMV_SORT_NATURAL: rank_natural(nav); break;
+    case IMV_SORT_MTIME:
+    case IMV_SORT_SIZE:
+    case IMV_SORT_DIMENSIONS: gather_keys(nav, keys_needed(order)); break;
+    case IMV_SORT_RANDOM: break;
+  }
+
+  uint64_t *keys = malloc(count * sizeof *keys);
+  uint32_t *sorted = malloc(count * sizeof *sorted);
+  size_t num = 0;
+  for (size_t pos = 0; pos < nav->len; ++pos) {
+    const char *path = nav->items[pos].path;
+    if (!path) {
+      continue;
+    }
+
+    uint64_t key = 0;
+    switch (order) {
+      case IMV_SORT_NATURAL: key = nav->keys[pos].natural; break;
+      case IMV_SORT_MTIME: key = nav->keys[pos].mtime; break;
+      case IMV_SORT_SIZE: key = nav->keys[pos].size; break;
+      case IMV_SORT_DIMENSIONS: key = nav->keys[pos].pixels; break;
+      /* 32 bits is plenty to shuffle by, and quicker to sort */
+      case IMV_SORT_RANDOM: key = mix(seed ^ mix(hash_key(path, strlen(path)))) >> 32; break;
+    }
+    /* paths that couldn't be looked at stay last either way */
+    keys[num] = reverse && key != UINT64_MAX ? ~key : key;
+    sorted[num] = (uint32_t)pos;
+    num++;
+  }
+
+  sort_positions(keys, sorted, num);
+  free(keys);
+  reorder(nav, sorted, num);
+  free(sorted);
 }
 
 const char *imv_navigator_selection(struct imv_navigator *nav)
@@ -130,29 +1570,35 @@ size_t imv_navigator_index(struct imv_navigator *nav)
   return nav->cur_path;
 }
 
+int imv_navigator_last_direction(struct imv_navigator *nav)
+{
+  return nav->last_move_direction < 0 ? -1 : 1;
+}
+
 void imv_navigator_select_rel(struct imv_navigator *nav, ssize_t direction)
 {
   const ssize_t prev_path = nav->cur_path;
-  if (nav->paths->len == 0) {
+  const size_t len = imv_navigator_length(nav);
+  if (len == 0) {
     return;
   }
 
   if (direction > 1) {
-    direction = div(direction, nav->paths->len).rem;
+    direction = div(direction, len).rem;
   } else if (direction < -1) {
-    direction = div(direction, nav->paths->len).rem;
+    direction = div(direction, len).rem;
   } else if (direction == 0) {
     return;
   }
 
   ssize_t new_path = nav->cur_path + direction;
-  if (new_path >= (ssize_t)nav->paths->len) {
+  if (new_path >= (ssize_t)len) {
     /* Wrap after the end of the list */
-    new_path -= (ssize_t)nav->paths->len;
+    new_path -= (ssize_t)len;
     nav->wrapped = 1;
   } else if (new_path < 0) {
     /* Wrap before the start of the list */
-    new_path += (ssize_t)nav->paths->len;
+    new_path += (ssize_t)len;
     nav->wrapped = 1;
   }
   nav->cur_path = (size_t)new_path;
@@ -163,9 +1609,11 @@ void imv_navigator_select_rel(struct imv_navigator *nav, ssize_t direction)
 
 void imv_navigator_select_abs(struct imv_navigator *nav, ssize_t index)
 {
+  const size_t len = imv_navigator_length(nav);
+
   /* allow -1 to indicate the last image */
   if (index < 0) {
-    index += (ssize_t)nav->paths->len;
+    index += (ssize_t)len;
 
     /* but if they go farther back than the first image, stick to first image */
     if (index < 0) {
@@ -174,8 +1622,8 @@ void imv_navigator_select_abs(struct imv_navigator *nav, ssize_t index)
   }
 
   /* stick to last image if we go beyond it */
-  if (index >= (ssize_t)nav->paths->len) {
-    index = (ssize_t)nav->paths->len - 1;
+  if (index >= (ssize_t)len) {
+    index = (ssize_t)len - 1;
   }
 
   const size_t prev_path = nav->cur_path;
@@ -184,24 +1632,20 @@ void imv_navigator_select_abs(struct imv_navigator *nav, ssize_t index)
   nav->last_move_direction = (index >= (ssize_t)prev_path) ? 1 : -1;
 }
 
-void imv_navigator_remove(struct imv_navigator *nav, const char *path)
+static void remove_item(struct imv_navigator *nav, size_t pos)
 {
-  bool found = false;
-  size_t removed = 0;
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *item = nav->paths->items[i];
-    if (!strcmp(item->path, path)) {
-      free(item->path);
-      free(item);
-      list_remove(nav->paths, i);
-      removed = i;
-      found = true;
-      break;
-    }
+  const size_t removed = index_of(nav, pos);
+
+  for (int i = 0; i < NUM_INDEXES; ++i) {
+    index_remove(nav, i, pos);
   }
+  nav->items[pos].path = NULL;
+  count_removed(nav, pos);
+  nav->removed++;
 
-  if (!found) {
-    return;
+  if (nav->removed >= MIN_TOMBSTONES_TO_COMPACT &&
+      nav->removed > imv_navigator_length(nav)) {
+    compact(nav);
   }
 
   if (nav->cur_path == removed) {
@@ -211,7 +1655,7 @@ void imv_navigator_remove(struct imv_navigator *nav, const char *path)
       imv_navigator_select_rel(nav, -1);
     } else {
       /* Try to stay where we are, unless we ran out of room */
-      if (nav->cur_path == nav->paths->len) {
+      if (nav->cur_path == imv_navigator_length(nav)) {
         nav->cur_path = 0;
         nav->wrapped = 1;
       }
@@ -220,40 +1664,31 @@ void imv_navigator_remove(struct imv_navigator *nav, const char *path)
   nav->changed = 1;
 }
 
-void imv_navigator_remove_at(struct imv_navigator *nav, size_t index)
+void imv_navigator_remove(struct imv_navigator *nav, const char *path)
 {
-  if (index >= nav->paths->len) {
-    return;
+  const uint32_t pos = index_find(nav, INDEX_PATH, path, strlen(path));
+  if (pos != NONE) {
+    remove_item(nav, pos);
   }
-  struct nav_item *item = nav->paths->items[index];
-  free(item->path);
-  free(item);
-  list_remove(nav->paths, index);
+}
 
-  if (nav->cur_path == index) {
-    /* We just removed the current path */
-    if (nav->last_move_direction < 0) {
-      /* Move left */
-      imv_navigator_select_rel(nav, -1);
-    } else {
-      /* Try to stay where we are, unless we ran out of room */
-      if (nav->cur_path == nav->paths->len) {
-        nav->cur_path = 0;
-        nav->wrapped = 1;
-      }
-    }
+void imv_navigator_remove_at(struct imv_navigator *nav, size_t index)
+{
+  if (index >= imv_navigator_length(nav)) {
+    return;
   }
-  nav->changed = 1;
+  remove_item(nav, position_of(nav, index));
 }
 
 void imv_navigator_remove_all(struct imv_navigator *nav)
 {
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *item = nav->paths->items[i];
-    free(item->path);
-    free(item);
+  for (int i = 0; i < NUM_INDEXES; ++i) {
+    index_clear(nav, i);
   }
-  list_clear(nav->paths);
+  arena_free(nav);
+  nav->len = 0;
+  nav->removed = 0;
+  nav->layout++;
   nav->cur_path = 0;
   nav->changed = 1;
 }
@@ -263,55 +1698,132 @@ ssize_t imv_navigator_find_path(struct imv_navigator *nav, const char *path)
   char *real_path = realpath(path, NULL);
   if (real_path) {
     /* first try to match the exact path if path can be resolved */
-    for (size_t i = 0; i < nav->paths->len; ++i) {
-      struct nav_item *item = nav->paths->items[i];
-      if (!strcmp(item->path, real_path)) {
-        free(real_path);
-        return (ssize_t)i;
-      }
-    }
-
+    const uint32_t pos = index_find(nav, INDEX_PATH, real_path,
+        strlen(real_path));
     free(real_path);
+    if (pos != NONE) {
+      return (ssize_t)index_of(nav, pos);
+    }
   }
 
   /* no exact matches or path cannot be resolved, try the final portion of the path */
-  for (size_t i = 0; i < nav->paths->len; ++i) {
-    struct nav_item *item = nav->paths->items[i];
-    char *last_sep = strrchr(item->path, '/');
-    if (last_sep && !strcmp(last_sep+1, path)) {
-      return (ssize_t)i;
-    }
+  const uint32_t pos = index_find(nav, INDEX_NAME, path, strlen(path));
+  if (pos != NONE) {
+    return (ssize_t)index_of(nav, pos);
   }
 
   /* no matches at all, give up */
   return -1;
 }
 
+#ifdef IMV_HAVE_INOTIFY
+/* Moves the watch onto the current path's directory, dropping any events
+ * still queued for the old one */
+static void watch_selection(struct imv_navigator *nav)
+{
+  if (nav->watch >= 0) {
+    inotify_rm_watch(nav->inotify_fd, nav->watch);
+    nav->watch = -1;
+  }
+  free(nav->watch_name);
+  nav->watch_name = NULL;
+
+  const char *path = imv_navigator_at(nav, nav->cur_path);
+  if (path) {
+    /* the directory is watched rather than the file, so that files replaced
+     * by renaming over them are still noticed */
+    const char *last_sep = strrchr(path, '/');
+    char *dir = last_sep ? strndup(path, (size_t)(last_sep - path) + 1)
+                         : strdup(".");
+    nav->watch = inotify_add_watch(nav->inotify_fd, dir,
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+    nav->watch_name = strdup(last_sep ? last_sep + 1 : path);
+    free(dir);
+  }
+
+  union {
+    struct inotify_event event;
+    char buf[4096];
+  } events;
+  while (read(nav->inotify_fd, &events, sizeof events) > 0) {
+    continue;
+  }
+}
+
+/* Returns 1 if any of the queued events are for the current path */
+static int selection_rewritten(struct imv_navigator *nav)
+{
+  int rewritten = 0;
+
+  union {
+    struct inotify_event event;
+    char buf[4096];
+  } events;
+  ssize_t len;
+  while ((len = read(nav->inotify_fd, &events, sizeof events)) > 0) {
+    for (char *ptr = events.buf; ptr < events.buf + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)ptr;
+      if (event->wd == nav->watch && event->len > 0 &&
+          !strcmp(event->name, nav->watch_name)) {
+        rewritten = 1;
+      }
+      ptr += sizeof *event + event->len;
+    }
+  }
+  return rewritten;
+}
+#endif
+
+int imv_navigator_watch_fd(struct imv_navigator *nav)
+{
+  return nav->inotify_fd;
+}
+
+int imv_navigator_watching(struct imv_navigator *nav)
+{
+  return nav->inotify_fd >= 0 && nav->watch >= 0;
+}
+
 int imv_navigator_poll_changed(struct imv_navigator *nav)
 {
   if (nav->changed) {
     nav->changed = 0;
-    nav->last_change = time(NULL);
+    clock_gettime(CLOCK_REALTIME, &nav->last_change);
+#ifdef IMV_HAVE_INOTIFY
+    if (nav->inotify_fd >= 0) {
+      watch_selection(nav);
+    }
+#endif
     return 1;
   }
 
-  if (nav->paths->len == 0) {
+  if (imv_navigator_length(nav) == 0) {
     return 0;
   };
 
+#ifdef IMV_HAVE_INOTIFY
+  /* if the directory couldn't be watched, such as when the limit on watches
+   * has been reached, fall back to checking the file's mtime */
+  if (imv_navigator_watching(nav)) {
+    return selection_rewritten(nav);
+  }
+#endif
+
   time_t cur_time = time(NULL);
   /* limit polling to once per second */
   if (nav->last_check < cur_time - 1) {
     nav->last_check = cur_time;
 
     struct stat file_info;
-    struct nav_item *cur_item = nav->paths->items[nav->cur_path];
-    if (stat(cur_item->path, &file_info) == -1) {
+    const char *cur_path = imv_navigator_at(nav, nav->cur_path);
+    if (!cur_path || stat(cur_path, &file_info) == -1) {
       return 0;
     }
 
-    time_t file_changed = file_info.st_mtim.tv_sec;
-    if (file_changed > nav->last_change) {
+    const struct timespec file_changed = file_info.st_mtim;
+    if (file_changed.tv_sec > nav->last_change.tv_sec ||
+        (file_changed.tv_sec == nav->last_change.tv_sec &&
+         file_changed.tv_nsec > nav->last_change.tv_nsec)) {
       nav->last_change = file_changed;
       return 1;
     }
@@ -326,14 +1838,13 @@ int imv_navigator_wrapped(struct imv_navigator *nav)
 
 size_t imv_navigator_length(struct imv_navigator *nav)
 {
-  return nav->paths->len;
+  return nav->len - nav->removed;
 }
 
-char *imv_navigator_at(struct imv_navigator *nav, size_t index)
+const char *imv_navigator_at(struct imv_navigator *nav, size_t index)
 {
-  if (index < nav->paths->len) {
-    struct nav_item *item = nav->paths->items[index];
-    return item->path;
+  if (index < imv_navigator_length(nav)) {
+    return nav->items[position_of(nav, index)].path;
   }
   return NULL;
 }
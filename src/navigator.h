@@ -1,14 +1,35 @@
 #ifndef IMV_NAVIGATOR_H
 #define IMV_NAVIGATOR_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
+enum imv_sort_order {
+  /* by path, with runs of digits compared as numbers */
+  IMV_SORT_NATURAL,
+  /* oldest first */
+  IMV_SORT_MTIME,
+  /* smallest file first */
+  IMV_SORT_SIZE,
+  /* fewest pixels first */
+  IMV_SORT_DIMENSIONS,
+  /* shuffled, the same way each time for the same seed */
+  IMV_SORT_RANDOM,
+};
+
 /* Creates an instance of imv_navigator */
 struct imv_navigator *imv_navigator_create(void);
 
 /* Cleans up an imv_navigator instance */
 void imv_navigator_free(struct imv_navigator *nav);
 
+/* Limits how many threads walking directories or looking up file details for
+ * a sort may use at once, counting the calling thread. Zero or less leaves it
+ * to the defaults, which are never exceeded. */
+void imv_navigator_set_max_threads(struct imv_navigator *nav,
+    int max_threads);
+
 /* Adds the given path to the navigator's internal list.
  * If a directory is given, all files within that directory are added.
  * An internal copy of path is made.
@@ -17,6 +38,69 @@ void imv_navigator_free(struct imv_navigator *nav);
 int imv_navigator_add(struct imv_navigator *nav, const char *path,
                        int recursive);
 
+/* Adds a batch of paths to the end of the list, exactly as given. Unlike
+ * imv_navigator_add, they aren't resolved or checked for being directories,
+ * so that's left to the caller, who may be able to do it more cheaply.
+ * Non-zero return code denotes failure. */
+int imv_navigator_append(struct imv_navigator *nav, char *const *paths,
+                          size_t count);
+
+/* Adds a batch of paths, each placed among those already listed from the same
+ * directory so that they stay in sorted order, or appended if there are none.
+ * Paths are stored as given, so should already be canonical, as with
+ * imv_navigator_append. Paths that are already listed are skipped, and
+ * directories are added as they are rather than expanded. The current
+ * selection stays where it is. Non-zero return code denotes failure. */
+int imv_navigator_insert(struct imv_navigator *nav, char *const *paths,
+                          size_t count);
+
+/* Reorders the paths, keeping the same one selected. Paths that can't be
+ * looked at go last. Any file details needed that haven't been looked up yet
+ * are looked up first, in parallel, which blocks; imv_navigator_sort_keys can
+ * be used to look them up beforehand without blocking. Paths added afterwards
+ * go wherever they would have anyway, until sorted again. */
+void imv_navigator_sort(struct imv_navigator *nav, enum imv_sort_order order,
+                        bool reverse, uint64_t seed);
+
+/* Returns true if sorting in the given order needs file details looked up */
+bool imv_navigator_sort_needs_keys(enum imv_sort_order order);
+
+/* The file details a sort order needs, for a copy of the navigator's paths */
+struct imv_sort_keys;
+
+/* Copies the paths so that the details needed to sort them in the given order
+ * can be looked up afresh on another thread. Returns NULL if the order doesn't
+ * need any, or there are no paths. */
+struct imv_sort_keys *imv_navigator_sort_keys(struct imv_navigator *nav,
+                                              enum imv_sort_order order);
+
+/* Like imv_navigator_sort_keys, but only copies the paths whose details
+ * haven't been looked up yet, such as those added since the last lookup.
+ * Returns NULL if there are none, so sorting wouldn't block. */
+struct imv_sort_keys *imv_navigator_missing_keys(struct imv_navigator *nav,
+                                                 enum imv_sort_order order);
+
+/* Looks up the details, in parallel, blocking until done or cancelled. Safe to
+ * call from any thread, while the navigator is in use. */
+void imv_sort_keys_gather(struct imv_sort_keys *keys);
+
+/* Asks imv_sort_keys_gather to stop as soon as possible. Safe to call from
+ * any thread. */
+void imv_sort_keys_cancel(struct imv_sort_keys *keys);
+
+/* Returns true if the details gathered are all that's needed to sort in the
+ * given order, apart from any for paths added since */
+bool imv_sort_keys_cover(const struct imv_sort_keys *keys,
+                         enum imv_sort_order order);
+
+/* Stores the details gathered for any of the paths still listed, so that
+ * later sorts use them */
+void imv_navigator_apply_keys(struct imv_navigator *nav,
+                              const struct imv_sort_keys *keys);
+
+/* Cleans up an imv_sort_keys instance */
+void imv_sort_keys_free(struct imv_sort_keys *keys);
+
 /* Returns a read-only reference to the current path. The pointer is only
  * guaranteed to be valid until the next call to an imv_navigator method. */
 const char *imv_navigator_selection(struct imv_navigator *nav);
@@ -24,6 +108,10 @@ const char *imv_navigator_selection(struct imv_navigator *nav);
 /* Returns the index of the currently selected path */
 size_t imv_navigator_index(struct imv_navigator *nav);
 
+/* Returns the direction the selection last moved in, -1 for backwards or 1
+ * for forwards */
+int imv_navigator_last_direction(struct imv_navigator *nav);
+
 /* Change the currently selected path. dir = -1 for previous, 1 for next. */
 void imv_navigator_select_rel(struct imv_navigator *nav, ssize_t dir);
 
@@ -48,6 +136,16 @@ ssize_t imv_navigator_find_path(struct imv_navigator *nav, const char *path);
  * changed since last called */
 int imv_navigator_poll_changed(struct imv_navigator *nav);
 
+/* Returns an fd that becomes readable when the currently selected file may
+ * have changed, or -1 if there isn't one */
+int imv_navigator_watch_fd(struct imv_navigator *nav);
+
+/* Returns 1 if changes to the currently selected file will make the watch fd
+ * readable, or 0 if imv_navigator_poll_changed has to be called periodically
+ * to notice them, such as when there's no watch fd or the file's directory
+ * couldn't be watched */
+int imv_navigator_watching(struct imv_navigator *nav);
+
 /* Check whether navigator wrapped around paths list */
 int imv_navigator_wrapped(struct imv_navigator *nav);
 
@@ -55,7 +153,7 @@ int imv_navigator_wrapped(struct imv_navigator *nav);
 size_t imv_navigator_length(struct imv_navigator *nav);
 
 /* Return a path for a given index */
-char *imv_navigator_at(struct imv_navigator *nav, size_t index);
+const char *imv_navigator_at(struct imv_navigator *nav, size_t index);
 
 
 #endif
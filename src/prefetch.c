@@ -0,0 +1,400 @@
+#include "prefetch.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "image.h"
+#include "list.h"
+#include "log.h"
+#include "source.h"
+#include "thread_pool.h"
+
+enum entry_state {
+  ENTRY_QUEUED,
+  ENTRY_LOADING,
+  ENTRY_READY,
+  ENTRY_FAILED,
+};
+
+struct entry {
+  struct imv_prefetch *prefetch;
+  char *path;
+  enum entry_state state;
+
+  /* position in the most recent update, lower is more important */
+  size_t rank;
+
+  /* the user is waiting on this entry, so it must not be discarded */
+  bool wanted;
+
+  /* removed from prefetch->entries, the last job referencing it frees it */
+  bool dropped;
+
+  /* number of jobs on the worker pool that reference this entry */
+  int jobs;
+
+  /* the source being decoded while state is ENTRY_LOADING, if opened yet */
+  struct imv_source *loading;
+
+  /* the result of loading, only set once state is ENTRY_READY */
+  struct imv_source *source;
+  struct imv_image *image;
+  int frametime;
+  size_t bytes;
+};
+
+struct imv_prefetch {
+  struct imv_thread_pool *pool;
+  imv_prefetch_open open;
+  imv_prefetch_ready ready;
+  void *data;
+
+  /* protects everything below, as well as the entries themselves */
+  pthread_mutex_t lock;
+
+  /* signalled whenever jobs drops to zero */
+  pthread_cond_t idle;
+
+  struct list *entries;
+  size_t budget;
+
+  /* total held by entries in the ENTRY_READY state */
+  size_t bytes;
+
+  /* jobs still referencing any entry, including dropped ones */
+  int jobs;
+};
+
+/* Default budget, enough for a handful of large photos */
+#define DEFAULT_BUDGET ((size_t)512 * 1024 * 1024)
+
+struct imv_prefetch *imv_prefetch_create(struct imv_thread_pool *pool,
+    imv_prefetch_open open, imv_prefetch_ready ready, void *data)
+{
+  struct imv_prefetch *prefetch = calloc(1, sizeof *prefetch);
+  prefetch->pool = pool;
+  prefetch->open = open;
+  prefetch->ready = ready;
+  prefetch->data = data;
+  prefetch->entries = list_create();
+  prefetch->budget = DEFAULT_BUDGET;
+  pthread_mutex_init(&prefetch->lock, NULL);
+  pthread_cond_init(&prefetch->idle, NULL);
+  return prefetch;
+}
+
+static void destroy_entry(struct entry *entry)
+{
+  if (entry->source) {
+    imv_source_async_free(entry->source);
+  }
+  imv_image_free(entry->image);
+  free(entry->path);
+  free(entry);
+}
+
+/* Must be called with prefetch->lock held */
+static void drop_entry(struct imv_prefetch *prefetch, size_t index)
+{
+  struct entry *entry = prefetch->entries->items[index];
+  list_remove(prefetch->entries, index);
+
+  if (entry->state == ENTRY_READY) {
+    prefetch->bytes -= entry->bytes;
+  }
+
+  entry->dropped = true;
+  if (entry->loading) {
+    /* stop wasting a worker on it */
+    imv_source_cancel(entry->loading);
+  }
+  if (entry->jobs == 0) {
+    destroy_entry(entry);
+  }
+}
+
+/* Discard the least important images until we're back within budget. Must be
+ * called with prefetch->lock held. */
+static void enforce_budget(struct imv_prefetch *prefetch)
+{
+  while (prefetch->bytes > prefetch->budget) {
+    size_t victim = 0;
+    bool found = false;
+    for (size_t i = 0; i < prefetch->entries->len; ++i) {
+      struct entry *entry = prefetch->entries->items[i];
+      if (entry->state != ENTRY_READY || entry->wanted) {
+        continue;
+      }
+      if (!found || entry->rank > ((struct entry *)prefetch->entries->items[victim])->rank) {
+        victim = i;
+        found = true;
+      }
+    }
+
+    if (!found) {
+      break;
+    }
+    drop_entry(prefetch, victim);
+  }
+}
+
+void imv_prefetch_free(struct imv_prefetch *prefetch)
+{
+  if (!prefetch) {
+    return;
+  }
+
+  pthread_mutex_lock(&prefetch->lock);
+  while (prefetch->entries->len > 0) {
+    drop_entry(prefetch, prefetch->entries->len - 1);
+  }
+  /* queued jobs for dropped entries return straight away */
+  while (prefetch->jobs > 0) {
+    pthread_cond_wait(&prefetch->idle, &prefetch->lock);
+  }
+  pthread_mutex_unlock(&prefetch->lock);
+
+  pthread_cond_destroy(&prefetch->idle);
+  pthread_mutex_destroy(&prefetch->lock);
+  list_free(prefetch->entries);
+  free(prefetch);
+}
+
+void imv_prefetch_set_budget(struct imv_prefetch *prefetch, size_t bytes)
+{
+  pthread_mutex_lock(&prefetch->lock);
+  prefetch->budget = bytes;
+  enforce_budget(prefetch);
+  pthread_mutex_unlock(&prefetch->lock);
+}
+
+struct load_result {
+  struct imv_image *image;
+  int frametime;
+};
+
+static void store_result(struct imv_source_message *msg)
+{
+  struct load_result *result = msg->user_data;
+  if (msg->partial) {
+    /* nobody's looking yet, so only the finished image matters */
+    imv_image_free(msg->image);
+    return;
+  }
+  result->image = msg->image;
+  result->frametime = msg->frametime;
+}
+
+static void prefetch_job(void *data);
+
+/* Must be called with prefetch->lock held */
+static void queue_entry(struct imv_prefetch *prefetch, struct entry *entry,
+    enum imv_thread_pool_priority priority)
+{
+  entry->jobs++;
+  prefetch->jobs++;
+  imv_thread_pool_submit(prefetch->pool, priority, &prefetch_job, entry);
+}
+
+static void prefetch_job(void *data)
+{
+  struct entry *entry = data;
+  struct imv_prefetch *prefetch = entry->prefetch;
+
+  /* The same entry may have been queued twice if it was bumped to high
+   * priority, so only the first job to get here does the work.
+   */
+  pthread_mutex_lock(&prefetch->lock);
+  const bool claimed = entry->state == ENTRY_QUEUED && !entry->dropped;
+  if (claimed) {
+    entry->state = ENTRY_LOADING;
+  }
+  pthread_mutex_unlock(&prefetch->lock);
+
+  struct imv_source *source = NULL;
+  struct load_result result = {0};
+  if (claimed) {
+    source = prefetch->open(entry->path, prefetch->data);
+    if (source) {
+      imv_source_set_callback(source, &store_result, &result);
+
+      /* Publish the source so that it can be cancelled if dropped, and only
+       * give way to other work if the user isn't waiting on it */
+      pthread_mutex_lock(&prefetch->lock);
+      entry->loading = source;
+      imv_source_set_preemptible(source, !entry->wanted);
+      if (entry->dropped) {
+        imv_source_cancel(source);
+      }
+      pthread_mutex_unlock(&prefetch->lock);
+
+      imv_source_load_first_frame(source);
+    }
+  }
+  const bool preempted = source && !result.image && imv_source_preempted(source);
+
+  imv_prefetch_ready ready = prefetch->ready;
+  void *ready_data = prefetch->data;
+  bool notify = false;
+
+  pthread_mutex_lock(&prefetch->lock);
+  entry->loading = NULL;
+  if (claimed && !entry->dropped) {
+    if (result.image) {
+      entry->state = ENTRY_READY;
+      entry->source = source;
+      entry->image = result.image;
+      entry->frametime = result.frametime;
+      entry->bytes = imv_image_memory_usage(result.image);
+      prefetch->bytes += entry->bytes;
+      source = NULL;
+      result.image = NULL;
+      notify = entry->wanted;
+    } else if (preempted) {
+      /* gave the worker up to something more important, go again later */
+      entry->state = ENTRY_QUEUED;
+      queue_entry(prefetch, entry,
+          entry->wanted ? IMV_PRIORITY_HIGH : IMV_PRIORITY_LOW);
+    } else {
+      entry->state = ENTRY_FAILED;
+      notify = entry->wanted;
+    }
+    enforce_budget(prefetch);
+  }
+
+  const bool destroy = --entry->jobs == 0 && entry->dropped;
+  if (--prefetch->jobs == 0) {
+    pthread_cond_broadcast(&prefetch->idle);
+  }
+  pthread_mutex_unlock(&prefetch->lock);
+
+  /* whatever wasn't handed over to the entry is no longer wanted */
+  if (source) {
+    imv_source_free(source);
+  }
+  imv_image_free(result.image);
+
+  if (destroy) {
+    destroy_entry(entry);
+  }
+
+  if (notify) {
+    ready(ready_data);
+  }
+}
+
+static ssize_t find_entry(struct imv_prefetch *prefetch, const char *path)
+{
+  for (size_t i = 0; i < prefetch->entries->len; ++i) {
+    struct entry *entry = prefetch->entries->items[i];
+    if (!strcmp(entry->path, path)) {
+      return (ssize_t)i;
+    }
+  }
+  return -1;
+}
+
+void imv_prefetch_update(struct imv_prefetch *prefetch, const char **paths,
+    size_t count)
+{
+  pthread_mutex_lock(&prefetch->lock);
+
+  /* Re-rank what we already have, dropping anything no longer wanted */
+  for (size_t i = prefetch->entries->len; i > 0; --i) {
+    struct entry *entry = prefetch->entries->items[i - 1];
+    bool keep = entry->wanted;
+    for (size_t j = 0; j < count; ++j) {
+      if (!strcmp(entry->path, paths[j])) {
+        entry->rank = j;
+        keep = true;
+        break;
+      }
+    }
+    if (!keep) {
+      drop_entry(prefetch, i - 1);
+    }
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    /* Nothing further down the list would survive the budget anyway */
+    if (prefetch->bytes >= prefetch->budget) {
+      break;
+    }
+
+    if (find_entry(prefetch, paths[i]) != -1) {
+      continue;
+    }
+
+    struct entry *entry = calloc(1, sizeof *entry);
+    entry->prefetch = prefetch;
+    entry->path = strdup(paths[i]);
+    entry->rank = i;
+    entry->state = ENTRY_QUEUED;
+    list_append(prefetch->entries, entry);
+    queue_entry(prefetch, entry, IMV_PRIORITY_LOW);
+  }
+
+  pthread_mutex_unlock(&prefetch->lock);
+}
+
+enum imv_prefetch_result imv_prefetch_take(struct imv_prefetch *prefetch,
+    const char *path, struct imv_source **source, struct imv_image **image,
+    int *frametime)
+{
+  enum imv_prefetch_result ret = PREFETCH_MISSING;
+
+  pthread_mutex_lock(&prefetch->lock);
+
+  /* The user has moved on from anything they were previously waiting for */
+  for (size_t i = prefetch->entries->len; i > 0; --i) {
+    struct entry *entry = prefetch->entries->items[i - 1];
+    if (entry->wanted && strcmp(entry->path, path)) {
+      drop_entry(prefetch, i - 1);
+    }
+  }
+
+  ssize_t index = find_entry(prefetch, path);
+  if (index != -1) {
+    struct entry *entry = prefetch->entries->items[index];
+    switch (entry->state) {
+      case ENTRY_READY:
+        *source = entry->source;
+        *image = entry->image;
+        *frametime = entry->frametime;
+        entry->source = NULL;
+        entry->image = NULL;
+        drop_entry(prefetch, index);
+        ret = PREFETCH_READY;
+        break;
+      case ENTRY_FAILED:
+        drop_entry(prefetch, index);
+        break;
+      case ENTRY_QUEUED:
+        if (!entry->wanted) {
+          /* jump the queue, whichever job runs first does the load */
+          queue_entry(prefetch, entry, IMV_PRIORITY_HIGH);
+        }
+        /* fall through */
+      case ENTRY_LOADING:
+        if (entry->loading) {
+          /* it's no longer speculative */
+          imv_source_set_preemptible(entry->loading, false);
+        }
+        entry->wanted = true;
+        ret = PREFETCH_PENDING;
+        break;
+    }
+  }
+
+  pthread_mutex_unlock(&prefetch->lock);
+
+  if (ret == PREFETCH_READY) {
+    imv_log(IMV_DEBUG, "prefetch: hit for %s\n", path);
+  }
+  return ret;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
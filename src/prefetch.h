@@ -0,0 +1,66 @@
+#ifndef IMV_PREFETCH_H
+#define IMV_PREFETCH_H
+
+#include <stddef.h>
+
+/* Speculatively opens images the user is likely to look at next and decodes
+ * their first frame in the background, so that they can be displayed as soon
+ * as they're selected. Prefetching runs at low priority on the worker pool so
+ * it never holds up the image the user is actually waiting for.
+ */
+struct imv_prefetch;
+
+struct imv_image;
+struct imv_source;
+struct imv_thread_pool;
+
+/* Opens a path, returning NULL if it can't be loaded. Called from worker
+ * threads. */
+typedef struct imv_source *(*imv_prefetch_open)(const char *path, void *data);
+
+/* Called from a worker thread when a path that imv_prefetch_take reported as
+ * PREFETCH_PENDING has finished loading. */
+typedef void (*imv_prefetch_ready)(void *data);
+
+enum imv_prefetch_result {
+  /* The path was prefetched, ownership of its source and image is passed on */
+  PREFETCH_READY,
+
+  /* The path is still being loaded. It has been bumped to high priority and
+   * the ready callback will be called once it's done. */
+  PREFETCH_PENDING,
+
+  /* The path wasn't prefetched, or failed to load */
+  PREFETCH_MISSING,
+};
+
+/* Creates an instance of imv_prefetch that queues its work on the given pool */
+struct imv_prefetch *imv_prefetch_create(struct imv_thread_pool *pool,
+    imv_prefetch_open open, imv_prefetch_ready ready, void *data);
+
+/* Cleans up an imv_prefetch instance, waiting for any loads in progress */
+void imv_prefetch_free(struct imv_prefetch *prefetch);
+
+/* Set the maximum number of bytes prefetched images may hold between them.
+ * Once it's exceeded the least important images are discarded. */
+void imv_prefetch_set_budget(struct imv_prefetch *prefetch, size_t bytes);
+
+/* Replace the set of paths to be prefetched, ordered most important first.
+ * Anything previously prefetched that isn't in the list is discarded. An
+ * internal copy of each path is made.
+ */
+void imv_prefetch_update(struct imv_prefetch *prefetch, const char **paths,
+    size_t count);
+
+/* Claim a prefetched path. On PREFETCH_READY, source, image and frametime are
+ * set, and the caller becomes responsible for the source and image. Any other
+ * path still marked as pending is discarded.
+ */
+enum imv_prefetch_result imv_prefetch_take(struct imv_prefetch *prefetch,
+    const char *path, struct imv_source **source, struct imv_image **image,
+    int *frametime);
+
+#endif
+
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,117 @@
+#include "resolve.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Paths are usually grouped by directory, so only a handful of directories
+ * need to be remembered at once for most lookups to hit */
+#define CACHE_SIZE 64
+
+struct cached_dir {
+  /* the directory as it appeared in a path, or NULL if the slot's unused */
+  char *dir;
+  size_t len;
+
+  /* its canonical form, or NULL if it couldn't be resolved */
+  char *real;
+};
+
+struct imv_resolver {
+  struct cached_dir cache[CACHE_SIZE];
+};
+
+static size_t hash_dir(const char *dir, size_t len)
+{
+  /* FNV-1a */
+  uint64_t hash = 0xcbf29ce484222325u;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (unsigned char)dir[i];
+    hash *= 0x100000001b3u;
+  }
+  return (size_t)(hash % CACHE_SIZE);
+}
+
+/* Returns the canonical form of the first len bytes of a path, which name a
+ * directory, or NULL if it can't be resolved */
+static const char *resolve_dir(struct imv_resolver *resolver, const char *dir,
+    size_t len)
+{
+  struct cached_dir *cached = &resolver->cache[hash_dir(dir, len)];
+  if (cached->dir && cached->len == len && !memcmp(cached->dir, dir, len)) {
+    return cached->real;
+  }
+
+  free(cached->dir);
+  free(cached->real);
+  cached->dir = malloc(len + 1);
+  memcpy(cached->dir, dir, len);
+  cached->dir[len] = 0;
+  cached->len = len;
+  cached->real = realpath(cached->dir, NULL);
+  return cached->real;
+}
+
+struct imv_resolver *imv_resolver_create(void)
+{
+  return calloc(1, sizeof(struct imv_resolver));
+}
+
+void imv_resolver_free(struct imv_resolver *resolver)
+{
+  for (size_t i = 0; i < CACHE_SIZE; ++i) {
+    free(resolver->cache[i].dir);
+    free(resolver->cache[i].real);
+  }
+  free(resolver);
+}
+
+char *imv_resolve_path(struct imv_resolver *resolver, const char *path,
+    bool *is_dir)
+{
+  struct stat info;
+  if (lstat(path, &info)) {
+    return NULL;
+  }
+
+  const char *slash = strrchr(path, '/');
+  const char *name = slash ? slash + 1 : path;
+
+  /* a symlink's target could be anywhere, and the last component could
+   * itself move up or down the tree, so only the whole path will do */
+  if (S_ISLNK(info.st_mode) || !*name || !strcmp(name, ".") ||
+      !strcmp(name, "..")) {
+    if (is_dir) {
+      *is_dir = !stat(path, &info) && S_ISDIR(info.st_mode);
+    }
+    return realpath(path, NULL);
+  }
+
+  if (is_dir) {
+    *is_dir = S_ISDIR(info.st_mode);
+  }
+
+  const char *dir;
+  if (!slash) {
+    dir = resolve_dir(resolver, ".", 1);
+  } else if (slash == path) {
+    dir = resolve_dir(resolver, "/", 1);
+  } else {
+    dir = resolve_dir(resolver, path, (size_t)(slash - path));
+  }
+  if (!dir) {
+    return NULL;
+  }
+
+  /* the root is the only canonical path that ends with a separator */
+  const size_t dir_len = strcmp(dir, "/") ? strlen(dir) : 0;
+  const size_t name_len = strlen(name);
+  char *real = malloc(dir_len + name_len + 2);
+  memcpy(real, dir, dir_len);
+  real[dir_len] = '/';
+  memcpy(real + dir_len + 1, name, name_len + 1);
+  return real;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
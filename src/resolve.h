@@ -0,0 +1,29 @@
+#ifndef IMV_RESOLVE_H
+#define IMV_RESOLVE_H
+
+#include <stdbool.h>
+
+/* Turns paths into canonical absolute ones, as realpath(3) does, but
+ * remembers the directories it has resolved along the way. realpath looks at
+ * every component of a path, whereas a path in a directory seen recently only
+ * costs a single lstat(2). Directories are assumed not to be moved or replaced
+ * while in use, so an instance should only be kept for a single batch of
+ * paths. Instances aren't thread safe.
+ */
+struct imv_resolver;
+
+/* Creates an instance of imv_resolver */
+struct imv_resolver *imv_resolver_create(void);
+
+/* Cleans up an imv_resolver instance */
+void imv_resolver_free(struct imv_resolver *resolver);
+
+/* Returns the canonical form of path, which the caller must free, or NULL if
+ * it doesn't exist or can't be looked at. If is_dir isn't NULL, it's set to
+ * whether the path is a directory. */
+char *imv_resolve_path(struct imv_resolver *resolver, const char *path,
+    bool *is_dir);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -1,8 +1,18 @@
 #include "source.h"
 #include "source_private.h"
 
+#include "image.h"
+#include "thread_pool.h"
+
+#include <math.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <time.h>
+
+/* Minimum time between partial images being sent while loading, in seconds */
+#define PROGRESS_INTERVAL 0.05
 
 struct imv_source {
   /* pointers to implementation's functions */
@@ -11,6 +21,13 @@ struct imv_source {
   /* pointer to implementation data */
   void *private;
 
+  /* passed to the implementation's load functions */
+  struct imv_source_request request;
+
+  /* when the load in progress last reported how far it had got, only
+   * accessed while busy is held */
+  double progress_time;
+
   /* Attempted to be locked by load_first_frame or load_next_frame.
    * If the mutex can't be locked, the call is aborted.
    * Used to prevent the source from having multiple worker threads at once.
@@ -18,66 +35,266 @@ struct imv_source {
    */
   pthread_mutex_t busy;
 
+  /* Protects pending_jobs, closing and free_when_idle */
+  pthread_mutex_t jobs_lock;
+
+  /* Signalled whenever pending_jobs drops to zero */
+  pthread_cond_t jobs_done;
+
+  /* Number of jobs on the worker pool that still reference this source */
+  int pending_jobs;
+
+  /* Once set, no further jobs may be queued for this source */
+  bool closing;
+
+  /* Set by imv_source_async_free, the last job to finish cleans up */
+  bool free_when_idle;
+
   /* callback function */
   imv_source_callback callback;
   /* callback data */
   void *callback_data;
+
+  /* called once the implementation has been freed, to release whatever
+   * memory it was reading from */
+  imv_source_release release;
+  void *release_data;
+
+  /* called on cancellation, to wake a load that's blocked */
+  imv_source_wake wake;
+  void *wake_data;
+
+  /* the version of the file opened, if has_file_id is set */
+  struct imv_file_id file_id;
+  bool has_file_id;
 };
 
+/* Pool that async work is queued on. If unset, work runs synchronously. */
+static struct imv_thread_pool *worker_pool;
+
+void imv_source_set_thread_pool(struct imv_thread_pool *pool)
+{
+  worker_pool = pool;
+}
+
 struct imv_source *imv_source_create(const struct imv_source_vtable *vtable, void *private)
 {
   struct imv_source *source = calloc(1, sizeof *source);
   source->vtable = vtable;
   source->private = private;
   pthread_mutex_init(&source->busy, NULL);
+  pthread_mutex_init(&source->jobs_lock, NULL);
+  pthread_cond_init(&source->jobs_done, NULL);
   return source;
 }
 
-static void *free_thread(void *src)
+static void destroy_source(struct imv_source *src)
+{
+  pthread_mutex_lock(&src->busy);
+  src->vtable->free(src->private);
+  pthread_mutex_unlock(&src->busy);
+  if (src->release) {
+    src->release(src->release_data);
+  }
+  pthread_mutex_destroy(&src->busy);
+  pthread_cond_destroy(&src->jobs_done);
+  pthread_mutex_destroy(&src->jobs_lock);
+  free(src);
+}
+
+static void finish_job(struct imv_source *src)
+{
+  pthread_mutex_lock(&src->jobs_lock);
+  const bool idle = --src->pending_jobs == 0;
+  const bool cleanup = idle && src->free_when_idle;
+  if (idle) {
+    pthread_cond_broadcast(&src->jobs_done);
+  }
+  pthread_mutex_unlock(&src->jobs_lock);
+
+  if (cleanup) {
+    destroy_source(src);
+  }
+}
+
+static void queue_job(struct imv_source *src, imv_thread_pool_job job)
+{
+  pthread_mutex_lock(&src->jobs_lock);
+  if (src->closing) {
+    pthread_mutex_unlock(&src->jobs_lock);
+    return;
+  }
+  src->pending_jobs++;
+  pthread_mutex_unlock(&src->jobs_lock);
+
+  if (worker_pool) {
+    imv_thread_pool_submit(worker_pool, IMV_PRIORITY_HIGH, job, src);
+  } else {
+    job(src);
+  }
+}
+
+static void free_job(void *src)
+{
+  destroy_source(src);
+}
+
+static bool request_preempted(const struct imv_source_request *req)
+{
+  return __atomic_load_n(&req->preemptible, __ATOMIC_RELAXED)
+      && imv_thread_pool_preempted();
+}
+
+bool imv_source_request_cancelled(const struct imv_source_request *req)
+{
+  return __atomic_load_n(&req->cancelled, __ATOMIC_RELAXED)
+      || request_preempted(req);
+}
+
+bool imv_source_request_scale_ok(const struct imv_source_request *req,
+    int width, int height, int scaled_width, int scaled_height)
+{
+  if (scaled_width >= width && scaled_height >= height) {
+    return true;
+  }
+
+  const int target_width = __atomic_load_n(&req->target_width, __ATOMIC_RELAXED);
+  const int target_height = __atomic_load_n(&req->target_height, __ATOMIC_RELAXED);
+  if (target_width <= 0 || target_height <= 0 || width <= 0 || height <= 0) {
+    return false;
+  }
+
+  /* the scale the image will be shown at when fit to the target */
+  double scale = (double)target_width / width;
+  if ((double)target_height / height < scale) {
+    scale = (double)target_height / height;
+  }
+
+  return scaled_width >= ceil(width * scale) && scaled_height >= ceil(height * scale);
+}
+
+static double cur_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
+}
+
+void imv_source_request_progress(const struct imv_source_request *req,
+    struct imv_image *image, int first_row, int last_row)
+{
+  /* Only ever called from within a load, while the source is busy */
+  struct imv_source *src = (struct imv_source *)
+      ((char *)req - offsetof(struct imv_source, request));
+
+  const double now = cur_time();
+  if (now - src->progress_time < PROGRESS_INTERVAL
+      || imv_source_request_cancelled(req)) {
+    return;
+  }
+  src->progress_time = now;
+
+  struct imv_source_message msg = {
+    .source = src,
+    .user_data = src->callback_data,
+    .image = imv_image_ref(image),
+    .partial = true,
+    .first_row = first_row,
+    .last_row = last_row,
+  };
+  src->callback(&msg);
+}
+
+void imv_source_set_target_size(struct imv_source *src, int width, int height)
+{
+  __atomic_store_n(&src->request.target_width, width, __ATOMIC_RELAXED);
+  __atomic_store_n(&src->request.target_height, height, __ATOMIC_RELAXED);
+}
+
+void imv_source_cancel(struct imv_source *src)
+{
+  __atomic_store_n(&src->request.cancelled, 1, __ATOMIC_RELAXED);
+  if (src->wake) {
+    src->wake(src->wake_data);
+  }
+}
+
+void imv_source_set_file_id(struct imv_source *src, const struct imv_file_id *id)
+{
+  src->file_id = *id;
+  src->has_file_id = true;
+}
+
+const struct imv_file_id *imv_source_file_id(const struct imv_source *src)
+{
+  return src->has_file_id ? &src->file_id : NULL;
+}
+
+void imv_source_set_preemptible(struct imv_source *src, bool preemptible)
 {
-  imv_source_free(src);
-  return NULL;
+  __atomic_store_n(&src->request.preemptible, preemptible, __ATOMIC_RELAXED);
+}
+
+bool imv_source_preempted(struct imv_source *src)
+{
+  return request_preempted(&src->request);
 }
 
 void imv_source_async_free(struct imv_source *src)
 {
-  pthread_t thread;
-  pthread_create(&thread, NULL, free_thread, src);
-  pthread_detach(thread);
+  /* Nobody is going to see the result of any work in progress */
+  imv_source_cancel(src);
+
+  pthread_mutex_lock(&src->jobs_lock);
+  src->closing = true;
+  src->free_when_idle = true;
+  const bool idle = src->pending_jobs == 0;
+  pthread_mutex_unlock(&src->jobs_lock);
+
+  /* If there's work in flight, whichever job finishes last does the cleanup */
+  if (!idle) {
+    return;
+  }
+
+  if (worker_pool) {
+    imv_thread_pool_submit_cleanup(worker_pool, free_job, src);
+  } else {
+    destroy_source(src);
+  }
 }
 
-static void *first_frame_thread(void *src)
+static void first_frame_job(void *src)
 {
   imv_source_load_first_frame(src);
-  return NULL;
+  finish_job(src);
 }
 
 void imv_source_async_load_first_frame(struct imv_source *src)
 {
-  pthread_t thread;
-  pthread_create(&thread, NULL, first_frame_thread, src);
-  pthread_detach(thread);
+  queue_job(src, first_frame_job);
 }
 
-static void *next_frame_thread(void *src)
+static void next_frame_job(void *src)
 {
   imv_source_load_next_frame(src);
-  return NULL;
+  finish_job(src);
 }
+
 void imv_source_async_load_next_frame(struct imv_source *src)
 {
-  pthread_t thread;
-  pthread_create(&thread, NULL, next_frame_thread, src);
-  pthread_detach(thread);
+  queue_job(src, next_frame_job);
 }
 
 void imv_source_free(struct imv_source *src)
 {
-  pthread_mutex_lock(&src->busy);
-  src->vtable->free(src->private);
-  pthread_mutex_unlock(&src->busy);
-  pthread_mutex_destroy(&src->busy);
-  free(src);
+  pthread_mutex_lock(&src->jobs_lock);
+  src->closing = true;
+  while (src->pending_jobs > 0) {
+    pthread_cond_wait(&src->jobs_done, &src->jobs_lock);
+  }
+  pthread_mutex_unlock(&src->jobs_lock);
+
+  destroy_source(src);
 }
 
 void imv_source_load_first_frame(struct imv_source *src)
@@ -90,15 +307,27 @@ void imv_source_load_first_frame(struct imv_source *src)
     return;
   }
 
+  if (imv_source_request_cancelled(&src->request)) {
+    pthread_mutex_unlock(&src->busy);
+    return;
+  }
+
   struct imv_source_message msg = {
     .source = src,
     .user_data = src->callback_data
   };
+  src->progress_time = cur_time();
 
-  src->vtable->load_first_frame(src->private, &msg.image, &msg.frametime);
+  src->vtable->load_first_frame(src->private, &src->request, &msg.image,
+      &msg.frametime);
 
   pthread_mutex_unlock(&src->busy);
 
+  if (imv_source_request_cancelled(&src->request)) {
+    imv_image_free(msg.image);
+    return;
+  }
+
   src->callback(&msg);
 }
 
@@ -112,15 +341,27 @@ void imv_source_load_next_frame(struct imv_source *src)
     return;
   }
 
+  if (imv_source_request_cancelled(&src->request)) {
+    pthread_mutex_unlock(&src->busy);
+    return;
+  }
+
   struct imv_source_message msg = {
     .source = src,
     .user_data = src->callback_data
   };
+  src->progress_time = cur_time();
 
-  src->vtable->load_next_frame(src->private, &msg.image, &msg.frametime);
+  src->vtable->load_next_frame(src->private, &src->request, &msg.image,
+      &msg.frametime);
 
   pthread_mutex_unlock(&src->busy);
 
+  if (imv_source_request_cancelled(&src->request)) {
+    imv_image_free(msg.image);
+    return;
+  }
+
   src->callback(&msg);
 }
 
@@ -130,3 +371,17 @@ void imv_source_set_callback(struct imv_source *src, imv_source_callback callbac
   src->callback = callback;
   src->callback_data = data;
 }
+
+void imv_source_set_wake(struct imv_source *src, imv_source_wake wake,
+    void *data)
+{
+  src->wake = wake;
+  src->wake_data = data;
+}
+
+void imv_source_set_release(struct imv_source *src, imv_source_release release,
+    void *data)
+{
+  src->release = release;
+  src->release_data = data;
+}
@@ -1,6 +1,10 @@
 #ifndef IMV_SOURCE_H
 #define IMV_SOURCE_H
 
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
 /* While imv_image represents a single frame of an image, be it a bitmap or
  * vector image, imv_source represents an open handle to an image file, which
  * can emit one or more imv_images.
@@ -9,27 +13,78 @@ struct imv_source;
 
 struct imv_source_message;
 struct imv_image;
+struct imv_thread_pool;
+
+/* Identifies a version of a file. If any of it differs, the file has been
+ * replaced or written to since. */
+struct imv_file_id {
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+};
+
+/* Sets the worker pool that the async functions below queue their work on. If
+ * no pool is set, the async functions run synchronously instead. */
+void imv_source_set_thread_pool(struct imv_thread_pool *pool);
 
 /* Clean up a source. Blocks if the source is active in the background. Async
- * version does not block, performing cleanup in another thread */
+ * version does not block, cancelling any work in progress and performing
+ * cleanup on the worker pool once it has stopped */
 void imv_source_async_free(struct imv_source *src);
 void imv_source_free(struct imv_source *src);
 
+/* Ask any load in progress or queued for the source to stop as soon as
+ * possible. Cancelled loads don't send a message. This can't be undone. */
+void imv_source_cancel(struct imv_source *src);
+
+/* Records the version of the file the source was opened from. It should be
+ * taken before the file's read, so that nothing decoded from the source is
+ * older than it claims. */
+void imv_source_set_file_id(struct imv_source *src, const struct imv_file_id *id);
+
+/* Returns the version of the file the source was opened from, or NULL if it's
+ * not known, such as for stdin */
+const struct imv_file_id *imv_source_file_id(const struct imv_source *src);
+
+/* Mark the source's loads as speculative. While set, a load run from a low
+ * priority job is abandoned as if cancelled, but without being latched, if the
+ * job is asked to give way to something more important. Reopen the source to
+ * try again, as a load may have been interrupted part way through. */
+void imv_source_set_preemptible(struct imv_source *src, bool preemptible);
+
+/* Returns true if the last load was abandoned to give way to other work. Only
+ * meaningful on the thread that ran the load. */
+bool imv_source_preempted(struct imv_source *src);
+
+/* Hint at the size the image will be displayed at, so that the next load may
+ * decode at a reduced resolution if it's much larger. The image still reports
+ * its full size. Pass 0 for both to get the full resolution. */
+void imv_source_set_target_size(struct imv_source *src, int width, int height);
+
 /* Load the first frame. Silently aborts if source is already loading. Async
- * version performs loading in background. */
+ * version queues the load on the worker pool. */
 void imv_source_async_load_first_frame(struct imv_source *src);
 void imv_source_load_first_frame(struct imv_source *src);
 
 /* Load the next frame. Silently aborts if source is already loading. Async
- * version performs loading in background. */
+ * version queues the load on the worker pool. */
 void imv_source_async_load_next_frame(struct imv_source *src);
 void imv_source_load_next_frame(struct imv_source *src);
 
 typedef void (*imv_source_callback)(struct imv_source_message *message);
 
-/* Sets the callback function to be called when frame loading completes */
+/* Sets the callback function to be called when frame loading completes, or
+ * with partial results while it's in progress. It may be called from any
+ * thread. */
 void imv_source_set_callback(struct imv_source *src, imv_source_callback callback, void *data);
 
+typedef void (*imv_source_release)(void *data);
+
+/* Sets a function to be called once the source has been freed, for releasing
+ * the memory it was opened from. Sources opened from memory may keep reading
+ * it until then. */
+void imv_source_set_release(struct imv_source *src, imv_source_release release, void *data);
+
 struct imv_source_message {
   /* Pointer to sender of message */
   struct imv_source *source;
@@ -42,6 +97,14 @@ struct imv_source_message {
 
   /* If an animated gif, the frame's duration in milliseconds, else 0 */
   int frametime;
+
+  /* If true, the image is still being decoded and only rows first_row up to
+   * (but not including) last_row are ready to be shown. Later messages carry
+   * the same image, until a final one that isn't partial, or one with no
+   * image if decoding fails. */
+  bool partial;
+  int first_row;
+  int last_row;
 };
 
 #endif
@@ -1,9 +1,52 @@
 #ifndef IMV_SOURCE_PRIVATE_H
 #define IMV_SOURCE_PRIVATE_H
 
+#include <stdbool.h>
+
 struct imv_image;
 struct imv_source;
 
+/* Describes the load a source has been asked to perform. Passed to every call
+ * of a source's load functions.
+ */
+struct imv_source_request {
+  /* Raised when nobody wants the result anymore. Long-running loads should
+   * check it with imv_source_request_cancelled regularly (e.g. between rows or
+   * strips) and give up early if it's set. Only ever read atomically.
+   */
+  int cancelled;
+
+  /* If non-zero, the image will be scaled to fit within this many pixels.
+   * Backends that can cheaply decode at reduced resolution may do so, as long
+   * as imv_source_request_scale_ok agrees, and must then create the image with
+   * imv_image_create_from_scaled_bitmap. Only ever read atomically.
+   */
+  int target_width;
+  int target_height;
+
+  /* Set for speculative loads, which are treated as cancelled once the worker
+   * running them is asked to give way. Only ever read atomically.
+   */
+  int preemptible;
+};
+
+/* Returns true if the load should be abandoned */
+bool imv_source_request_cancelled(const struct imv_source_request *req);
+
+/* Returns true if a width x height image decoded at scaled_width x
+ * scaled_height would still have enough pixels to be displayed at the
+ * requested size. Always false for a reduced size without a target. */
+bool imv_source_request_scale_ok(const struct imv_source_request *req,
+    int width, int height, int scaled_width, int scaled_height);
+
+/* Lets a long-running load show the part of the image decoded so far: rows
+ * first_row up to (but not including) last_row, which mustn't be written to
+ * again. The image must be the one the load will eventually return. Reports
+ * are rate limited, so it's cheap enough to call after every row.
+ */
+void imv_source_request_progress(const struct imv_source_request *req,
+    struct imv_image *image, int first_row, int last_row);
+
 /* This is the interface a source needs to implement to function correctly.
  * Backends act as a "factory" for sources by calling imv_source_create
  * with a pointer to a static vtable, and a pointer to that implementation's
@@ -13,15 +56,18 @@ struct imv_source;
 struct imv_source_vtable {
 
   /* Loads the first frame, if successful puts output in image and duration
-   * (in milliseconds) in frametime. If unsuccessful, image shall be NULL. A
-   * still image should use a frametime of 0.
+   * (in milliseconds) in frametime. If unsuccessful or cancelled, image shall
+   * be NULL. A still image should use a frametime of 0.
    */
-  void (*load_first_frame)(void *private, struct imv_image **image, int *frametime);
+  void (*load_first_frame)(void *private, const struct imv_source_request *req,
+      struct imv_image **image, int *frametime);
 
   /* Loads the next frame, if successful puts output in image and duration
-   * (in milliseconds) in frametime. If unsuccessful, image shall be NULL.
+   * (in milliseconds) in frametime. If unsuccessful or cancelled, image shall
+   * be NULL.
    */
-  void (*load_next_frame)(void *private, struct imv_image **image, int *frametime);
+  void (*load_next_frame)(void *private, const struct imv_source_request *req,
+      struct imv_image **image, int *frametime);
 
   /* Cleans up the private data of a source */
   void (*free)(void *private);
@@ -30,4 +76,11 @@ struct imv_source_vtable {
 /* Build a source given its vtable and a pointer to the private data */
 struct imv_source *imv_source_create(const struct imv_source_vtable *vt, void *private);
 
+typedef void (*imv_source_wake)(void *data);
+
+/* Sets a function to be called whenever the source is cancelled, for a load
+ * that may be blocked waiting on something, such as data still arriving, to
+ * be woken so that it notices. It may be called from any thread. */
+void imv_source_set_wake(struct imv_source *src, imv_source_wake wake, void *data);
+
 #endif
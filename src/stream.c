@@ -0,0 +1,255 @@
+#include "stream.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/* How much room is made for the start of the stream. It doubles whenever it
+ * fills up, so that each byte is only copied a handful of times however long
+ * the stream turns out to be. */
+#define INITIAL_CAPACITY ((size_t)64 * 1024)
+
+struct imv_stream {
+  int refs;
+  int fd;
+
+  /* protects everything below, until the stream's done */
+  pthread_mutex_t lock;
+
+  /* signalled whenever more has been read, or the end reached */
+  pthread_cond_t grown;
+
+  unsigned char *data;
+  size_t len;
+  size_t capacity;
+
+  /* the end has been reached, or reading failed, so data is final */
+  bool done;
+
+  /* data is mapped from a regular file rather than read into memory */
+  bool mapped;
+
+  /* reading in the background, until woken to stop */
+  bool reading;
+  pthread_t thread;
+  int wake_fds[2];
+};
+
+static void *read_thread(void *raw)
+{
+  struct imv_stream *stream = raw;
+
+  /* only this thread ever moves the data, so it can be read into without
+   * holding the lock, as nobody looks past len */
+  unsigned char *data = NULL;
+  size_t len = 0;
+  size_t capacity = 0;
+
+  while (1) {
+    if (len == capacity) {
+      capacity = capacity ? capacity * 2 : INITIAL_CAPACITY;
+      pthread_mutex_lock(&stream->lock);
+      unsigned char *grown = realloc(stream->data, capacity);
+      if (grown) {
+        stream->data = data = grown;
+        stream->capacity = capacity;
+      }
+      pthread_mutex_unlock(&stream->lock);
+      if (!grown) {
+        imv_log(IMV_ERROR, "stream: out of memory after %zu bytes\n", len);
+        break;
+      }
+    }
+
+    struct pollfd fds[] = {
+      {.fd = stream->fd, .events = POLLIN},
+      {.fd = stream->wake_fds[0], .events = POLLIN},
+    };
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+
+    const ssize_t got = read(stream->fd, data + len, capacity - len);
+    if (got < 0 && (errno == EINTR || errno == EAGAIN)) {
+      continue;
+    }
+    if (got < 0) {
+      imv_log(IMV_ERROR, "stream: %s\n", strerror(errno));
+    }
+    if (got <= 0) {
+      break;
+    }
+
+    len += (size_t)got;
+    pthread_mutex_lock(&stream->lock);
+    stream->len = len;
+    pthread_cond_broadcast(&stream->grown);
+    pthread_mutex_unlock(&stream->lock);
+  }
+
+  pthread_mutex_lock(&stream->lock);
+  stream->done = true;
+  pthread_cond_broadcast(&stream->grown);
+  pthread_mutex_unlock(&stream->lock);
+  return NULL;
+}
+
+/* Maps fd if it's a regular file, such as stdin redirected from a file or a
+ * memfd, so that there's nothing to wait for or copy */
+static bool map_stream(struct imv_stream *stream)
+{
+  struct stat st;
+  if (fstat(stream->fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    return false;
+  }
+
+  /* if some of the file's already been read, the stream starts part way
+   * in, so it's simplest to carry on reading it like a pipe */
+  if (lseek(stream->fd, 0, SEEK_CUR) != 0) {
+    return false;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, stream->fd, 0);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+  posix_madvise(data, st.st_size, POSIX_MADV_WILLNEED);
+
+  stream->data = data;
+  stream->len = st.st_size;
+  stream->capacity = st.st_size;
+  stream->mapped = true;
+  stream->done = true;
+  return true;
+}
+
+struct imv_stream *imv_stream_create(int fd)
+{
+  struct imv_stream *stream = calloc(1, sizeof *stream);
+  stream->refs = 1;
+  stream->fd = fd;
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->grown, NULL);
+
+  if (map_stream(stream)) {
+    return stream;
+  }
+
+  if (pipe(stream->wake_fds)) {
+    imv_stream_free(stream);
+    return NULL;
+  }
+  if (pthread_create(&stream->thread, NULL, &read_thread, stream)) {
+    close(stream->wake_fds[0]);
+    close(stream->wake_fds[1]);
+    imv_stream_free(stream);
+    return NULL;
+  }
+  stream->reading = true;
+  return stream;
+}
+
+/* Tells the reading thread to stop */
+static void wake_reader(struct imv_stream *stream)
+{
+  ssize_t rc;
+  do {
+    rc = write(stream->wake_fds[1], "", 1);
+  } while (rc < 0 && errno == EINTR);
+}
+
+struct imv_stream *imv_stream_ref(struct imv_stream *stream)
+{
+  __atomic_add_fetch(&stream->refs, 1, __ATOMIC_RELAXED);
+  return stream;
+}
+
+void imv_stream_free(struct imv_stream *stream)
+{
+  if (!stream) {
+    return;
+  }
+
+  if (__atomic_sub_fetch(&stream->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+
+  if (stream->reading) {
+    wake_reader(stream);
+    pthread_join(stream->thread, NULL);
+    close(stream->wake_fds[0]);
+    close(stream->wake_fds[1]);
+  }
+
+  if (stream->mapped) {
+    munmap(stream->data, stream->capacity);
+  } else {
+    free(stream->data);
+  }
+  pthread_cond_destroy(&stream->grown);
+  pthread_mutex_destroy(&stream->lock);
+  free(stream);
+}
+
+void imv_stream_stop(struct imv_stream *stream)
+{
+  if (stream && stream->reading) {
+    wake_reader(stream);
+  }
+}
+
+size_t imv_stream_read(struct imv_stream *stream, size_t offset, void *buf,
+    size_t len, const int *cancelled)
+{
+  pthread_mutex_lock(&stream->lock);
+  while (!stream->done && stream->len < offset + len
+      && !(cancelled && __atomic_load_n(cancelled, __ATOMIC_RELAXED))) {
+    pthread_cond_wait(&stream->grown, &stream->lock);
+  }
+
+  size_t copied = 0;
+  if (offset < stream->len) {
+    copied = stream->len - offset < len ? stream->len - offset : len;
+    memcpy(buf, stream->data + offset, copied);
+  }
+  pthread_mutex_unlock(&stream->lock);
+  return copied;
+}
+
+void imv_stream_wake(struct imv_stream *stream)
+{
+  /* taking the lock means a waiter either hasn't checked yet, or is already
+   * waiting to be woken */
+  pthread_mutex_lock(&stream->lock);
+  pthread_cond_broadcast(&stream->grown);
+  pthread_mutex_unlock(&stream->lock);
+}
+
+void *imv_stream_data(struct imv_stream *stream, size_t *len)
+{
+  pthread_mutex_lock(&stream->lock);
+  while (!stream->done) {
+    pthread_cond_wait(&stream->grown, &stream->lock);
+  }
+  pthread_mutex_unlock(&stream->lock);
+
+  *len = stream->len;
+  return stream->data;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
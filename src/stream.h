@@ -0,0 +1,45 @@
+#ifndef IMV_STREAM_H
+#define IMV_STREAM_H
+
+#include <stddef.h>
+
+/* Everything read from a file descriptor such as a pipe, which is read in the
+ * background so that what's arrived can be used while the rest is still on
+ * its way. A regular file is mapped instead, so it's all there at once.
+ */
+struct imv_stream;
+
+/* Starts reading fd, which is left open. Returns NULL if it can't be read */
+struct imv_stream *imv_stream_create(int fd);
+
+/* Takes an extra reference to an imv_stream, so that it can be held in more
+ * than one place at once. Returns the stream for convenience. */
+struct imv_stream *imv_stream_ref(struct imv_stream *stream);
+
+/* Releases a reference to an imv_stream. Once the last reference is gone,
+ * reading stops and everything read is freed. */
+void imv_stream_free(struct imv_stream *stream);
+
+/* Stops reading, so that what's arrived so far is all there is. Anyone
+ * waiting for more is given what there is instead. */
+void imv_stream_stop(struct imv_stream *stream);
+
+/* Copies len bytes from offset into buf, waiting for them to arrive if need
+ * be. Returns how many were copied, which is only fewer than len if the end
+ * of the stream was reached first, or if cancelled isn't NULL and is set while
+ * waiting, which imv_stream_wake must be called after for it to be noticed.
+ * cancelled is only ever read atomically. */
+size_t imv_stream_read(struct imv_stream *stream, size_t offset, void *buf,
+    size_t len, const int *cancelled);
+
+/* Wakes anyone waiting on the stream, so that they check whether they've been
+ * cancelled */
+void imv_stream_wake(struct imv_stream *stream);
+
+/* Waits for the end of the stream, and returns all of it. The data doesn't
+ * move or change for as long as the stream's referenced. */
+void *imv_stream_data(struct imv_stream *stream, size_t *len);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,511 @@
+#include "template.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "thread_pool.h"
+
+extern char **environ;
+
+/* How long a command's output is reused for before it's run again */
+#define COMMAND_REFRESH 1.0 /* seconds */
+
+/* Anything longer than this wouldn't fit in a title or overlay anyway */
+#define MAX_COMMAND_OUTPUT 4096
+
+enum segment_type {
+  SEGMENT_TEXT,
+  SEGMENT_VARIABLE,
+  SEGMENT_COMMAND,
+};
+
+struct segment {
+  enum segment_type type;
+  /* the literal text, variable name, or command, depending on type */
+  char *text;
+
+  /* only used by commands, protected by the template's lock */
+  char *output;
+  /* when output was last updated, 0 if the command has never been run */
+  double updated;
+  bool running;
+  bool stale;
+  pid_t pid;
+};
+
+struct imv_template {
+  struct imv_thread_pool *pool;
+  imv_template_lookup lookup;
+  imv_template_export export;
+  imv_template_updated updated;
+  void *data;
+
+  struct segment *segments;
+  size_t num_segments;
+
+  /* protects everything below, as well as the commands' state */
+  pthread_mutex_t lock;
+
+  /* signalled whenever jobs drops to zero */
+  pthread_cond_t idle;
+  int jobs;
+  bool shutdown;
+};
+
+struct command_job {
+  struct imv_template *tmpl;
+  struct segment *segment;
+  char **envp;
+};
+
+struct string {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+static double cur_time(void)
+{
+  struct timespec ts;
+  const int rc = clock_gettime(CLOCK_MONOTONIC, &ts);
+  assert(!rc);
+  return ts.tv_sec + (double)ts.tv_nsec * 0.000000001;
+}
+
+static void string_append(struct string *str, const char *data, size_t len)
+{
+  if (str->len + len + 1 > str->cap) {
+    str->cap = (str->len + len + 1) * 2;
+    str->data = realloc(str->data, str->cap);
+  }
+  memcpy(str->data + str->len, data, len);
+  str->len += len;
+  str->data[str->len] = '\0';
+}
+
+static void add_segment(struct imv_template *tmpl, enum segment_type type,
+    const char *text, size_t len)
+{
+  tmpl->segments = realloc(tmpl->segments,
+      (tmpl->num_segments + 1) * sizeof *tmpl->segments);
+  struct segment *segment = &tmpl->segments[tmpl->num_segments++];
+  memset(segment, 0, sizeof *segment);
+  segment->type = type;
+  segment->text = strndup(text, len);
+}
+
+/* Turns any literal text collected so far into a segment of its own */
+static void flush_text(struct imv_template *tmpl, struct string *text)
+{
+  if (text->len > 0) {
+    add_segment(tmpl, SEGMENT_TEXT, text->data, text->len);
+    text->len = 0;
+  }
+}
+
+static bool is_name_char(char c)
+{
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+/* Finds the parenthesis closing a $( that ends just before str */
+static const char *find_closing_paren(const char *str)
+{
+  int depth = 1;
+  for (; *str; ++str) {
+    if (*str == '(') {
+      depth++;
+    } else if (*str == ')' && --depth == 0) {
+      return str;
+    }
+  }
+  return NULL;
+}
+
+/* Parses a format the way the shell would, except that unquoted whitespace
+ * only ever separates words, which end up joined by single spaces.
+ */
+static bool parse(struct imv_template *tmpl, const char *format)
+{
+  enum { UNQUOTED, SINGLE_QUOTED, DOUBLE_QUOTED } quote = UNQUOTED;
+  struct string text = {0};
+  bool space = false;
+  bool started = false;
+
+  const char *p = format;
+  while (*p) {
+    const char c = *p;
+
+    if (quote == UNQUOTED && isspace((unsigned char)c)) {
+      space = true;
+      ++p;
+      continue;
+    }
+    if (space && started) {
+      string_append(&text, " ", 1);
+    }
+    space = false;
+    started = true;
+
+    if (quote == SINGLE_QUOTED) {
+      if (c == '\'') {
+        quote = UNQUOTED;
+      } else {
+        string_append(&text, p, 1);
+      }
+      ++p;
+    } else if (c == '\\' && p[1]) {
+      /* inside double quotes, only special characters can be escaped */
+      if (quote == DOUBLE_QUOTED && !strchr("$`\"\\", p[1])) {
+        string_append(&text, p, 1);
+      }
+      string_append(&text, p + 1, 1);
+      p += 2;
+    } else if (c == '\'' && quote == UNQUOTED) {
+      quote = SINGLE_QUOTED;
+      ++p;
+    } else if (c == '"') {
+      quote = quote == DOUBLE_QUOTED ? UNQUOTED : DOUBLE_QUOTED;
+      ++p;
+    } else if (c == '`') {
+      const char *end = strchr(p + 1, '`');
+      if (!end) {
+        break;
+      }
+      flush_text(tmpl, &text);
+      add_segment(tmpl, SEGMENT_COMMAND, p + 1, end - p - 1);
+      p = end + 1;
+    } else if (c == '$' && p[1] == '(') {
+      const char *end = find_closing_paren(p + 2);
+      if (!end) {
+        break;
+      }
+      flush_text(tmpl, &text);
+      add_segment(tmpl, SEGMENT_COMMAND, p + 2, end - p - 2);
+      p = end + 1;
+    } else if (c == '$' && p[1] == '{') {
+      const char *end = strchr(p + 2, '}');
+      if (!end) {
+        break;
+      }
+      flush_text(tmpl, &text);
+      add_segment(tmpl, SEGMENT_VARIABLE, p + 2, end - p - 2);
+      p = end + 1;
+    } else if (c == '$' && is_name_char(p[1])) {
+      const char *end = p + 1;
+      while (is_name_char(*end)) {
+        ++end;
+      }
+      flush_text(tmpl, &text);
+      add_segment(tmpl, SEGMENT_VARIABLE, p + 1, end - p - 1);
+      p = end;
+    } else {
+      string_append(&text, p, 1);
+      ++p;
+    }
+  }
+
+  flush_text(tmpl, &text);
+  free(text.data);
+
+  /* stopped early on something unterminated */
+  return !*p && quote == UNQUOTED;
+}
+
+static void free_segments(struct imv_template *tmpl)
+{
+  for (size_t i = 0; i < tmpl->num_segments; ++i) {
+    free(tmpl->segments[i].text);
+    free(tmpl->segments[i].output);
+  }
+  free(tmpl->segments);
+  tmpl->segments = NULL;
+  tmpl->num_segments = 0;
+}
+
+struct imv_template *imv_template_create(const char *format,
+    struct imv_thread_pool *pool, imv_template_lookup lookup,
+    imv_template_export export, imv_template_updated updated, void *data)
+{
+  struct imv_template *tmpl = calloc(1, sizeof *tmpl);
+  tmpl->pool = pool;
+  tmpl->lookup = lookup;
+  tmpl->export = export;
+  tmpl->updated = updated;
+  tmpl->data = data;
+  pthread_mutex_init(&tmpl->lock, NULL);
+  pthread_cond_init(&tmpl->idle, NULL);
+
+  if (!parse(tmpl, format)) {
+    imv_log(IMV_WARNING, "Unable to parse text: %s\n", format);
+    free_segments(tmpl);
+    const char *error = "error expanding text";
+    add_segment(tmpl, SEGMENT_TEXT, error, strlen(error));
+  }
+
+  return tmpl;
+}
+
+void imv_template_free(struct imv_template *tmpl)
+{
+  if (!tmpl) {
+    return;
+  }
+
+  pthread_mutex_lock(&tmpl->lock);
+  tmpl->shutdown = true;
+  for (size_t i = 0; i < tmpl->num_segments; ++i) {
+    if (tmpl->segments[i].pid > 0) {
+      /* the whole process group, so that the shell's children go too */
+      kill(-tmpl->segments[i].pid, SIGTERM);
+    }
+  }
+  while (tmpl->jobs > 0) {
+    pthread_cond_wait(&tmpl->idle, &tmpl->lock);
+  }
+  pthread_mutex_unlock(&tmpl->lock);
+
+  pthread_cond_destroy(&tmpl->idle);
+  pthread_mutex_destroy(&tmpl->lock);
+  free_segments(tmpl);
+  free(tmpl);
+}
+
+/* Runs a command with its output going to a pipe, returning what it wrote */
+static char *run_command(struct imv_template *tmpl, struct segment *segment,
+    char **envp)
+{
+  int fds[2];
+  if (pipe(fds)) {
+    return NULL;
+  }
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+  posix_spawnattr_setpgroup(&attr, 0);
+
+  char *argv[] = {"sh", "-c", segment->text, NULL};
+  pid_t pid = 0;
+
+  /* Spawn with the lock held, so that the template can't be freed without
+   * seeing the pid */
+  pthread_mutex_lock(&tmpl->lock);
+  int rc = -1;
+  if (!tmpl->shutdown) {
+    rc = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, envp);
+  }
+  if (rc == 0) {
+    segment->pid = pid;
+  }
+  pthread_mutex_unlock(&tmpl->lock);
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+
+  if (rc != 0) {
+    close(fds[0]);
+    return NULL;
+  }
+
+  /* Read until the end even once there's no room left, as a command blocked
+   * writing to a full pipe would never exit */
+  char *output = malloc(MAX_COMMAND_OUTPUT + 1);
+  char discard[512];
+  size_t len = 0;
+  while (1) {
+    const bool full = len == MAX_COMMAND_OUTPUT;
+    ssize_t r = full ? read(fds[0], discard, sizeof discard)
+                     : read(fds[0], output + len, MAX_COMMAND_OUTPUT - len);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    } else if (r <= 0) {
+      break;
+    }
+    if (!full) {
+      len += r;
+    }
+  }
+  close(fds[0]);
+
+  while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+  }
+
+  /* trailing newlines are dropped, as the shell does */
+  while (len > 0 && output[len - 1] == '\n') {
+    len--;
+  }
+  output[len] = '\0';
+  return output;
+}
+
+static void free_environ(char **envp)
+{
+  for (char **var = envp; *var; ++var) {
+    free(*var);
+  }
+  free(envp);
+}
+
+static void command_job(void *data)
+{
+  struct command_job *job = data;
+  struct imv_template *tmpl = job->tmpl;
+  struct segment *segment = job->segment;
+
+  char *output = run_command(tmpl, segment, job->envp);
+  free_environ(job->envp);
+  free(job);
+
+  pthread_mutex_lock(&tmpl->lock);
+  segment->running = false;
+  segment->pid = 0;
+  segment->updated = cur_time();
+  const bool changed = output && (!segment->output || strcmp(segment->output, output));
+  if (changed) {
+    free(segment->output);
+    segment->output = output;
+    output = NULL;
+  }
+  const bool notify = changed && !tmpl->shutdown;
+  pthread_mutex_unlock(&tmpl->lock);
+
+  free(output);
+
+  if (notify) {
+    tmpl->updated(tmpl->data);
+  }
+
+  pthread_mutex_lock(&tmpl->lock);
+  if (--tmpl->jobs == 0) {
+    pthread_cond_broadcast(&tmpl->idle);
+  }
+  pthread_mutex_unlock(&tmpl->lock);
+}
+
+/* Copies the environment, so that a command can be run with it from another
+ * thread while this one goes on changing it */
+static char **copy_environ(void)
+{
+  size_t count = 0;
+  while (environ[count]) {
+    ++count;
+  }
+
+  char **envp = calloc(count + 1, sizeof *envp);
+  for (size_t i = 0; i < count; ++i) {
+    envp[i] = strdup(environ[i]);
+  }
+  return envp;
+}
+
+static void start_command(struct imv_template *tmpl, struct segment *segment)
+{
+  tmpl->export(tmpl->data);
+
+  struct command_job *job = calloc(1, sizeof *job);
+  job->tmpl = tmpl;
+  job->segment = segment;
+  job->envp = copy_environ();
+
+  if (tmpl->pool) {
+    imv_thread_pool_submit(tmpl->pool, IMV_PRIORITY_LOW, &command_job, job);
+  } else {
+    command_job(job);
+  }
+}
+
+/* Appends as much of str as fits, keeping buf nul terminated */
+static void append(char *buf, size_t len, size_t *used, const char *str)
+{
+  size_t n = strlen(str);
+  if (*used + n >= len) {
+    n = len - *used - 1;
+  }
+  memcpy(buf + *used, str, n);
+  *used += n;
+  buf[*used] = '\0';
+}
+
+size_t imv_template_render(struct imv_template *tmpl, char *buf, size_t len)
+{
+  if (len == 0) {
+    return 0;
+  }
+  buf[0] = '\0';
+
+  const double now = cur_time();
+  size_t used = 0;
+  for (size_t i = 0; i < tmpl->num_segments; ++i) {
+    struct segment *segment = &tmpl->segments[i];
+
+    if (segment->type == SEGMENT_TEXT) {
+      append(buf, len, &used, segment->text);
+    } else if (segment->type == SEGMENT_VARIABLE) {
+      char value_buf[64];
+      const char *value = tmpl->lookup(segment->text, value_buf,
+          sizeof value_buf, tmpl->data);
+      if (!value) {
+        value = getenv(segment->text);
+      }
+      if (value) {
+        append(buf, len, &used, value);
+      }
+    } else {
+      pthread_mutex_lock(&tmpl->lock);
+      const bool start = !segment->running && (segment->stale
+          || segment->updated == 0 || now - segment->updated >= COMMAND_REFRESH);
+      if (start) {
+        segment->running = true;
+        segment->stale = false;
+        tmpl->jobs++;
+      }
+      if (segment->output) {
+        append(buf, len, &used, segment->output);
+      }
+      pthread_mutex_unlock(&tmpl->lock);
+
+      if (start) {
+        start_command(tmpl, segment);
+      }
+    }
+  }
+
+  return used;
+}
+
+void imv_template_invalidate(struct imv_template *tmpl)
+{
+  if (!tmpl) {
+    return;
+  }
+
+  pthread_mutex_lock(&tmpl->lock);
+  for (size_t i = 0; i < tmpl->num_segments; ++i) {
+    tmpl->segments[i].stale = true;
+  }
+  pthread_mutex_unlock(&tmpl->lock);
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,51 @@
+#ifndef IMV_TEMPLATE_H
+#define IMV_TEMPLATE_H
+
+#include <stddef.h>
+
+/* A title or overlay format string, parsed once up front so that it can be
+ * cheaply filled in on every redraw. Supports the subset of shell syntax that
+ * makes sense for a line of text: quoting, backslash escapes, $var, ${var},
+ * and command substitution with $(...) or `...`.
+ *
+ * Command substitutions are run on the worker pool rather than while drawing.
+ * Until a command has finished its previous output is used, and outputs are
+ * reused until they're older than a second or invalidated.
+ */
+struct imv_template;
+
+struct imv_thread_pool;
+
+/* Looks up a variable, returning its value, which may be written to buf, or
+ * NULL to fall back to the environment. Called from the rendering thread. */
+typedef const char *(*imv_template_lookup)(const char *name, char *buf,
+    size_t len, void *data);
+
+/* Exports variables to the environment, ready for a command to be run.
+ * Called from the rendering thread. */
+typedef void (*imv_template_export)(void *data);
+
+/* Called from a worker thread when a command's output has changed, so the
+ * template should be rendered again. */
+typedef void (*imv_template_updated)(void *data);
+
+/* Parses format. If it can't be parsed the template renders as an error
+ * message. */
+struct imv_template *imv_template_create(const char *format,
+    struct imv_thread_pool *pool, imv_template_lookup lookup,
+    imv_template_export export, imv_template_updated updated, void *data);
+
+/* Cleans up a template, stopping any commands still running */
+void imv_template_free(struct imv_template *tmpl);
+
+/* Fills in the template, writing at most len bytes to buf including the nul
+ * terminator. Returns the length of the text written. */
+size_t imv_template_render(struct imv_template *tmpl, char *buf, size_t len);
+
+/* Marks all command outputs out of date, for when what they depend on, such as
+ * the current file, has changed. */
+void imv_template_invalidate(struct imv_template *tmpl);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
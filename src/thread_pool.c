@@ -0,0 +1,305 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/* Upper limit on the number of threads picked automatically. Each worker can
+ * be holding a full-size decoded image, so more isn't necessarily better.
+ */
+#define MAX_AUTO_THREADS 8
+
+struct job {
+  imv_thread_pool_job func;
+  void *data;
+  /* the next job in its queue, or once it's running, the next running low
+   * priority job */
+  struct job *next;
+
+  /* set when a running low priority job is asked to give way, only ever
+   * accessed atomically */
+  int preempted;
+};
+
+/* The job the calling worker thread is running */
+static pthread_key_t current_job;
+static pthread_once_t current_job_once = PTHREAD_ONCE_INIT;
+
+static void create_current_job(void)
+{
+  pthread_key_create(&current_job, NULL);
+}
+
+struct job_queue {
+  struct job *head;
+  struct job *tail;
+};
+
+struct imv_thread_pool {
+  pthread_t *threads;
+  int num_threads;
+
+  /* protects everything below */
+  pthread_mutex_t lock;
+  /* signalled when a job is queued, a worker stops running a low priority
+   * job, or the pool is shutting down */
+  pthread_cond_t job_ready;
+
+  /* one queue per priority, high priority jobs always go first */
+  struct job_queue queues[2];
+  size_t queue_depth;
+
+  /* Low priority jobs may never occupy every worker, so that there's always
+   * one free to pick up anything the user is waiting on.
+   */
+  int busy_low;
+  int max_busy_low;
+
+  /* workers running any job at all */
+  int busy;
+
+  /* the low priority jobs being run, oldest first */
+  struct job *running_low;
+
+  bool shutdown;
+};
+
+static struct job *pop_job(struct job_queue *queue)
+{
+  struct job *job = queue->head;
+  if (job) {
+    queue->head = job->next;
+    if (!queue->head) {
+      queue->tail = NULL;
+    }
+  }
+  return job;
+}
+
+/* Takes the next job that may be run right now, if there is one */
+static struct job *next_job(struct imv_thread_pool *pool, bool *is_low)
+{
+  struct job *job = pop_job(&pool->queues[IMV_PRIORITY_HIGH]);
+  *is_low = false;
+  if (!job && pool->busy_low < pool->max_busy_low) {
+    job = pop_job(&pool->queues[IMV_PRIORITY_LOW]);
+    *is_low = job != NULL;
+  }
+  return job;
+}
+
+/* Must be called with pool->lock held */
+static void add_running_low(struct imv_thread_pool *pool, struct job *job)
+{
+  struct job **link = &pool->running_low;
+  while (*link) {
+    link = &(*link)->next;
+  }
+  job->next = NULL;
+  *link = job;
+}
+
+/* Must be called with pool->lock held */
+static void remove_running_low(struct imv_thread_pool *pool, struct job *job)
+{
+  struct job **link = &pool->running_low;
+  while (*link != job) {
+    link = &(*link)->next;
+  }
+  *link = job->next;
+}
+
+/* If high priority work has nowhere to run, ask the oldest low priority job
+ * that's running to give way. Only one is asked at a time, as one worker is
+ * all it takes. Must be called with pool->lock held. */
+static void preempt_low(struct imv_thread_pool *pool)
+{
+  if (pool->busy < pool->num_threads || !pool->running_low) {
+    return;
+  }
+  for (struct job *job = pool->running_low; job; job = job->next) {
+    if (__atomic_load_n(&job->preempted, __ATOMIC_RELAXED)) {
+      /* already on its way out */
+      return;
+    }
+  }
+  __atomic_store_n(&pool->running_low->preempted, 1, __ATOMIC_RELAXED);
+}
+
+static void *worker_thread(void *data)
+{
+  struct imv_thread_pool *pool = data;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    bool is_low;
+    struct job *job = next_job(pool, &is_low);
+    if (!job) {
+      if (pool->shutdown && !pool->queues[IMV_PRIORITY_HIGH].head
+          && !pool->queues[IMV_PRIORITY_LOW].head) {
+        /* shutting down and the queues have been drained */
+        break;
+      }
+      pthread_cond_wait(&pool->job_ready, &pool->lock);
+      continue;
+    }
+
+    pool->queue_depth--;
+    pool->busy++;
+    if (is_low) {
+      pool->busy_low++;
+      add_running_low(pool, job);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    pthread_setspecific(current_job, job);
+    job->func(job->data);
+    pthread_setspecific(current_job, NULL);
+    pthread_mutex_lock(&pool->lock);
+
+    pool->busy--;
+    if (is_low) {
+      remove_running_low(pool, job);
+    }
+    free(job);
+    if (is_low) {
+      pool->busy_low--;
+      /* another worker may have been holding off on a low priority job */
+      pthread_cond_broadcast(&pool->job_ready);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+static int auto_thread_count(void)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) {
+    return 1;
+  }
+  return cpus > MAX_AUTO_THREADS ? MAX_AUTO_THREADS : (int)cpus;
+}
+
+struct imv_thread_pool *imv_thread_pool_create(int num_threads)
+{
+  if (num_threads <= 0) {
+    num_threads = auto_thread_count();
+  }
+
+  pthread_once(&current_job_once, &create_current_job);
+
+  struct imv_thread_pool *pool = calloc(1, sizeof *pool);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->job_ready, NULL);
+
+  pool->threads = calloc(num_threads, sizeof *pool->threads);
+  for (int i = 0; i < num_threads; ++i) {
+    if (pthread_create(&pool->threads[i], NULL, worker_thread, pool)) {
+      imv_log(IMV_WARNING, "thread_pool: only able to start %d of %d threads\n",
+          i, num_threads);
+      break;
+    }
+    pool->num_threads++;
+  }
+
+  if (pool->num_threads == 0) {
+    imv_thread_pool_free(pool);
+    return NULL;
+  }
+
+  /* With a single thread there's nothing to reserve, so low priority jobs are
+   * preempted instead */
+  pthread_mutex_lock(&pool->lock);
+  pool->max_busy_low = pool->num_threads > 1 ? pool->num_threads - 1 : 1;
+  pthread_mutex_unlock(&pool->lock);
+
+  imv_log(IMV_DEBUG, "thread_pool: started %d worker threads\n", pool->num_threads);
+  return pool;
+}
+
+void imv_thread_pool_free(struct imv_thread_pool *pool)
+{
+  if (!pool) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->job_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->num_threads; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->job_ready);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+static void submit(struct imv_thread_pool *pool,
+    enum imv_thread_pool_priority priority, imv_thread_pool_job func,
+    void *data, bool may_preempt)
+{
+  struct job *job = malloc(sizeof *job);
+  job->func = func;
+  job->data = data;
+  job->next = NULL;
+  job->preempted = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  struct job_queue *queue = &pool->queues[priority];
+  if (queue->tail) {
+    queue->tail->next = job;
+  } else {
+    queue->head = job;
+  }
+  queue->tail = job;
+  pool->queue_depth++;
+  if (priority == IMV_PRIORITY_HIGH && may_preempt) {
+    preempt_low(pool);
+  }
+  /* wake everyone, as an idle worker may not be allowed to take this job */
+  pthread_cond_broadcast(&pool->job_ready);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void imv_thread_pool_submit(struct imv_thread_pool *pool,
+    enum imv_thread_pool_priority priority, imv_thread_pool_job func, void *data)
+{
+  submit(pool, priority, func, data, true);
+}
+
+void imv_thread_pool_submit_cleanup(struct imv_thread_pool *pool,
+    imv_thread_pool_job func, void *data)
+{
+  submit(pool, IMV_PRIORITY_HIGH, func, data, false);
+}
+
+bool imv_thread_pool_preempted(void)
+{
+  pthread_once(&current_job_once, &create_current_job);
+  const struct job *job = pthread_getspecific(current_job);
+  return job && __atomic_load_n(&job->preempted, __ATOMIC_RELAXED);
+}
+
+size_t imv_thread_pool_queue_depth(struct imv_thread_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  size_t depth = pool->queue_depth;
+  pthread_mutex_unlock(&pool->lock);
+  return depth;
+}
+
+int imv_thread_pool_size(struct imv_thread_pool *pool)
+{
+  return pool->num_threads;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
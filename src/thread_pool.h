@@ -0,0 +1,58 @@
+#ifndef IMV_THREAD_POOL_H
+#define IMV_THREAD_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A fixed set of worker threads servicing a pair of shared FIFO job queues.
+ * Used to bound how much background work (decoding, freeing) can run at once,
+ * and to avoid paying for thread creation every time some is started.
+ */
+struct imv_thread_pool;
+
+enum imv_thread_pool_priority {
+  /* Work the user is waiting on. Always runs before any low priority job. */
+  IMV_PRIORITY_HIGH,
+
+  /* Speculative work, such as prefetching. Never allowed to occupy every
+   * worker thread at once, unless there's only one, in which case long jobs
+   * should give way when imv_thread_pool_preempted says so. */
+  IMV_PRIORITY_LOW,
+};
+
+typedef void (*imv_thread_pool_job)(void *data);
+
+/* Create a pool with the given number of worker threads. If num_threads is 0
+ * or less, one thread is created per online CPU, up to a sensible maximum.
+ */
+struct imv_thread_pool *imv_thread_pool_create(int num_threads);
+
+/* Clean up a pool. Any jobs still queued are run to completion first, then all
+ * worker threads are joined. */
+void imv_thread_pool_free(struct imv_thread_pool *pool);
+
+/* Queue a job to be run by the next idle worker thread. A high priority job
+ * that finds every worker busy asks one of the low priority jobs to give way.
+ */
+void imv_thread_pool_submit(struct imv_thread_pool *pool,
+    enum imv_thread_pool_priority priority, imv_thread_pool_job job, void *data);
+
+/* Queue a high priority job that nobody's waiting on, such as freeing
+ * something, which never asks anything else to give way */
+void imv_thread_pool_submit_cleanup(struct imv_thread_pool *pool,
+    imv_thread_pool_job job, void *data);
+
+/* Returns true if the low priority job running on the calling thread has been
+ * asked to give way to high priority work. It should stop early and resubmit
+ * whatever's left, handing its worker over. Always false anywhere else. */
+bool imv_thread_pool_preempted(void);
+
+/* Returns the number of jobs waiting for a worker thread */
+size_t imv_thread_pool_queue_depth(struct imv_thread_pool *pool);
+
+/* Returns the number of worker threads in the pool */
+int imv_thread_pool_size(struct imv_thread_pool *pool);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
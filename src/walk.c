@@ -0,0 +1,404 @@
+#include "walk.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Some systems like GNU/Hurd don't define PATH_MAX */
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/* Listing directories is mostly spent waiting on the disk or network rather
+ * than the CPU, so this isn't tied to the number of cores. It counts the
+ * calling thread, and is the most used when no other limit is given. */
+#define WALK_THREADS 8
+
+enum node_state {
+  NODE_QUEUED,
+  NODE_SCANNING,
+  NODE_SCANNED,
+};
+
+struct entry {
+  const char *name;
+
+  /* offset of name within the directory's names while it's being read */
+  size_t offset;
+
+  bool is_dir;
+
+  /* the entry is a symbolic link */
+  bool is_link;
+
+  /* the subdirectory's listing, once it's been queued */
+  struct dir_node *dir;
+};
+
+struct dir_node {
+  char *path;
+  enum node_state state;
+
+  /* the directory was reached through a symbolic link */
+  bool via_link;
+
+  /* set if any entry couldn't be looked at */
+  bool failed;
+
+  /* sorted by name once scanned */
+  struct entry *entries;
+  size_t num_entries;
+
+  /* the entries' names, packed end to end */
+  char *names;
+
+  /* neighbours in the queue while NODE_QUEUED */
+  struct dir_node *prev;
+  struct dir_node *next;
+};
+
+struct walk {
+  bool recursive;
+
+  /* workers to start besides the calling thread */
+  int max_workers;
+
+  /* protects everything below, and the state and queue links of the nodes */
+  pthread_mutex_t lock;
+
+  /* signalled when nodes are queued, or the walk is over */
+  pthread_cond_t queued;
+
+  /* broadcast whenever a node has been scanned */
+  pthread_cond_t scanned;
+
+  /* nodes waiting to be scanned, most recently queued first so that the
+   * workers stay close to where the results are being consumed */
+  struct dir_node *queue;
+
+  bool finished;
+
+  pthread_t threads[WALK_THREADS - 1];
+  int num_threads;
+};
+
+static struct dir_node *create_node(char *path, bool via_link)
+{
+  struct dir_node *node = calloc(1, sizeof *node);
+  node->path = path;
+  node->via_link = via_link;
+  return node;
+}
+
+static void free_node(struct dir_node *node)
+{
+  free(node->entries);
+  free(node->names);
+  free(node->path);
+  free(node);
+}
+
+/* Must be called with walk->lock held */
+static void queue_push(struct walk *walk, struct dir_node *node)
+{
+  node->prev = NULL;
+  node->next = walk->queue;
+  if (walk->queue) {
+    walk->queue->prev = node;
+  }
+  walk->queue = node;
+}
+
+/* Must be called with walk->lock held */
+static void queue_unlink(struct walk *walk, struct dir_node *node)
+{
+  if (node->prev) {
+    node->prev->next = node->next;
+  } else {
+    walk->queue = node->next;
+  }
+  if (node->next) {
+    node->next->prev = node->prev;
+  }
+  node->prev = NULL;
+  node->next = NULL;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+  const struct entry *entry_a = a;
+  const struct entry *entry_b = b;
+  return strcoll(entry_a->name, entry_b->name);
+}
+
+enum entry_type {
+  TYPE_FILE,
+  TYPE_DIR,
+  TYPE_MISSING,
+  TYPE_ERROR,
+};
+
+/* Works out what a directory entry is, only looking at the file itself if the
+ * directory listing didn't say */
+static enum entry_type entry_type(int dir_fd, const struct dirent *ent,
+    bool *is_link)
+{
+  struct stat info;
+  *is_link = false;
+#ifdef DT_UNKNOWN
+  /* symlinks are followed, so they have to be looked at too */
+  if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK) {
+    return ent->d_type == DT_DIR ? TYPE_DIR : TYPE_FILE;
+  }
+  *is_link = ent->d_type == DT_LNK;
+#endif
+
+  if (!*is_link) {
+    /* the listing didn't say, but only links need to be followed */
+    if (fstatat(dir_fd, ent->d_name, &info, AT_SYMLINK_NOFOLLOW)) {
+      return errno == ENOENT ? TYPE_MISSING : TYPE_ERROR;
+    }
+    if (!S_ISLNK(info.st_mode)) {
+      return S_ISDIR(info.st_mode) ? TYPE_DIR : TYPE_FILE;
+    }
+    *is_link = true;
+  }
+
+  if (fstatat(dir_fd, ent->d_name, &info, 0)) {
+    /* dangling or looping links aren't worth complaining about */
+    if (errno == ELOOP || errno == ENOTDIR || errno == ENOENT) {
+      return TYPE_MISSING;
+    }
+    return TYPE_ERROR;
+  }
+  return S_ISDIR(info.st_mode) ? TYPE_DIR : TYPE_FILE;
+}
+
+static void start_threads(struct walk *walk);
+
+/* Reads a directory's entries, queueing any subdirectories to be read too */
+static void scan_node(struct walk *walk, struct dir_node *node)
+{
+  /* unreadable directories are quietly skipped */
+  const int fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  DIR *dir = fdopendir(fd);
+  if (!dir) {
+    close(fd);
+    return;
+  }
+
+  size_t names_len = 0;
+  size_t names_cap = 0;
+  size_t entries_cap = 0;
+  const size_t path_len = strlen(node->path);
+
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+      continue;
+    }
+
+    const size_t name_len = strlen(ent->d_name);
+    if (path_len + 1 + name_len > PATH_MAX) {
+      continue;
+    }
+
+    bool is_link;
+    const enum entry_type type = entry_type(fd, ent, &is_link);
+    if (type == TYPE_ERROR) {
+      node->failed = true;
+    }
+    if (type == TYPE_MISSING || type == TYPE_ERROR ||
+        (type == TYPE_DIR && !walk->recursive)) {
+      continue;
+    }
+
+    if (node->num_entries == entries_cap) {
+      entries_cap = entries_cap ? entries_cap * 2 : 64;
+      node->entries = realloc(node->entries, entries_cap * sizeof *node->entries);
+    }
+    if (names_len + name_len + 1 > names_cap) {
+      names_cap = names_cap ? names_cap * 2 : 4096;
+      while (names_len + name_len + 1 > names_cap) {
+        names_cap *= 2;
+      }
+      node->names = realloc(node->names, names_cap);
+    }
+
+    struct entry *entry = &node->entries[node->num_entries++];
+    entry->offset = names_len;
+    entry->is_dir = type == TYPE_DIR;
+    entry->is_link = is_link;
+    entry->dir = NULL;
+    memcpy(node->names + names_len, ent->d_name, name_len + 1);
+    names_len += name_len + 1;
+  }
+  closedir(dir);
+
+  for (size_t i = 0; i < node->num_entries; ++i) {
+    node->entries[i].name = node->names + node->entries[i].offset;
+  }
+  qsort(node->entries, node->num_entries, sizeof *node->entries,
+      &compare_entries);
+
+  bool any_dirs = false;
+  for (size_t i = 0; i < node->num_entries; ++i) {
+    struct entry *entry = &node->entries[i];
+    if (entry->is_dir) {
+      char *path = malloc(path_len + strlen(entry->name) + 2);
+      sprintf(path, "%s/%s", node->path, entry->name);
+      entry->dir = create_node(path, node->via_link || entry->is_link);
+      any_dirs = true;
+    }
+  }
+
+  if (!any_dirs) {
+    return;
+  }
+
+  pthread_mutex_lock(&walk->lock);
+  /* pushed last to first, so the first is read first */
+  for (size_t i = node->num_entries; i > 0; --i) {
+    if (node->entries[i - 1].dir) {
+      queue_push(walk, node->entries[i - 1].dir);
+    }
+  }
+  start_threads(walk);
+  pthread_cond_broadcast(&walk->queued);
+  pthread_mutex_unlock(&walk->lock);
+}
+
+static void *walk_thread(void *data)
+{
+  struct walk *walk = data;
+
+  pthread_mutex_lock(&walk->lock);
+  while (1) {
+    while (!walk->queue && !walk->finished) {
+      pthread_cond_wait(&walk->queued, &walk->lock);
+    }
+    if (!walk->queue) {
+      break;
+    }
+
+    struct dir_node *node = walk->queue;
+    queue_unlink(walk, node);
+    node->state = NODE_SCANNING;
+    pthread_mutex_unlock(&walk->lock);
+
+    scan_node(walk, node);
+
+    pthread_mutex_lock(&walk->lock);
+    node->state = NODE_SCANNED;
+    pthread_cond_broadcast(&walk->scanned);
+  }
+  pthread_mutex_unlock(&walk->lock);
+
+  return NULL;
+}
+
+/* Must be called with walk->lock held */
+static void start_threads(struct walk *walk)
+{
+  if (walk->num_threads > 0) {
+    return;
+  }
+
+  /* if none can be started the calling thread does all the work */
+  for (int i = 0; i < walk->max_workers; ++i) {
+    if (pthread_create(&walk->threads[walk->num_threads], NULL,
+          &walk_thread, walk)) {
+      break;
+    }
+    walk->num_threads++;
+  }
+}
+
+/* Passes on the files in a node, and its subdirectories', freeing each node
+ * once done with. Returns non-zero if anything failed. */
+static int emit_node(struct walk *walk, struct dir_node *node,
+    imv_walk_callback callback, void *data, int *callback_result)
+{
+  pthread_mutex_lock(&walk->lock);
+  if (node->state == NODE_QUEUED) {
+    /* no worker has got to it yet, so don't wait around for one */
+    queue_unlink(walk, node);
+    node->state = NODE_SCANNING;
+    pthread_mutex_unlock(&walk->lock);
+
+    scan_node(walk, node);
+
+    pthread_mutex_lock(&walk->lock);
+    node->state = NODE_SCANNED;
+  }
+  while (node->state != NODE_SCANNED) {
+    pthread_cond_wait(&walk->scanned, &walk->lock);
+  }
+  pthread_mutex_unlock(&walk->lock);
+
+  int result = node->failed ? 1 : 0;
+  char path[PATH_MAX + 2];
+
+  for (size_t i = 0; i < node->num_entries; ++i) {
+    struct entry *entry = &node->entries[i];
+    if (entry->dir) {
+      /* still walked after the callback fails, so that it's all cleaned up */
+      if (emit_node(walk, entry->dir, callback, data, callback_result)) {
+        result = 1;
+      }
+    } else if (*callback_result == 0) {
+      snprintf(path, sizeof path, "%s/%s", node->path, entry->name);
+      *callback_result = callback(path, node->via_link || entry->is_link,
+          data);
+    }
+  }
+
+  free_node(node);
+  return result;
+}
+
+int imv_walk_directory(const char *path, bool recursive, int max_threads,
+    imv_walk_callback callback, void *data)
+{
+  if (max_threads <= 0 || max_threads > WALK_THREADS) {
+    max_threads = WALK_THREADS;
+  }
+
+  struct walk walk = {
+    .recursive = recursive,
+    .max_workers = max_threads - 1,
+  };
+  pthread_mutex_init(&walk.lock, NULL);
+  pthread_cond_init(&walk.queued, NULL);
+  pthread_cond_init(&walk.scanned, NULL);
+
+  int callback_result = 0;
+  struct dir_node *root = create_node(strdup(path), false);
+  int result = emit_node(&walk, root, callback, data, &callback_result);
+
+  pthread_mutex_lock(&walk.lock);
+  walk.finished = true;
+  pthread_cond_broadcast(&walk.queued);
+  pthread_mutex_unlock(&walk.lock);
+  for (int i = 0; i < walk.num_threads; ++i) {
+    pthread_join(walk.threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&walk.scanned);
+  pthread_cond_destroy(&walk.queued);
+  pthread_mutex_destroy(&walk.lock);
+
+  return result || callback_result ? 1 : 0;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -0,0 +1,27 @@
+#ifndef IMV_WALK_H
+#define IMV_WALK_H
+
+#include <stdbool.h>
+
+/* Called with the path of each file found, which is the directory's path with
+ * names appended. If via_link is set, the file or a directory it's in is a
+ * symbolic link, so the path isn't canonical even if the directory's was.
+ * Returning non-zero stops any more paths being passed on. */
+typedef int (*imv_walk_callback)(const char *path, bool via_link, void *data);
+
+/* Lists the files in a directory, sorted by name in the current locale. If
+ * recursive is set, the contents of each subdirectory are listed in its place.
+ *
+ * Subdirectories are read ahead by a handful of worker threads, up to
+ * max_threads including the calling thread, or a default if it's zero. The
+ * callback is only ever called from the calling thread, and in the same order
+ * as a depth first walk would give.
+ *
+ * Returns non-zero if anything couldn't be looked at or the callback failed.
+ */
+int imv_walk_directory(const char *path, bool recursive, int max_threads,
+    imv_walk_callback callback, void *data);
+
+#endif
+
+/* vim:set ts=2 sts=2 sw=2 et: */
@@ -80,9 +80,14 @@ void imv_window_get_mouse_position(struct imv_window *window, double *x, double
 /* Swap the framebuffers. Present anything rendered since the last call. */
 void imv_window_present(struct imv_window *window);
 
-/* Blocks until an event is received, or the timeout (in seconds) expires */
+/* Blocks until an event is received, or the timeout (in seconds) expires.
+ * A negative timeout never expires. */
 void imv_window_wait_for_event(struct imv_window *window, double timeout);
 
+/* Also wake up imv_window_wait_for_event when fd becomes readable. Only one fd
+ * is watched at a time, and -1 stops watching it. */
+void imv_window_watch_fd(struct imv_window *window, int fd);
+
 /* Push an event to the event queue. An internal copy of the event is made.
  * Wakes up imv_window_wait_for_event */
 void imv_window_push_event(struct imv_window *window, struct imv_event *e);
@@ -1,11 +1,11 @@
 #include "window.h"
 
+#include "event_queue.h"
 #include "keyboard.h"
 #include "list.h"
 
 #include <assert.h>
 #include <fcntl.h>
-#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <string.h>
@@ -40,7 +40,10 @@ struct imv_window {
   struct list *wl_outputs;
 
   int display_fd;
-  int pipe_fds[2];
+  struct imv_event_queue *events;
+
+  /* an extra fd to wake up for, or -1 */
+  int watch_fd;
 
   timer_t timer_id;
   int repeat_scancode; /* scancode of key to repeat */
@@ -79,15 +82,6 @@ struct output_data {
   bool contains_window;
 };
 
-static void set_nonblocking(int fd)
-{
-  int flags = fcntl(fd, F_GETFL);
-  assert(flags != -1);
-  flags |= O_NONBLOCK;
-  int rc = fcntl(fd, F_SETFL, flags);
-  assert(rc != -1);
-}
-
 static void handle_ping_xdg_wm_base(void *data, struct xdg_wm_base *xdg,
     uint32_t serial)
 {
@@ -668,9 +662,9 @@ static void connect_to_wayland(struct imv_window *window)
   window->wl_display = wl_display_connect(NULL);
   assert(window->wl_display);
   window->display_fd = wl_display_get_fd(window->wl_display);
-  pipe(window->pipe_fds);
-  set_nonblocking(window->pipe_fds[0]);
-  set_nonblocking(window->pipe_fds[1]);
+  window->events = imv_event_queue_create();
+  assert(window->events);
+  window->watch_fd = -1;
 
   window->wl_registry = wl_display_get_registry(window->wl_display);
   assert(window->wl_registry);
@@ -730,8 +724,11 @@ static void create_window(struct imv_window *window, int width, int height,
 
 static void shutdown_wayland(struct imv_window *window)
 {
-  close(window->pipe_fds[0]);
-  close(window->pipe_fds[1]);
+  struct imv_event e;
+  while (imv_event_queue_pop(window->events, &e)) {
+    cleanup_event(&e);
+  }
+  imv_event_queue_free(window->events);
   if (window->wl_pointer) {
     wl_pointer_destroy(window->wl_pointer);
   }
@@ -776,9 +773,6 @@ static void on_timer(union sigval sigval)
 
 struct imv_window *imv_window_create(int width, int height, const char *title)
 {
-  /* Ensure event writes will always be atomic */
-  assert(sizeof(struct imv_event) <= PIPE_BUF);
-
   struct imv_window *window = calloc(1, sizeof *window);
   window->scale = 1;
 
@@ -883,7 +877,8 @@ void imv_window_wait_for_event(struct imv_window *window, double timeout)
 {
   struct pollfd fds[] = {
     {.fd = window->display_fd,  .events = POLLIN},
-    {.fd = window->pipe_fds[0], .events = POLLIN}
+    {.fd = imv_event_queue_fd(window->events), .events = POLLIN},
+    {.fd = window->watch_fd, .events = POLLIN}
   };
   nfds_t nfds = sizeof fds / sizeof *fds;
 
@@ -894,7 +889,7 @@ void imv_window_wait_for_event(struct imv_window *window, double timeout)
 
   wl_display_flush(window->wl_display);
 
-  if (poll(fds, nfds, timeout * 1000) <= 0) {
+  if (poll(fds, nfds, timeout < 0 ? -1 : (int)(timeout * 1000)) <= 0) {
     wl_display_cancel_read(window->wl_display);
     return;
   }
@@ -906,23 +901,22 @@ void imv_window_wait_for_event(struct imv_window *window, double timeout)
   }
 }
 
+void imv_window_watch_fd(struct imv_window *window, int fd)
+{
+  window->watch_fd = fd;
+}
+
 void imv_window_push_event(struct imv_window *window, struct imv_event *e)
 {
-  /* Push it down the pipe */
-  write(window->pipe_fds[1], e, sizeof *e);
+  imv_event_queue_push(window->events, e);
 }
 
 void imv_window_pump_events(struct imv_window *window, imv_event_handler handler, void *data)
 {
   wl_display_dispatch_pending(window->wl_display);
 
-  while (1) {
-    struct imv_event e;
-    ssize_t len = read(window->pipe_fds[0], &e, sizeof e);
-    if (len <= 0) {
-      break;
-    }
-    assert(len == sizeof e);
+  struct imv_event e;
+  while (imv_event_queue_pop(window->events, &e)) {
     if (handler) {
       handler(data, &e);
     }
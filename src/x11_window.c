@@ -2,7 +2,6 @@
 
 #include <assert.h>
 #include <fcntl.h>
-#include <limits.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +15,7 @@
 #include <xcb/xcb.h>
 #include <xkbcommon/xkbcommon-x11.h>
 
+#include "event_queue.h"
 #include "keyboard.h"
 #include "log.h"
 
@@ -40,17 +40,11 @@ struct imv_window {
   } pointer;
 
   struct imv_keyboard *keyboard;
-  int pipe_fds[2];
-};
+  struct imv_event_queue *events;
 
-static void set_nonblocking(int fd)
-{
-  int flags = fcntl(fd, F_GETFL);
-  assert(flags != -1);
-  flags |= O_NONBLOCK;
-  int rc = fcntl(fd, F_SETFL, flags);
-  assert(rc != -1);
-}
+  /* an extra fd to wake up for, or -1 */
+  int watch_fd;
+};
 
 static void setup_keymap(struct imv_window *window)
 {
@@ -95,15 +89,12 @@ static void setup_keymap(struct imv_window *window)
 
 struct imv_window *imv_window_create(int w, int h, const char *title)
 {
-  /* Ensure event writes will always be atomic */
-  assert(sizeof(struct imv_event) <= PIPE_BUF);
-
   struct imv_window *window = calloc(1, sizeof *window);
   window->pointer.last.x = -1;
   window->pointer.last.y = -1;
-  pipe(window->pipe_fds);
-  set_nonblocking(window->pipe_fds[0]);
-  set_nonblocking(window->pipe_fds[1]);
+  window->events = imv_event_queue_create();
+  assert(window->events);
+  window->watch_fd = -1;
 
   window->x_display = XOpenDisplay(NULL);
   assert(window->x_display);
@@ -164,8 +155,7 @@ struct imv_window *imv_window_create(int w, int h, const char *title)
 void imv_window_free(struct imv_window *window)
 {
   imv_keyboard_free(window->keyboard);
-  close(window->pipe_fds[0]);
-  close(window->pipe_fds[1]);
+  imv_event_queue_free(window->events);
   glXMakeCurrent(window->x_display, None, NULL);
   glXDestroyContext(window->x_display, window->x_glc);
   XDestroyWindow(window->x_display, window->x_window);
@@ -275,19 +265,30 @@ void imv_window_present(struct imv_window *window)
 
 void imv_window_wait_for_event(struct imv_window *window, double timeout)
 {
+  /* round trips made since the last pump, such as querying a property, can
+   * leave events queued by Xlib that polling the connection won't see */
+  if (XEventsQueued(window->x_display, QueuedAfterFlush) > 0) {
+    return;
+  }
+
   struct pollfd fds[] = {
     {.fd = ConnectionNumber(window->x_display), .events = POLLIN},
-    {.fd = window->pipe_fds[0], .events = POLLIN}
+    {.fd = imv_event_queue_fd(window->events), .events = POLLIN},
+    {.fd = window->watch_fd, .events = POLLIN}
   };
   nfds_t nfds = sizeof fds / sizeof *fds;
 
-  poll(fds, nfds, timeout * 1000);
+  poll(fds, nfds, timeout < 0 ? -1 : (int)(timeout * 1000));
+}
+
+void imv_window_watch_fd(struct imv_window *window, int fd)
+{
+  window->watch_fd = fd;
 }
 
 void imv_window_push_event(struct imv_window *window, struct imv_event *e)
 {
-  /* Push it down the pipe */
-  write(window->pipe_fds[1], e, sizeof *e);
+  imv_event_queue_push(window->events, e);
 }
 
 static void handle_keyboard(struct imv_window *window, imv_event_handler handler, void *data, const XEvent *xev)
@@ -428,14 +429,9 @@ void imv_window_pump_events(struct imv_window *window, imv_event_handler handler
     }
   }
 
-  /* Handle any events in the pipe */
-  while (1) {
-    struct imv_event e;
-    ssize_t len = read(window->pipe_fds[0], &e, sizeof e);
-    if (len <= 0) {
-      break;
-    }
-    assert(len == sizeof e);
+  /* Handle any events pushed from elsewhere */
+  struct imv_event e;
+  while (imv_event_queue_pop(window->events, &e)) {
     if (handler) {
       handler(data, &e);
     }
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "navigator.h"
+
+/* Measures how quickly paths can be added to, looked up in and sorted by the
+ * navigator, and how much memory each one costs. Run with meson test --benchmark, or
+ * directly with the number of paths to use. */
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long max_rss_kb(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+int main(int argc, char **argv)
+{
+  const size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  char path[128];
+
+  const long rss_before = max_rss_kb();
+  struct imv_navigator *nav = imv_navigator_create();
+
+  /* These don't exist, so they're stored as given without touching the disk
+   * beyond the first component */
+  double start = now();
+  for (size_t i = 0; i < count; ++i) {
+    snprintf(path, sizeof path, "imv-bench/dir%zu/IMG_%08zu.jpg", i / 1000, i);
+    imv_navigator_add(nav, path, 0);
+  }
+  const double add_time = now() - start;
+  const long rss_after = max_rss_kb();
+
+  start = now();
+  size_t found = 0;
+  for (size_t i = 0; i < count; i += 7) {
+    snprintf(path, sizeof path, "IMG_%08zu.jpg", i);
+    found += imv_navigator_find_path(nav, path) == (ssize_t)i;
+  }
+  const double find_time = now() - start;
+
+  /* The first natural sort has to compare the paths, later ones don't */
+  start = now();
+  imv_navigator_sort(nav, IMV_SORT_NATURAL, true, 0);
+  const double first_sort_time = now() - start;
+  start = now();
+  imv_navigator_sort(nav, IMV_SORT_RANDOM, false, 1);
+  const double random_time = now() - start;
+  start = now();
+  imv_navigator_sort(nav, IMV_SORT_NATURAL, false, 0);
+  const double sort_time = now() - start;
+
+  start = now();
+  for (size_t i = 0; i < count; i += 2) {
+    snprintf(path, sizeof path, "imv-bench/dir%zu/IMG_%08zu.jpg", i / 1000, i);
+    imv_navigator_remove(nav, path);
+  }
+  const double remove_time = now() - start;
+
+  printf("paths:          %zu\n", count);
+  printf("add:            %.0f paths/s\n", count / add_time);
+  printf("memory:         %.1f bytes/path\n",
+      (rss_after - rss_before) * 1024.0 / count);
+  printf("find by name:   %.0f lookups/s\n", (count / 7 + 1) / find_time);
+  printf("first sort:     %.1f ms\n", first_sort_time * 1000);
+  printf("shuffle:        %.1f ms\n", random_time * 1000);
+  printf("re-sort:        %.1f ms\n", sort_time * 1000);
+  printf("remove:         %.0f paths/s\n", (count / 2) / remove_time);
+
+  const size_t remaining = imv_navigator_length(nav);
+  imv_navigator_free(nav);
+
+  if (found != (count + 6) / 7 || remaining != count / 2) {
+    fprintf(stderr, "navigator returned the wrong results\n");
+    return 1;
+  }
+  return 0;
+}
+
+/* vim:set ts=2 sts=2 sw=2 et: */